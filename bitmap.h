@@ -14,21 +14,24 @@
 #include "ouichefs.h"
 
 /*
- * Return the first free bit (set to 1) in a given in-memory bitmap spanning
- * over multiple blocks and clear it.
+ * Return the first free bit (set to 1) at or after start in a given in-memory
+ * bitmap spanning over multiple blocks, wrapping around, and clear it.
  * Return 0 if no free bit found (we assume that the first bit is never free
  * because of the superblock and the root inode, thus allowing us to use 0 as an
  * error value).
  */
 static __always_inline uint32_t get_first_free_bit(unsigned long *freemap,
 						   unsigned long size,
+						   unsigned long start,
 						   uint32_t *sb_counter,
 						   spinlock_t *lock)
 {
 	uint32_t ino;
 
 again:
-	ino = find_first_bit(freemap, size);
+	ino = find_next_bit(freemap, size, start);
+	if (ino == size && start)
+		ino = find_first_bit(freemap, size);
 	if (ino == size)
 		return 0;
 
@@ -45,24 +48,56 @@ again:
 	return ino;
 }
 
+/*
+ * Records that the bitmap block holding bit changed, either in the running
+ * journal transaction or for the next sync.
+ */
+static inline void mark_bitmap_dirty(struct ouichefs_sb_info *sbi,
+				     unsigned long *dirty, uint32_t start,
+				     uint32_t bit)
+{
+	set_bit(bit / sbi->bits_per_block, dirty);
+	ouichefs_journal_bitmap(sbi, start + bit / sbi->bits_per_block);
+}
+
 /*
  * Return an unused inode number and mark it used.
  * Return 0 if no free inode was found.
  */
 static inline uint32_t get_free_inode(struct ouichefs_sb_info *sbi)
 {
-	return get_first_free_bit(sbi->ifree_bitmap, sbi->nr_inodes,
-				  &sbi->nr_free_inodes, &sbi->ifree_lock);
+	uint32_t ino = get_first_free_bit(sbi->ifree_bitmap, sbi->nr_inodes, 0,
+					  &sbi->nr_free_inodes,
+					  &sbi->ifree_lock);
+
+	if (ino)
+		mark_bitmap_dirty(sbi, sbi->ifree_dirty,
+				  OUICHEFS_GET_IFREE_START(sbi), ino);
+	return ino;
 }
 
 /*
- * Return an unused block number and mark it used.
+ * Return an unused block number and mark it used. With the group layout,
+ * blocks of the group of goal are preferred.
  * Return 0 if no free block was found.
  */
-static inline uint32_t get_free_block(struct ouichefs_sb_info *sbi)
+static inline uint32_t get_free_block(struct ouichefs_sb_info *sbi,
+				      uint32_t goal)
 {
-	return get_first_free_bit(sbi->bfree_bitmap, sbi->nr_blocks,
-				  &sbi->nr_free_blocks, &sbi->bfree_lock);
+	unsigned long start = 0;
+	uint32_t bno;
+
+	if (sbi->layout == OUICHEFS_LAYOUT_GROUPS &&
+	    goal >= OUICHEFS_GET_DATA_START(sbi) && goal < sbi->nr_blocks)
+		start = OUICHEFS_GET_GROUP_START(goal, sbi);
+
+	bno = get_first_free_bit(sbi->bfree_bitmap, sbi->nr_blocks, start,
+				 &sbi->nr_free_blocks, &sbi->bfree_lock);
+
+	if (bno)
+		mark_bitmap_dirty(sbi, sbi->bfree_dirty,
+				  OUICHEFS_GET_BFREE_START(sbi), bno);
+	return bno;
 }
 
 /*
@@ -71,10 +106,20 @@ static inline uint32_t get_free_block(struct ouichefs_sb_info *sbi)
  */
 static inline uint32_t get_free_id_entry(struct ouichefs_sb_info *sbi)
 {
-	return get_first_free_bit(sbi->idfree_bitmap,
-				  sbi->nr_inode_data_entries,
-				  &sbi->nr_free_inode_data_entries,
-				  &sbi->idfree_lock);
+	uint32_t idx;
+
+	if (unlikely(!smp_load_acquire(&sbi->idfree_bitmap)) &&
+	    ouichefs_load_idfree(sbi))
+		return 0;
+
+	idx = get_first_free_bit(sbi->idfree_bitmap, sbi->nr_inode_data_entries,
+				 0, &sbi->nr_free_inode_data_entries,
+				 &sbi->idfree_lock);
+
+	if (idx)
+		mark_bitmap_dirty(sbi, sbi->idfree_dirty,
+				  OUICHEFS_GET_IDFREE_START(sbi), idx);
+	return idx;
 }
 
 /*
@@ -105,18 +150,25 @@ static inline void put_inode(struct ouichefs_sb_info *sbi, uint32_t ino)
 			 &sbi->nr_free_inodes, &sbi->ifree_lock)) {
 		return;
 	}
+	mark_bitmap_dirty(sbi, sbi->ifree_dirty, OUICHEFS_GET_IFREE_START(sbi),
+			  ino);
 	pr_debug("%s:%d: freed inode %u\n", __func__, __LINE__, ino);
 }
 
 /*
- * Mark a block as unused.
+ * Mark a block as unused. With a journal, the block only becomes available
+ * once the running transaction is committed.
  */
 static inline void put_block(struct ouichefs_sb_info *sbi, uint32_t bno)
 {
+	if (ouichefs_journal_defer_free(sbi, bno))
+		return;
 	if (put_free_bit(sbi->bfree_bitmap, sbi->nr_blocks, bno,
 			 &sbi->nr_free_blocks, &sbi->bfree_lock)) {
 		return;
 	}
+	mark_bitmap_dirty(sbi, sbi->bfree_dirty, OUICHEFS_GET_BFREE_START(sbi),
+			  bno);
 	pr_debug("%s:%d: freed block %u\n", __func__, __LINE__, bno);
 }
 
@@ -125,11 +177,19 @@ static inline void put_block(struct ouichefs_sb_info *sbi, uint32_t bno)
  */
 static inline void put_inode_data_entry(struct ouichefs_sb_info *sbi, uint32_t idx)
 {
+	if (unlikely(!smp_load_acquire(&sbi->idfree_bitmap)) &&
+	    ouichefs_load_idfree(sbi)) {
+		pr_warn("%s:%d: leaking inode data entry %u\n", __func__,
+			__LINE__, idx);
+		return;
+	}
 	if (put_free_bit(sbi->idfree_bitmap, sbi->nr_inode_data_entries,
 			 idx, &sbi->nr_free_inode_data_entries,
 			 &sbi->idfree_lock)) {
 		return;
 	}
+	mark_bitmap_dirty(sbi, sbi->idfree_dirty,
+			  OUICHEFS_GET_IDFREE_START(sbi), idx);
 	pr_debug("%s:%d: freed inode data entry %u\n", __func__, __LINE__, idx);
 }
 
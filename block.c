@@ -12,6 +12,7 @@
 #include <linux/buffer_head.h>
 
 #include "ouichefs.h"
+#include "ouichefs_trace.h"
 #include "bitmap.h"
 
 /*
@@ -19,8 +20,9 @@
  * the bitmap and sets the reference counter.
  * If this function succeeds, the number of the allocated block is written into
  * bno and 0 is returned, otherwise the return value is negative.
+ * goal is a block the new one should be close to, or 0.
  */
-int ouichefs_alloc_block(struct super_block *sb, uint32_t *out)
+int ouichefs_alloc_block(struct super_block *sb, uint32_t *out, uint32_t goal)
 {
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct buffer_head *bh = NULL;
@@ -28,15 +30,17 @@ int ouichefs_alloc_block(struct super_block *sb, uint32_t *out)
 	uint32_t bno = 0;
 
 	/* Get a new, free data block */
-	bno = get_free_block(sbi);
-	if (!bno)
+	bno = get_free_block(sbi, goal);
+	if (!bno) {
+		trace_ouichefs_alloc_block(sb, goal, 0, -ENOSPC);
 		return -ENOSPC;
+	}
 
 	pr_debug("Allocating block %u (meta %u)\n", bno,
 		OUICHEFS_GET_META_BLOCK(bno, sbi));
 
 	/* Open corresponding metadata block */
-	bh = sb_bread(sb, OUICHEFS_GET_META_BLOCK(bno, sbi));
+	bh = ouichefs_bread(sb, OUICHEFS_GET_META_BLOCK(bno, sbi));
 	if (unlikely(!bh)) {
 		pr_err("Failed to open metadata block for data block %d\n", bno);
 		return -EIO;
@@ -48,15 +52,46 @@ int ouichefs_alloc_block(struct super_block *sb, uint32_t *out)
 	pr_debug("Refcount of %u: %u -> %u\n", bno,
 		 mb->refcount[OUICHEFS_GET_META_SHIFT(bno)], 1);
 	mb->refcount[OUICHEFS_GET_META_SHIFT(bno)] = 1;
-	mark_buffer_dirty(bh);
+	ouichefs_journal_dirty(sb, bh);
 	unlock_buffer(bh);
 	brelse(bh);
+	trace_ouichefs_alloc_block(sb, goal, bno, 0);
+	ouichefs_stat_inc(sbi, OUICHEFS_STAT_ALLOC);
 
 	/* Return new block */
 	*out = bno;
 	return 0;
 }
 
+/*
+ * Same as ouichefs_alloc_block(), but the new block is guaranteed to be
+ * zeroed. Without a journal, blocks are already zeroed when they are freed.
+ * With a journal, they are zeroed on disk once the transaction freeing them
+ * is committed, but the buffer cache may still hold their old content.
+ */
+int ouichefs_alloc_zeroed_block(struct super_block *sb, uint32_t *out)
+{
+	struct buffer_head *bh;
+	int ret;
+
+	ret = ouichefs_alloc_block(sb, out, 0);
+	if (ret < 0 || !OUICHEFS_SB(sb)->journal)
+		return ret;
+
+	bh = sb_getblk(sb, *out);
+	if (unlikely(!bh)) {
+		ouichefs_put_block(sb, *out, OUICHEFS_DATA);
+		return -EIO;
+	}
+	lock_buffer(bh);
+	memset(bh->b_data, 0, sb->s_blocksize);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	ouichefs_journal_dirty(sb, bh);
+	brelse(bh);
+	return 0;
+}
+
 /*
  * Increments the reference counter for the given, already used data block
  */
@@ -67,13 +102,14 @@ int ouichefs_get_block(struct super_block *sb, uint32_t bno)
 	struct ouichefs_metadata_block *mb;
 
 	/* Sanity check */
-	if (unlikely(bno < OUICHEFS_GET_DATA_START(sbi))) {
+	if (unlikely(bno < OUICHEFS_GET_DATA_START(sbi) ||
+		     OUICHEFS_IS_META_BLOCK(bno, sbi))) {
 		pr_warn("Invalid data block number: %d\n", bno);
 		return -EINVAL;
 	}
 
 	/* Open corresponding metadata block */
-	bh = sb_bread(sb, OUICHEFS_GET_META_BLOCK(bno, sbi));
+	bh = ouichefs_bread(sb, OUICHEFS_GET_META_BLOCK(bno, sbi));
 	if (unlikely(!bh)) {
 		pr_err("Failed to open metadata block for data block %d\n", bno);
 		return -EIO;
@@ -86,7 +122,10 @@ int ouichefs_get_block(struct super_block *sb, uint32_t bno)
 		 mb->refcount[OUICHEFS_GET_META_SHIFT(bno)],
 		 mb->refcount[OUICHEFS_GET_META_SHIFT(bno)] + 1);
 	mb->refcount[OUICHEFS_GET_META_SHIFT(bno)] += 1;
-	mark_buffer_dirty(bh);
+	trace_ouichefs_get_block(sb, bno,
+				 mb->refcount[OUICHEFS_GET_META_SHIFT(bno)]);
+	ouichefs_stat_inc(sbi, OUICHEFS_STAT_REF_INC);
+	ouichefs_journal_dirty(sb, bh);
 	unlock_buffer(bh);
 	brelse(bh);
 
@@ -102,27 +141,32 @@ int ouichefs_get_block(struct super_block *sb, uint32_t bno)
  * If this block is an index block (is_index_block), then the reference
  * count of all it's referenced blocks are updated as well.
  *
+ * The copy is charged to inode, the file or directory the block belongs to.
+ *
  * Return value: negative on error, 0 if nothing was done, 1 if a new
  * block has been allocated
  */
-int ouichefs_cow_block(struct super_block *sb, uint32_t *bno,
+int ouichefs_cow_block(struct inode *inode, uint32_t *bno,
 		       enum ouichefs_datablock_type b_type)
 {
+	struct super_block *sb = inode->i_sb;
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct buffer_head *bh1 = NULL, *bh2 = NULL, *bh1meta = NULL;
 	struct ouichefs_metadata_block *mb;
 	struct ouichefs_file_index_block *index;
 	uint32_t old_bno = *bno, new_bno;
+	unsigned int refcount;
 	int ret;
 
 	/* Sanity check */
-	if (unlikely(old_bno < OUICHEFS_GET_DATA_START(sbi))) {
+	if (unlikely(old_bno < OUICHEFS_GET_DATA_START(sbi) ||
+		     OUICHEFS_IS_META_BLOCK(old_bno, sbi))) {
 		pr_warn("Invalid data block number: %d\n", old_bno);
 		return -EINVAL;
 	}
 
 	/* Open corresponding metadata block */
-	bh1meta = sb_bread(sb, OUICHEFS_GET_META_BLOCK(old_bno, sbi));
+	bh1meta = ouichefs_bread(sb, OUICHEFS_GET_META_BLOCK(old_bno, sbi));
 	if (unlikely(!bh1meta)) {
 		pr_err("Failed to open metadata block for data block %d\n", old_bno);
 		return -EIO;
@@ -131,7 +175,9 @@ int ouichefs_cow_block(struct super_block *sb, uint32_t *bno,
 	mb = (struct ouichefs_metadata_block *)bh1meta->b_data;
 
 	/* Only one reference; We can modify this block; Return! */
-	if (mb->refcount[OUICHEFS_GET_META_SHIFT(old_bno)] == 1) {
+	refcount = mb->refcount[OUICHEFS_GET_META_SHIFT(old_bno)];
+	if (refcount == 1) {
+		trace_ouichefs_cow_block(sb, old_bno, old_bno, b_type, refcount);
 		pr_debug("Refcount of %u is 1: No copy needed.\n", old_bno);
 		unlock_buffer(bh1meta);
 		brelse(bh1meta);
@@ -139,9 +185,8 @@ int ouichefs_cow_block(struct super_block *sb, uint32_t *bno,
 	}
 
 	/* We are not the sole owner of this data */
-	pr_debug("Refcount of %u is %u: CoWing it!\n", old_bno,
-		mb->refcount[OUICHEFS_GET_META_SHIFT(old_bno)]);
-	bh1 = sb_bread(sb, old_bno);
+	pr_debug("Refcount of %u is %u: CoWing it!\n", old_bno, refcount);
+	bh1 = ouichefs_bread(sb, old_bno);
 	if (unlikely(!bh1)) {
 		unlock_buffer(bh1meta);
 		brelse(bh1meta);
@@ -153,7 +198,8 @@ int ouichefs_cow_block(struct super_block *sb, uint32_t *bno,
 	 * Decrement reference counter of original data
 	 */
 	mb->refcount[OUICHEFS_GET_META_SHIFT(old_bno)] -= 1;
-	mark_buffer_dirty(bh1meta);
+	ouichefs_stat_inc(sbi, OUICHEFS_STAT_REF_DEC);
+	ouichefs_journal_dirty(sb, bh1meta);
 	unlock_buffer(bh1meta);
 	brelse(bh1meta);
 
@@ -162,13 +208,13 @@ int ouichefs_cow_block(struct super_block *sb, uint32_t *bno,
 	 * This is safe now since the metadata block of old_bno is no longer
 	 * locked (old_bno and new_bno might reside in the same metadata block)
 	 */
-	ret = ouichefs_alloc_block(sb, &new_bno);
+	ret = ouichefs_alloc_block(sb, &new_bno, old_bno);
 	if (unlikely(ret < 0)) {
 		unlock_buffer(bh1);
 		brelse(bh1);
 		return ret;
 	}
-	bh2 = sb_bread(sb, new_bno);
+	bh2 = ouichefs_bread(sb, new_bno);
 	if (unlikely(!bh2)) {
 		pr_err("Failed to open newly-allocated data block %u!\n", new_bno);
 		ouichefs_put_block(sb, new_bno, OUICHEFS_DATA);
@@ -181,16 +227,21 @@ int ouichefs_cow_block(struct super_block *sb, uint32_t *bno,
 	 * Copy data and release the new block; We may need to read the data,
 	 * so keep the old block here for now
 	 */
-	memcpy(bh2->b_data, bh1->b_data, OUICHEFS_BLOCK_SIZE);
-	mark_buffer_dirty(bh2);
-	sync_dirty_buffer(bh2);
+	memcpy(bh2->b_data, bh1->b_data, sb->s_blocksize);
+	if (b_type == OUICHEFS_DATA) {
+		/* File data is never journaled */
+		mark_buffer_dirty(bh2);
+		ouichefs_sync_buffer(sb, bh2);
+	} else {
+		ouichefs_journal_dirty_sync(sb, bh2);
+	}
 	brelse(bh2);
 
 	/* Handle block types */
 	switch (b_type) {
 	case OUICHEFS_INDEX:
 		index = (struct ouichefs_file_index_block *)bh1->b_data;
-		for (int i = 0; i < OUICHEFS_INDEX_BLOCK_LEN; i++) {
+		for (int i = 0; i < sbi->index_len; i++) {
 			if (!index->blocks[i])
 				break;
 			/* Safety: No metadata blocks are currently locked */
@@ -206,6 +257,9 @@ int ouichefs_cow_block(struct super_block *sb, uint32_t *bno,
 	/* Finally release the old data block and point bno to the new block */
 	unlock_buffer(bh1);
 	brelse(bh1);
+	trace_ouichefs_cow_block(sb, old_bno, new_bno, b_type, refcount);
+	ouichefs_stat_inc(sbi, OUICHEFS_STAT_COW_DATA + b_type);
+	ouichefs_wa_add(inode, OUICHEFS_WA_COW_DATA + b_type, 1);
 	*bno = new_bno;
 	return 1;
 }
@@ -225,13 +279,14 @@ void ouichefs_put_block(struct super_block *sb, uint32_t bno,
 	bool free_data = false;
 
 	/* Sanity check */
-	if (unlikely(bno < OUICHEFS_GET_DATA_START(sbi))) {
+	if (unlikely(bno < OUICHEFS_GET_DATA_START(sbi) ||
+		     OUICHEFS_IS_META_BLOCK(bno, sbi))) {
 		pr_warn("Invalid data block number: %d\n", bno);
 		return;
 	}
 
 	/* Open corresponding metadata block */
-	bh = sb_bread(sb, OUICHEFS_GET_META_BLOCK(bno, sbi));
+	bh = ouichefs_bread(sb, OUICHEFS_GET_META_BLOCK(bno, sbi));
 	if (unlikely(!bh)) {
 		pr_err("Failed to open metadata block for data block %d\n", bno);
 		return;
@@ -253,7 +308,10 @@ void ouichefs_put_block(struct super_block *sb, uint32_t bno,
 		 mb->refcount[OUICHEFS_GET_META_SHIFT(bno)],
 		 mb->refcount[OUICHEFS_GET_META_SHIFT(bno)] - 1);
 	mb->refcount[OUICHEFS_GET_META_SHIFT(bno)] -= 1;
-	mark_buffer_dirty(bh);
+	trace_ouichefs_put_block(sb, bno, b_type,
+				 mb->refcount[OUICHEFS_GET_META_SHIFT(bno)]);
+	ouichefs_stat_inc(sbi, OUICHEFS_STAT_REF_DEC);
+	ouichefs_journal_dirty(sb, bh);
 	unlock_buffer(bh);
 	brelse(bh);
 
@@ -263,7 +321,7 @@ void ouichefs_put_block(struct super_block *sb, uint32_t bno,
 	 * to access it anyway.
 	 */
 	if (free_data) {
-		bh2 = sb_bread(sb, bno);
+		bh2 = ouichefs_bread(sb, bno);
 		if (unlikely(!bh2))
 			return; // Failed to open data block; Consider it "free"
 
@@ -271,7 +329,7 @@ void ouichefs_put_block(struct super_block *sb, uint32_t bno,
 		switch (b_type) {
 		case OUICHEFS_INDEX:
 			index = (struct ouichefs_file_index_block *)bh2->b_data;
-			for (int i = 0; i < OUICHEFS_INDEX_BLOCK_LEN; i++) {
+			for (int i = 0; i < sbi->index_len; i++) {
 				if (!index->blocks[i])
 					break;
 				/* Safety: No metadata blocks are currently locked */
@@ -285,11 +343,18 @@ void ouichefs_put_block(struct super_block *sb, uint32_t bno,
 			break;
 		}
 
-		/* Zero-out the block */
-		memset(bh2->b_data, 0, OUICHEFS_BLOCK_SIZE);
-		mark_buffer_dirty(bh2);
+		/*
+		 * Zero-out the block, see ouichefs_alloc_zeroed_block(). The
+		 * journal does it after the commit, the old content must stay
+		 * until then.
+		 */
+		if (!sbi->journal) {
+			memset(bh2->b_data, 0, sb->s_blocksize);
+			mark_buffer_dirty(bh2);
+		}
 		brelse(bh2);
 		put_block(sbi, bno);
+		ouichefs_stat_inc(sbi, OUICHEFS_STAT_FREE);
 		pr_debug("Freed block %u\n", bno);
 	}
 }
@@ -0,0 +1,423 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/mount.h>
+#include <linux/namei.h>
+#include <linux/slab.h>
+#include <linux/buffer_head.h>
+#include <linux/pagemap.h>
+
+#include "ouichefs.h"
+
+/*
+ * A directory of the clone whose entries still have to be cloned from the
+ * source directory. Once done, it waits for the statistics of its
+ * subdirectories to be added up.
+ */
+struct ouichefs_clone_work {
+	struct list_head list;
+	struct inode *src;
+	struct inode *dst;
+	struct inode *parent; /* Clone directory above dst, NULL for the top */
+};
+
+/* Adds usage to the recursive statistics of the clone directory dir */
+static void ouichefs_clone_account(struct inode *dir,
+				   const struct ouichefs_dir_stats *usage)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(dir->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+
+	spin_lock(&sbi->dstats_lock);
+	ci->r_stats.bytes += usage->bytes;
+	ci->r_stats.blocks += usage->blocks;
+	ci->r_stats.files += usage->files;
+	spin_unlock(&sbi->dstats_lock);
+}
+
+static void ouichefs_clone_attrs(struct inode *dst, struct inode *src)
+{
+	dst->i_mode = src->i_mode;
+	i_uid_write(dst, i_uid_read(src));
+	i_gid_write(dst, i_gid_read(src));
+	i_size_write(dst, i_size_read(src));
+	dst->i_blocks = src->i_blocks;
+	dst->i_atime = src->i_atime;
+	dst->i_mtime = src->i_mtime;
+	dst->i_ctime = current_time(dst);
+}
+
+/*
+ * Creates an empty directory in dir with the attributes of src. Directory
+ * blocks embed inode numbers, so they cannot be shared with the source. Its
+ * statistics start at zero and are added up while its entries are cloned.
+ */
+static struct inode *ouichefs_clone_new_dir(struct inode *dir,
+					    struct inode *src)
+{
+	struct ouichefs_handle handle;
+	struct buffer_head *bh;
+	struct inode *inode;
+
+	ouichefs_journal_start(dir->i_sb, &handle);
+	inode = ouichefs_new_inode(dir, S_IFDIR, 0);
+	if (IS_ERR(inode))
+		goto stop;
+
+	/* Scrub the directory block, just like ouichefs_create() does */
+	bh = ouichefs_bread(dir->i_sb, OUICHEFS_INODE(inode)->index_block);
+	if (!bh) {
+		ouichefs_release_inode(inode);
+		clear_nlink(inode);
+		iput(inode);
+		inode = ERR_PTR(-EIO);
+		goto stop;
+	}
+	memset(bh->b_data, 0, dir->i_sb->s_blocksize);
+	ouichefs_journal_dirty(dir->i_sb, bh);
+	brelse(bh);
+
+	ouichefs_clone_attrs(inode, src);
+	mark_inode_dirty(inode);
+stop:
+	ouichefs_journal_stop(&handle);
+	return inode;
+}
+
+/*
+ * Clones a regular file by sharing its index block, so no data or index
+ * block is copied until one of both files is written to.
+ */
+static struct inode *ouichefs_clone_file(struct inode *dir, struct inode *src)
+{
+	struct ouichefs_handle handle;
+	struct inode *inode;
+	int ret;
+
+	inode_lock_shared(src);
+
+	/* The index block on disk must reflect the page cache */
+	ret = filemap_write_and_wait(src->i_mapping);
+	if (ret) {
+		inode = ERR_PTR(ret);
+		goto unlock;
+	}
+
+	ouichefs_journal_start(dir->i_sb, &handle);
+	inode = ouichefs_new_inode(dir, src->i_mode,
+				   OUICHEFS_INODE(src)->index_block);
+	if (!IS_ERR(inode)) {
+		ouichefs_clone_attrs(inode, src);
+		mark_inode_dirty(inode);
+	}
+	ouichefs_journal_stop(&handle);
+
+unlock:
+	inode_unlock_shared(src);
+	return inode;
+}
+
+/*
+ * Fills the clone directory w->dst with clones of all entries of w->src.
+ * Subdirectories are created empty and queued on todo. The regular files
+ * are accounted in w->dst right away, the subdirectories once they are done.
+ * Only w->src is locked, and the files in it one at a time.
+ */
+static int ouichefs_clone_dir(struct ouichefs_clone_work *w,
+			      struct list_head *todo)
+{
+	struct super_block *sb = w->src->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_dir_block *src_block, *dst_block;
+	struct buffer_head *src_bh, *dst_bh;
+	struct ouichefs_clone_work *sub;
+	struct ouichefs_dir_stats usage;
+	struct ouichefs_handle handle;
+	struct inode *child, *clone;
+	int i, ret = 0;
+
+	inode_lock_shared(w->src);
+	src_bh = ouichefs_bread(sb, OUICHEFS_INODE(w->src)->index_block);
+	if (!src_bh) {
+		ret = -EIO;
+		goto unlock;
+	}
+	dst_bh = ouichefs_bread(sb, OUICHEFS_INODE(w->dst)->index_block);
+	if (!dst_bh) {
+		ret = -EIO;
+		goto release_src;
+	}
+	src_block = (struct ouichefs_dir_block *)src_bh->b_data;
+	dst_block = (struct ouichefs_dir_block *)dst_bh->b_data;
+
+	for (i = 0; i < sbi->max_subfiles; i++) {
+		if (src_block->files[i].inode == 0)
+			break;
+
+		child = ouichefs_iget(sb, src_block->files[i].inode, false);
+		if (IS_ERR(child)) {
+			ret = PTR_ERR(child);
+			break;
+		}
+
+		sub = NULL;
+		if (S_ISDIR(child->i_mode)) {
+			sub = kmalloc(sizeof(*sub), GFP_KERNEL);
+			if (!sub) {
+				iput(child);
+				ret = -ENOMEM;
+				break;
+			}
+			clone = ouichefs_clone_new_dir(w->dst, child);
+		} else {
+			clone = ouichefs_clone_file(w->dst, child);
+		}
+		if (IS_ERR(clone)) {
+			kfree(sub);
+			iput(child);
+			ret = PTR_ERR(clone);
+			break;
+		}
+
+		/* Register the clone under the same name */
+		ouichefs_journal_start(sb, &handle);
+		dst_block->files[i].inode = clone->i_ino;
+		memcpy(dst_block->files[i].filename,
+		       src_block->files[i].filename, OUICHEFS_FILENAME_LEN);
+
+		ouichefs_journal_dirty(sb, dst_bh);
+		if (sub)
+			inode_inc_link_count(w->dst);
+		ouichefs_journal_stop(&handle);
+
+		if (sub) {
+			sub->src = child;
+			sub->dst = clone;
+			sub->parent = w->dst;
+			list_add_tail(&sub->list, todo);
+		} else {
+			ouichefs_inode_usage(clone, &usage);
+			ouichefs_clone_account(w->dst, &usage);
+			iput(child);
+			iput(clone);
+		}
+	}
+
+	/* Even on failure, keep what was cloned so far consistent */
+	brelse(dst_bh);
+	mark_inode_dirty(w->dst);
+release_src:
+	brelse(src_bh);
+unlock:
+	inode_unlock_shared(w->src);
+	return ret;
+}
+
+/*
+ * Adds the complete clone inode to dir. This makes the whole clone visible
+ * at once.
+ */
+static int ouichefs_clone_link(struct inode *dir, struct inode *inode,
+			       const char *name)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_dir_block *dblock;
+	struct buffer_head *bh;
+	uint32_t dir_index_block = OUICHEFS_INODE(dir)->index_block;
+	int i, ret;
+
+	/* Check that we can modify the directory block, clone it otherwise */
+	ret = ouichefs_cow_block(dir, &dir_index_block, OUICHEFS_DIR);
+	if (unlikely(ret < 0))
+		return ret;
+
+	bh = ouichefs_bread(sb, dir_index_block);
+	if (unlikely(!bh)) {
+		ret = -EIO;
+		goto failed;
+	}
+	dblock = (struct ouichefs_dir_block *)bh->b_data;
+
+	/* Find first free slot in parent index and register the clone */
+	for (i = 0; i < sbi->max_subfiles; i++)
+		if (dblock->files[i].inode == 0)
+			break;
+	if (i == sbi->max_subfiles) {
+		brelse(bh);
+		ret = -EMLINK;
+		goto failed;
+	}
+	dblock->files[i].inode = inode->i_ino;
+	strscpy(dblock->files[i].filename, name, OUICHEFS_FILENAME_LEN);
+	ouichefs_journal_dirty(sb, bh);
+	brelse(bh);
+	mark_inode_dirty(inode);
+
+	dir->i_mtime = dir->i_atime = dir->i_ctime = current_time(dir);
+	inode_inc_link_count(dir);
+	OUICHEFS_INODE(dir)->index_block = dir_index_block;
+	mark_inode_dirty(dir);
+	return 0;
+
+failed:
+	if (dir_index_block != OUICHEFS_INODE(dir)->index_block)
+		ouichefs_put_block(sb, dir_index_block, OUICHEFS_DIR);
+	return ret;
+}
+
+/*
+ * Clones the directory opened as src_file recursively into the directory
+ * opened as file, under the given name. Regular files share their index
+ * blocks with the source through the block refcounts; only inodes and
+ * directory blocks are created. The walk is O(N) in the number of entries
+ * of the source tree.
+ *
+ * The clone is built detached, without holding dir: the walk only locks one
+ * source directory at a time, and the files in it, so it cannot deadlock
+ * with a rename or with a clone in the opposite direction. dir is locked to
+ * link the clone in last. On failure, the partial clone is handed to the
+ * reclaim worker.
+ */
+int ouichefs_clone_tree(struct file *file, struct file *src_file,
+			const char *name)
+{
+	struct dentry *parent = file->f_path.dentry;
+	struct inode *dir = d_inode(parent);
+	struct inode *src = file_inode(src_file);
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_clone_work *w, *tmp;
+	struct ouichefs_dir_stats usage;
+	struct ouichefs_handle handle;
+	struct dentry *dentry;
+	struct inode *top;
+	LIST_HEAD(todo);
+	LIST_HEAD(done);
+	int ret;
+
+	if (!S_ISDIR(dir->i_mode) || !S_ISDIR(src->i_mode))
+		return -ENOTDIR;
+	if (src->i_sb != sb)
+		return -EXDEV;
+	if (strlen(name) > OUICHEFS_FILENAME_LEN)
+		return -ENAMETOOLONG;
+
+	/* A partial clone is detached on failure, see ouichefs_rmtree() */
+	down_read(&OUICHEFS_SB(sb)->detach_rwsem);
+	ret = mnt_want_write_file(file);
+	if (ret)
+		goto up;
+
+	/* A directory cannot be cloned into its own subtree */
+	if (is_subdir(parent, src_file->f_path.dentry)) {
+		ret = -EINVAL;
+		goto drop_write;
+	}
+
+	/* Fail early, the name is looked up again to link the clone */
+	dentry = lookup_one_len_unlocked(name, parent, strlen(name));
+	if (IS_ERR(dentry)) {
+		ret = PTR_ERR(dentry);
+		goto drop_write;
+	}
+	if (d_really_is_positive(dentry))
+		ret = -EEXIST;
+	dput(dentry);
+	if (ret)
+		goto drop_write;
+
+	top = ouichefs_clone_new_dir(dir, src);
+	if (IS_ERR(top)) {
+		ret = PTR_ERR(top);
+		goto drop_write;
+	}
+
+	w = kmalloc(sizeof(*w), GFP_KERNEL);
+	if (!w) {
+		ret = -ENOMEM;
+		goto discard;
+	}
+	w->src = igrab(src);
+	w->dst = igrab(top);
+	w->parent = NULL;
+	list_add(&w->list, &todo);
+
+	/*
+	 * Breadth-first; drain the list even on failure to drop all refs.
+	 * Each directory goes to the head of done once cloned, so done lists
+	 * every directory before its parent.
+	 */
+	while ((w = list_first_entry_or_null(&todo, struct ouichefs_clone_work,
+					     list))) {
+		if (!ret)
+			ret = ouichefs_clone_dir(w, &todo);
+		iput(w->src);
+		list_move(&w->list, &done);
+		cond_resched();
+	}
+
+	/* Add up the statistics of each directory into its parent */
+	list_for_each_entry_safe(w, tmp, &done, list) {
+		if (!ret && w->parent) {
+			ouichefs_inode_usage(w->dst, &usage);
+			ouichefs_clone_account(w->parent, &usage);
+			mark_inode_dirty(w->parent);
+		}
+		iput(w->dst);
+		kfree(w);
+	}
+	if (ret)
+		goto discard;
+
+	inode_lock_nested(dir, I_MUTEX_PARENT);
+	dentry = lookup_one_len(name, parent, strlen(name));
+	if (IS_ERR(dentry)) {
+		ret = PTR_ERR(dentry);
+		goto unlock_dir;
+	}
+	if (d_really_is_positive(dentry)) {
+		ret = -EEXIST;
+		goto put_dentry;
+	}
+
+	ouichefs_journal_start_credits(sb, &handle,
+				       ouichefs_dir_stats_credits(dentry));
+	ret = ouichefs_clone_link(dir, top, name);
+	if (ret) {
+		ouichefs_journal_stop(&handle);
+		goto put_dentry;
+	}
+
+	/* Account the clone in all directories above it */
+	ouichefs_inode_usage(top, &usage);
+	ouichefs_dir_stats_propagate(dentry, &usage);
+	ouichefs_journal_stop(&handle);
+
+	pr_debug("Cloned ino %lu to ino %lu\n", src->i_ino, top->i_ino);
+	d_instantiate(dentry, top);
+	dput(dentry);
+	inode_unlock(dir);
+	goto drop_write;
+
+put_dentry:
+	dput(dentry);
+unlock_dir:
+	inode_unlock(dir);
+discard:
+	if (ouichefs_reclaim_detached(sb, top->i_ino))
+		pr_warn("Out of memory, leaking partial clone ino %lu\n",
+			top->i_ino);
+	iput(top);
+drop_write:
+	mnt_drop_write_file(file);
+up:
+	up_read(&OUICHEFS_SB(sb)->detach_rwsem);
+	return ret;
+}
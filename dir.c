@@ -23,6 +23,7 @@ static int ouichefs_iterate(struct file *dir, struct dir_context *ctx)
 	struct inode *inode = file_inode(dir);
 	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct buffer_head *bh = NULL;
 	struct ouichefs_dir_block *dblock = NULL;
 	struct ouichefs_file *f = NULL;
@@ -36,7 +37,7 @@ static int ouichefs_iterate(struct file *dir, struct dir_context *ctx)
 	 * Check that ctx->pos is not bigger than what we can handle (including
 	 * . and ..)
 	 */
-	if (ctx->pos > OUICHEFS_MAX_SUBFILES + 2)
+	if (ctx->pos > sbi->max_subfiles + 2)
 		return 0;
 
 	/* Commit . and .. to ctx */
@@ -44,13 +45,13 @@ static int ouichefs_iterate(struct file *dir, struct dir_context *ctx)
 		return 0;
 
 	/* Read the directory index block on disk */
-	bh = sb_bread(sb, ci->index_block);
+	bh = ouichefs_bread_hot(sb, ci->index_block);
 	if (!bh)
 		return -EIO;
 	dblock = (struct ouichefs_dir_block *)bh->b_data;
 
 	/* Iterate over the index block and commit subfiles */
-	for (i = ctx->pos - 2; i < OUICHEFS_MAX_SUBFILES; i++) {
+	for (i = ctx->pos - 2; i < sbi->max_subfiles; i++) {
 		f = &dblock->files[i];
 		if (!f->inode)
 			break;
@@ -68,4 +69,7 @@ static int ouichefs_iterate(struct file *dir, struct dir_context *ctx)
 const struct file_operations ouichefs_dir_ops = {
 	.owner = THIS_MODULE,
 	.iterate_shared = ouichefs_iterate,
+	.fsync = ouichefs_fsync,
+	.unlocked_ioctl = ouichefs_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
 };
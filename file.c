@@ -14,6 +14,7 @@
 #include <linux/mpage.h>
 
 #include "ouichefs.h"
+#include "ouichefs_trace.h"
 
 static int ouichefs_truncate(struct ouichefs_inode_info *ci);
 
@@ -23,10 +24,12 @@ static int ouichefs_truncate(struct ouichefs_inode_info *ci);
  * true, allocate a new block on disk and map it. If cow is true, check if block
  * is writeable and allocate a copy if not.
  */
-static int ouichefs_file_get_block(struct inode *inode, sector_t iblock,
-				   struct buffer_head *bh_result, bool create, bool cow)
+static int __ouichefs_file_get_block(struct inode *inode, sector_t iblock,
+				     struct buffer_head *bh_result, bool create,
+				     bool cow)
 {
 	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 	struct ouichefs_file_index_block *index;
 	struct buffer_head *bh_index;
@@ -34,7 +37,7 @@ static int ouichefs_file_get_block(struct inode *inode, sector_t iblock,
 	int ret = 0;
 
 	/* If block number exceeds filesize, fail */
-	if (iblock >= OUICHEFS_INDEX_BLOCK_LEN)
+	if (iblock >= sbi->index_len)
 		return -EFBIG;
 
 	/*
@@ -42,7 +45,8 @@ static int ouichefs_file_get_block(struct inode *inode, sector_t iblock,
 	 * inodes and we want to write, make a copy
 	 */
 	if (cow) {
-		ret = ouichefs_cow_block(sb, &ci->index_block, OUICHEFS_INDEX);
+		ret = ouichefs_cow_block(inode, &ci->index_block,
+					 OUICHEFS_INDEX);
 		if (unlikely(ret < 0))
 			return ret;
 
@@ -54,7 +58,7 @@ static int ouichefs_file_get_block(struct inode *inode, sector_t iblock,
 	}
 
 	/* Read index block from disk */
-	bh_index = sb_bread(sb, ci->index_block);
+	bh_index = ouichefs_bread_hot(sb, ci->index_block);
 	if (unlikely(!bh_index))
 		return -EIO;
 	index = (struct ouichefs_file_index_block *)bh_index->b_data;
@@ -69,22 +73,22 @@ static int ouichefs_file_get_block(struct inode *inode, sector_t iblock,
 			ret = 0;
 			goto brelse_index;
 		}
-		ret = ouichefs_alloc_block(sb, &bno);
+		ret = ouichefs_alloc_block(sb, &bno, ci->index_block);
 		if (unlikely(ret < 0))
 			goto brelse_index;
 
 		index->blocks[iblock] = bno;
-		mark_buffer_dirty(bh_index);
+		ouichefs_journal_dirty(sb, bh_index);
 	} else if (cow) {
 		/* Check if this block is shared; Copy it if it is */
-		ret = ouichefs_cow_block(sb, &bno, OUICHEFS_DATA);
+		ret = ouichefs_cow_block(inode, &bno, OUICHEFS_DATA);
 		if (unlikely(ret < 0))
 			goto brelse_index;
 
 		/* Update index block to point to newly allocated copy */
 		if (ret > 0) {
 			index->blocks[iblock] = bno;
-			mark_buffer_dirty(bh_index);
+			ouichefs_journal_dirty(sb, bh_index);
 			ret = 0;
 		}
 	}
@@ -101,6 +105,23 @@ brelse_index:
 	return ret;
 }
 
+static int ouichefs_file_get_block(struct inode *inode, sector_t iblock,
+				   struct buffer_head *bh_result, bool create, bool cow)
+{
+	struct ouichefs_handle handle;
+	int ret;
+
+	/* Lookups do not modify anything */
+	if (!create && !cow)
+		return __ouichefs_file_get_block(inode, iblock, bh_result,
+						 false, false);
+
+	ouichefs_journal_start(inode->i_sb, &handle);
+	ret = __ouichefs_file_get_block(inode, iblock, bh_result, create, cow);
+	ouichefs_journal_stop(&handle);
+	return ret;
+}
+
 static int ouichefs_file_get_block_ro(struct inode *inode, sector_t iblock,
 	struct buffer_head *bh_result, int create)
 {
@@ -128,7 +149,28 @@ static void ouichefs_readahead(struct readahead_control *rac)
  */
 static int ouichefs_writepage(struct page *page, struct writeback_control *wbc)
 {
-	return block_write_full_page(page, ouichefs_file_get_block_cow, wbc);
+	struct inode *inode = page->mapping->host;
+	struct buffer_head *bh, *head;
+	u64 start = local_clock();
+	unsigned int nr = 0;
+	int ret;
+
+	/* Count the blocks written back, for the write amplification */
+	if (page_has_buffers(page)) {
+		bh = head = page_buffers(page);
+		do {
+			if (buffer_dirty(bh))
+				nr++;
+			bh = bh->b_this_page;
+		} while (bh != head);
+	}
+
+	ret = block_write_full_page(page, ouichefs_file_get_block_cow, wbc);
+	if (!ret)
+		ouichefs_wa_add(inode, OUICHEFS_WA_DATA, nr);
+	ouichefs_lat_end(OUICHEFS_SB(inode->i_sb), OUICHEFS_LAT_WRITEPAGE,
+			 start);
+	return ret;
 }
 
 /*
@@ -143,19 +185,21 @@ static int ouichefs_write_begin(struct file *file,
 {
 	struct inode *inode = file->f_inode;
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	u64 start = local_clock();
 	int err;
 	uint32_t nr_allocs = 0;
 
 	/* Check if the write can be completed (enough space?) */
-	if (pos + len > OUICHEFS_MAX_FILESIZE)
-		return -ENOSPC;
-	nr_allocs = max(pos + len, i_size_read(file->f_inode)) / OUICHEFS_BLOCK_SIZE;
+	err = -ENOSPC;
+	if (pos + len > inode->i_sb->s_maxbytes)
+		goto out;
+	nr_allocs = max(pos + len, i_size_read(file->f_inode)) >> inode->i_blkbits;
 	if (nr_allocs > file->f_inode->i_blocks - 1)
 		nr_allocs -= file->f_inode->i_blocks - 1;
 	else
 		nr_allocs = 0;
 	if (nr_allocs > sbi->nr_free_blocks)
-		return -ENOSPC;
+		goto out;
 
 	/* prepare the write */
 	err = block_write_begin(mapping, pos, len, pagep,
@@ -164,6 +208,9 @@ static int ouichefs_write_begin(struct file *file,
 	if (unlikely(err < 0))
 		ouichefs_truncate(OUICHEFS_INODE(inode));
 
+out:
+	ouichefs_lat_end(sbi, OUICHEFS_LAT_WRITE_BEGIN, start);
+	trace_ouichefs_write_begin(inode, pos, len, err);
 	return err;
 }
 
@@ -178,9 +225,13 @@ static int ouichefs_write_end(struct file *file, struct address_space *mapping,
 {
 	int ret;
 	struct inode *inode = file->f_inode;
+	struct ouichefs_dir_stats delta;
+	loff_t size_old = i_size_read(inode);
 
 	/* Complete the write() */
 	ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
+	if (ret > 0)
+		ouichefs_wa_add(inode, OUICHEFS_WA_BYTES, ret);
 	if (ret < len) {
 		pr_err("%s:%d: wrote less than asked... what do I do? nothing for now...\n",
 		       __func__, __LINE__);
@@ -189,17 +240,24 @@ static int ouichefs_write_end(struct file *file, struct address_space *mapping,
 	uint32_t nr_blocks_old = inode->i_blocks;
 
 	/* Update inode metadata. The 1 is the index block */
-	inode->i_blocks = 1 + (i_size_read(inode) / OUICHEFS_BLOCK_SIZE);
-	if ((i_size_read(inode) % OUICHEFS_BLOCK_SIZE) != 0)
+	inode->i_blocks = 1 + (i_size_read(inode) >> inode->i_blkbits);
+	if ((i_size_read(inode) & (i_blocksize(inode) - 1)) != 0)
 		inode->i_blocks++;
 	inode->i_mtime = inode->i_ctime = current_time(inode);
 	mark_inode_dirty(inode);
 
+	/* Update the statistics of all parent directories on release */
+	delta.bytes = i_size_read(inode) - size_old;
+	delta.blocks = (int64_t)inode->i_blocks - nr_blocks_old;
+	delta.files = 0;
+	ouichefs_dir_stats_defer(inode, &delta);
+
 	/* If file is smaller than before, free unused blocks */
 	if (nr_blocks_old > inode->i_blocks)
 		ouichefs_truncate(OUICHEFS_INODE(inode));
 
 end:
+	trace_ouichefs_write_end(inode, pos, len, copied, inode->i_blocks);
 	return ret;
 }
 
@@ -219,22 +277,34 @@ static int ouichefs_open(struct inode *inode, struct file *file)
 	if ((wronly || rdwr) && trunc && (i_size_read(inode) != 0)) {
 		struct super_block *sb = inode->i_sb;
 		struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+		struct ouichefs_dir_stats delta;
+		struct ouichefs_handle handle;
 		int ret;
 
 		/* Check if we can modify the index block, clone it otherwise */
-		ret = ouichefs_cow_block(sb, &ci->index_block, OUICHEFS_INDEX);
-		if (unlikely(ret < 0))
+		ouichefs_journal_start_credits(sb, &handle,
+			ouichefs_dir_stats_credits(file->f_path.dentry));
+		ret = ouichefs_cow_block(inode, &ci->index_block,
+					 OUICHEFS_INDEX);
+		if (unlikely(ret < 0)) {
+			ouichefs_journal_stop(&handle);
 			return ret;
+		}
 
-		/* Update inode metadata */
+		/* Update inode metadata and the statistics of its parents */
+		delta.bytes = -i_size_read(inode);
+		delta.blocks = 1 - (int64_t)inode->i_blocks;
+		delta.files = 0;
 		i_size_write(inode, 0);
 		inode->i_blocks = 1;
 		inode->i_ctime = current_time(inode);
 		inode->i_mtime = current_time(inode);
+		ouichefs_dir_stats_propagate(file->f_path.dentry, &delta);
+		mark_inode_dirty(inode);
+		ouichefs_journal_stop(&handle);
 
 		/* Free old blocks */
 		ouichefs_truncate(ci);
-		mark_inode_dirty(inode);
 	}
 
 	return 0;
@@ -247,19 +317,25 @@ static int ouichefs_truncate(struct ouichefs_inode_info *ci)
 {
 	struct inode *inode = &ci->vfs_inode;
 	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct ouichefs_file_index_block *index;
+	struct ouichefs_handle handle;
 	struct buffer_head *bh_index;
 
+	/* Must not run in a handle, since this locks pages */
 	truncate_pagecache(inode, i_size_read(inode));
 
 	/* Read index block from disk */
-	bh_index = sb_bread(sb, ci->index_block);
-	if (unlikely(!bh_index))
+	ouichefs_journal_start(sb, &handle);
+	bh_index = ouichefs_bread(sb, ci->index_block);
+	if (unlikely(!bh_index)) {
+		ouichefs_journal_stop(&handle);
 		return -EIO;
+	}
 	index = (struct ouichefs_file_index_block *)bh_index->b_data;
 
 	/* Iterate all referenced blocks and dereference them */
-	for (int i = inode->i_blocks - 1; i < OUICHEFS_INDEX_BLOCK_LEN; i++) {
+	for (int i = inode->i_blocks - 1; i < sbi->index_len; i++) {
 		if (index->blocks[i] == 0)
 			break;
 
@@ -267,8 +343,9 @@ static int ouichefs_truncate(struct ouichefs_inode_info *ci)
 		index->blocks[i] = 0;
 	}
 
-	mark_buffer_dirty(bh_index);
+	ouichefs_journal_dirty(sb, bh_index);
 	brelse(bh_index);
+	ouichefs_journal_stop(&handle);
 
 	return 0;
 }
@@ -338,24 +415,25 @@ static ssize_t __reflink_file_range(
 	uint16_t s_off_b, d_off_b, len_b;
 
 	/* Compute blocks to reflink */
-	len_b = len / OUICHEFS_BLOCK_SIZE;
-	s_off_b = src_off / OUICHEFS_BLOCK_SIZE;
-	d_off_b = dst_off / OUICHEFS_BLOCK_SIZE;
-	WARN_ON(len % OUICHEFS_BLOCK_SIZE != 0);
-	WARN_ON(src_off % OUICHEFS_BLOCK_SIZE != 0);
-	WARN_ON(dst_off % OUICHEFS_BLOCK_SIZE != 0);
+	len_b = len >> sb->s_blocksize_bits;
+	s_off_b = src_off >> sb->s_blocksize_bits;
+	d_off_b = dst_off >> sb->s_blocksize_bits;
+	WARN_ON((len & (sb->s_blocksize - 1)) != 0);
+	WARN_ON((src_off & (sb->s_blocksize - 1)) != 0);
+	WARN_ON((dst_off & (sb->s_blocksize - 1)) != 0);
 
 	pr_debug("Reflinking %u blocks, src=%lu (at %u), dst=%lu (at %u)\n",
 		len_b, src->vfs_inode.i_ino, s_off_b, dst->vfs_inode.i_ino, d_off_b);
 
 	/* Open source index block */
-	s_bh = sb_bread(sb, src->index_block);
+	s_bh = ouichefs_bread(sb, src->index_block);
 	if (unlikely(!s_bh))
 		return -EIO;
 	src_index = (struct ouichefs_file_index_block *)s_bh->b_data;
 
 	/* Clone dst index block is necessary */
-	ret = ouichefs_cow_block(sb, &dst->index_block, OUICHEFS_INDEX);
+	ret = ouichefs_cow_block(&dst->vfs_inode, &dst->index_block,
+				 OUICHEFS_INDEX);
 	if (unlikely(ret < 0)) {
 		brelse(s_bh);
 		return ret;
@@ -365,7 +443,7 @@ static ssize_t __reflink_file_range(
 	}
 
 	/* Open destination index block */
-	d_bh = sb_bread(sb, dst->index_block);
+	d_bh = ouichefs_bread(sb, dst->index_block);
 	if (unlikely(!d_bh)) {
 		brelse(s_bh);
 		return -EIO;
@@ -377,7 +455,7 @@ static ssize_t __reflink_file_range(
 		/* Check if blocks are already reflinked */
 		if (src_index->blocks[s_off_b + i] ==
 		    dst_index->blocks[d_off_b + i]) {
-			ret += OUICHEFS_BLOCK_SIZE;
+			ret += sb->s_blocksize;
 			continue;
 		}
 
@@ -394,16 +472,16 @@ static ssize_t __reflink_file_range(
 		dst_index->blocks[d_off_b + i] = src_index->blocks[s_off_b + i];
 		mark_bh_dirty = true;
 
-		ret += OUICHEFS_BLOCK_SIZE;
+		ret += sb->s_blocksize;
 	}
 
 	pr_debug("Reflinked %lu blocks (src=%lu, dst=%lu)\n",
-		ret / OUICHEFS_BLOCK_SIZE, src->vfs_inode.i_ino, dst->vfs_inode.i_ino);
+		ret >> sb->s_blocksize_bits, src->vfs_inode.i_ino, dst->vfs_inode.i_ino);
 
 	/* Free index blocks */
 early_out:
 	if (mark_bh_dirty)
-		mark_buffer_dirty(d_bh);
+		ouichefs_journal_dirty(sb, d_bh);
 	brelse(d_bh);
 	brelse(s_bh);
 
@@ -421,6 +499,7 @@ static loff_t ouichefs_remap_file_range(struct file *src_file, loff_t src_off,
 {
 	struct inode *src_ino = src_file->f_inode;
 	struct inode *dst_ino = dst_file->f_inode;
+	struct ouichefs_handle handle;
 	loff_t ret = 0;
 
 	/* Filter for unknown flags; Abort if any are found */
@@ -456,7 +535,11 @@ static loff_t ouichefs_remap_file_range(struct file *src_file, loff_t src_off,
 		dst_file, dst_off, &len, flags);
 	pr_debug("Update len=%lld", len);
 	if (ret < 0 || len == 0)
-		goto out_done;
+		goto out_unlock;
+
+	/* Only start the handle now, since the preparation syncs pages */
+	ouichefs_journal_start_credits(dst_ino->i_sb, &handle,
+			ouichefs_dir_stats_credits(dst_file->f_path.dentry));
 
 	/* Can the whole file be reflinked? */
 	if (src_off == 0 && dst_off == 0 &&
@@ -472,20 +555,32 @@ static loff_t ouichefs_remap_file_range(struct file *src_file, loff_t src_off,
 out_done:
 	/* Update dest inode metadata if operation succeeded */
 	if (ret > 0) {
+		ouichefs_stat_add(OUICHEFS_SB(dst_ino->i_sb),
+				  OUICHEFS_STAT_REFLINK_BYTES, ret);
 		if (dst_off + ret > i_size_read(dst_ino)) {
+			struct ouichefs_dir_stats delta;
+
 			pr_debug("Update i_size %lld -> %llu\n",
 				 i_size_read(dst_ino), dst_off + ret);
+			delta.bytes = dst_off + ret - i_size_read(dst_ino);
+			delta.blocks = -(int64_t)dst_ino->i_blocks;
+			delta.files = 0;
 			i_size_write(dst_ino, dst_off + ret);
 			dst_ino->i_blocks = 1 +
-					    (i_size_read(dst_ino) / OUICHEFS_BLOCK_SIZE);
-			if ((i_size_read(dst_ino) % OUICHEFS_BLOCK_SIZE) != 0)
+					    (i_size_read(dst_ino) >> dst_ino->i_blkbits);
+			if ((i_size_read(dst_ino) & (i_blocksize(dst_ino) - 1)) != 0)
 				dst_ino->i_blocks++;
+			delta.blocks += dst_ino->i_blocks;
+			ouichefs_dir_stats_propagate(dst_file->f_path.dentry,
+						     &delta);
 		}
 
 		file_update_time(dst_file);
 		mark_inode_dirty(dst_ino);
 	}
+	ouichefs_journal_stop(&handle);
 
+out_unlock:
 	/* Unlock inodes and page cache */
 	filemap_invalidate_unlock_two(src_file->f_mapping, dst_file->f_mapping);
 	unlock_two_nondirectories(src_ino, dst_ino);
@@ -493,11 +588,44 @@ out_done:
 	return ret;
 }
 
+static int ouichefs_release(struct inode *inode, struct file *file)
+{
+	if (file->f_mode & FMODE_WRITE)
+		ouichefs_dir_stats_flush(file->f_path.dentry);
+	return 0;
+}
+
+/*
+ * Writes back the file content, then commits the transaction holding its
+ * metadata. Without a journal, the inode is written back directly.
+ */
+int ouichefs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+	struct inode *inode = file_inode(file);
+	int ret;
+
+	ouichefs_dir_stats_flush(file->f_path.dentry);
+	if (!OUICHEFS_SB(inode->i_sb)->journal)
+		return generic_file_fsync(file, start, end, datasync);
+
+	ret = file_write_and_wait_range(file, start, end);
+	if (ret)
+		return ret;
+	ret = ouichefs_log_inode_retry(inode);
+	if (ret)
+		return ret;
+	return ouichefs_journal_commit(inode->i_sb);
+}
+
 const struct file_operations ouichefs_file_ops = {
 	.owner = THIS_MODULE,
 	.open = ouichefs_open,
+	.release = ouichefs_release,
 	.llseek = generic_file_llseek,
 	.read_iter = generic_file_read_iter,
 	.write_iter = generic_file_write_iter,
-	.remap_file_range = ouichefs_remap_file_range
+	.fsync = ouichefs_fsync,
+	.remap_file_range = ouichefs_remap_file_range,
+	.unlocked_ioctl = ouichefs_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
 };
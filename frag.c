@@ -0,0 +1,294 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "ouichefs.h"
+
+/*
+ * Fragmentation report, in /sys/kernel/debug/ouichefs/<dev>/fragmentation
+ *
+ * The free extents are computed from the in-memory block free bitmap, one
+ * bitmap block at a time so that allocations are not held up. Files and
+ * refcounts need disk reads, so only a bounded sample of evenly spread
+ * inodes and metadata blocks is read. The inode data fill factor uses the
+ * free entry counter and the inode data index, which is small.
+ */
+
+/* Maximum number of inodes and of metadata blocks read for a report */
+#define OUICHEFS_FRAG_SAMPLE 1024
+
+/* Free extent sizes, bucket i counts extents of [2^i, 2^(i+1)) blocks */
+#define OUICHEFS_FRAG_BUCKETS 32
+
+struct ouichefs_frag {
+	u64 extents[OUICHEFS_FRAG_BUCKETS];
+	u64 nr_extents;
+	u64 free_blocks;
+	u64 largest;
+};
+
+static void frag_add_extent(struct ouichefs_frag *f, u64 len)
+{
+	f->extents[min_t(unsigned int, ilog2(len),
+			 OUICHEFS_FRAG_BUCKETS - 1)]++;
+	f->nr_extents++;
+	f->free_blocks += len;
+	f->largest = max(f->largest, len);
+}
+
+/*
+ * Collects the free extents of the block free bitmap. Returns false if the
+ * bitmap is not loaded, i.e. on a read-only mount.
+ */
+static bool frag_free_extents(struct ouichefs_sb_info *sbi,
+			      struct ouichefs_frag *f)
+{
+	unsigned long chunk, limit, pos, start, end;
+	u64 pending = 0;
+	bool loaded = false;
+
+	for (chunk = 0;; chunk += sbi->bits_per_block) {
+		spin_lock(&sbi->bfree_lock);
+		if (!sbi->bfree_bitmap || chunk >= sbi->nr_blocks) {
+			spin_unlock(&sbi->bfree_lock);
+			break;
+		}
+		loaded = true;
+		limit = min_t(unsigned long, chunk + sbi->bits_per_block,
+			      sbi->nr_blocks);
+		for (pos = chunk; pos < limit; pos = end) {
+			start = find_next_bit(sbi->bfree_bitmap, limit, pos);
+			/* An extent ending at the previous chunk is complete */
+			if (start > pos && pending) {
+				frag_add_extent(f, pending);
+				pending = 0;
+			}
+			if (start >= limit)
+				break;
+			end = find_next_zero_bit(sbi->bfree_bitmap, limit,
+						 start);
+			pending += end - start;
+			if (end < limit) {
+				frag_add_extent(f, pending);
+				pending = 0;
+			}
+		}
+		spin_unlock(&sbi->bfree_lock);
+		cond_resched();
+	}
+	if (pending)
+		frag_add_extent(f, pending);
+	return loaded;
+}
+
+/* Returns the number of extents of the file index block bno, or -errno */
+static int frag_file_extents(struct super_block *sb, uint32_t bno)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh;
+	int i, nr = 0;
+
+	bh = ouichefs_bread(sb, bno);
+	if (!bh)
+		return -EIO;
+	index = (struct ouichefs_file_index_block *)bh->b_data;
+	for (i = 0; i < sbi->index_len && index->blocks[i]; i++) {
+		if (!i || index->blocks[i] != index->blocks[i - 1] + 1)
+			nr++;
+	}
+	brelse(bh);
+	return nr;
+}
+
+static void frag_show_files(struct seq_file *m, struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_data *idata;
+	struct buffer_head *bh;
+	uint32_t ino, step, mode, index_block;
+	u64 nr_files = 0, nr_extents = 0;
+	u32 frac;
+	int ret;
+
+	step = max_t(uint32_t, 1, sbi->nr_inodes / OUICHEFS_FRAG_SAMPLE);
+	for (ino = 1; ino < sbi->nr_inodes; ino += step) {
+		/* The bitmap goes away if a remount read-write fails */
+		spin_lock(&sbi->ifree_lock);
+		if (!sbi->ifree_bitmap) {
+			spin_unlock(&sbi->ifree_lock);
+			seq_puts(m, "files: not available without free bitmaps\n");
+			return;
+		}
+		ino = find_next_zero_bit(sbi->ifree_bitmap, sbi->nr_inodes,
+					 ino);
+		spin_unlock(&sbi->ifree_lock);
+		if (ino >= sbi->nr_inodes)
+			break;
+
+		/* The inode may be freed by now, this is only a sample */
+		idata = ouichefs_peek_inode_data(sb, &bh, ino);
+		if (IS_ERR(idata))
+			continue;
+		mode = idata->i_mode;
+		index_block = idata->index_block;
+		brelse(bh);
+		if (!S_ISREG(mode))
+			continue;
+
+		ret = frag_file_extents(sb, index_block);
+		if (ret < 0)
+			continue;
+		nr_files++;
+		nr_extents += ret;
+		cond_resched();
+	}
+
+	seq_printf(m, "files: %llu sampled, %llu extents", nr_files,
+		   nr_extents);
+	if (nr_files) {
+		nr_extents = div_u64_rem(div64_u64(nr_extents * 100, nr_files),
+					 100, &frac);
+		seq_printf(m, ", %llu.%02u extents per file", nr_extents, frac);
+	}
+	seq_putc(m, '\n');
+}
+
+static void frag_show_shared(struct seq_file *m, struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_metadata_block *mb;
+	struct buffer_head *bh;
+	u64 used = 0, shared = 0, first;
+	uint32_t nr_meta, step, k, meta, len, i;
+	unsigned int sampled = 0;
+	u32 frac;
+
+	if (sbi->layout == OUICHEFS_LAYOUT_GROUPS)
+		nr_meta = DIV_ROUND_UP(sbi->nr_blocks -
+					       OUICHEFS_GET_META_START(sbi),
+				       sbi->group_blocks);
+	else
+		nr_meta = sbi->nr_meta_blocks;
+	step = max_t(uint32_t, 1, nr_meta / OUICHEFS_FRAG_SAMPLE);
+
+	for (k = 0; k < nr_meta; k += step) {
+		if (sbi->layout == OUICHEFS_LAYOUT_GROUPS) {
+			meta = OUICHEFS_GET_META_START(sbi) +
+			       k * sbi->group_blocks;
+			first = meta + 1;
+			len = sbi->group_blocks - 1;
+			/* Groups starting in the journal have no metadata */
+			if (sbi->nr_journal_blocks &&
+			    meta >= sbi->journal_start &&
+			    meta < sbi->journal_start + sbi->nr_journal_blocks)
+				continue;
+		} else {
+			meta = OUICHEFS_GET_META_START(sbi) + k;
+			first = OUICHEFS_GET_DATA_START(sbi) +
+				((u64)k << sbi->meta_bits);
+			len = sbi->meta_len;
+		}
+		if (first >= sbi->nr_blocks)
+			break;
+		len = min_t(u64, len, sbi->nr_blocks - first);
+
+		bh = ouichefs_bread(sb, meta);
+		if (!bh)
+			continue;
+		mb = (struct ouichefs_metadata_block *)bh->b_data;
+		for (i = 0; i < len; i++) {
+			if (mb->refcount[i])
+				used++;
+			if (mb->refcount[i] > 1)
+				shared++;
+		}
+		brelse(bh);
+		sampled++;
+		cond_resched();
+	}
+
+	seq_printf(m, "shared blocks: %llu of %llu used", shared, used);
+	if (used) {
+		shared = div_u64_rem(div64_u64(shared * 10000, used), 100,
+				     &frac);
+		seq_printf(m, " (%llu.%02u%%)", shared, frac);
+	}
+	seq_printf(m, ", %u of %u metadata blocks sampled\n", sampled,
+		   nr_meta);
+}
+
+static void frag_show_inode_data(struct seq_file *m, struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_data_index_block *ididx;
+	struct buffer_head *bh;
+	u64 blocks = 0, used, slots;
+	uint32_t b, i;
+	u32 frac;
+
+	for (b = 0; b < sbi->nr_ididx_blocks; b++) {
+		bh = ouichefs_bread(sb, OUICHEFS_GET_IDIDX_BLOCK(sbi, 0) + b);
+		if (!bh)
+			continue;
+		ididx = (struct ouichefs_inode_data_index_block *)bh->b_data;
+		for (i = 0; i < sbi->index_len; i++) {
+			if (ididx->blocks[i])
+				blocks++;
+		}
+		brelse(bh);
+		cond_resched();
+	}
+
+	used = sbi->nr_inode_data_entries - sbi->nr_free_inode_data_entries;
+	slots = blocks * sbi->ide_per_block;
+	seq_printf(m, "inode data: %llu blocks, %llu of %llu entries used",
+		   blocks, used, slots);
+	if (slots) {
+		used = div_u64_rem(div64_u64(min(used, slots) * 10000, slots),
+				   100, &frac);
+		seq_printf(m, " (%llu.%02u%%)", used, frac);
+	}
+	seq_putc(m, '\n');
+}
+
+static int fragmentation_show(struct seq_file *m, void *v)
+{
+	struct super_block *sb = m->private;
+	struct ouichefs_frag f = { 0 };
+	int i;
+
+	if (!frag_free_extents(OUICHEFS_SB(sb), &f)) {
+		seq_puts(m, "free extents: not available without free bitmaps\n");
+	} else {
+		seq_printf(m, "free extents: %llu, %llu free blocks, largest %llu\n",
+			   f.nr_extents, f.free_blocks, f.largest);
+		for (i = 0; i < OUICHEFS_FRAG_BUCKETS; i++) {
+			if (f.extents[i])
+				seq_printf(m, "  [%llu, %llu) blocks: %llu\n",
+					   1ULL << i, 1ULL << (i + 1),
+					   f.extents[i]);
+		}
+	}
+	frag_show_files(m, sb);
+	frag_show_shared(m, sb);
+	frag_show_inode_data(m, sb);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(fragmentation);
+
+void ouichefs_frag_debugfs(struct super_block *sb, struct dentry *dir)
+{
+	debugfs_create_file("fragmentation", 0444, dir, sb,
+			    &fragmentation_fops);
+}
@@ -13,6 +13,9 @@
 
 #include "ouichefs.h"
 
+#define CREATE_TRACE_POINTS
+#include "ouichefs_trace.h"
+
 /*
  * Mount a ouiche_fs partition
  */
@@ -40,6 +43,12 @@ void ouichefs_kill_sb(struct super_block *sb)
 {
 	remove_ouichefs_partition_entry(sb->s_id);
 
+	/* Finish reclaiming detached subtrees while the inodes are alive */
+	if (sb->s_fs_info) {
+		ouichefs_reclaim_flush(sb);
+		ouichefs_hot_save(sb);
+	}
+
 	kill_block_super(sb);
 
 	pr_info("unmounted disk\n");
@@ -73,6 +82,7 @@ static int __init ouichefs_init(void)
 	ret = init_sysfs_interface();
 	if (ret < 0)
 		goto err;
+	ouichefs_debugfs_init();
 
 	pr_info("module loaded\n");
 
@@ -88,6 +98,7 @@ static void __exit ouichefs_exit(void)
 {
 	int ret;
 
+	ouichefs_debugfs_exit();
 	cleanup_sysfs_interface();
 
 	ret = unregister_filesystem(&ouichefs_file_system_type);
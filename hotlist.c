@@ -0,0 +1,208 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/blkdev.h>
+#include <linux/crc32.h>
+#include <linux/hash.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+
+#include "ouichefs.h"
+
+#define OUICHEFS_HOT_BITS 10
+#define OUICHEFS_HOT_SLOTS (1 << OUICHEFS_HOT_BITS)
+
+/*
+ * One slot of the in-memory read frequency table. Blocks hashing to the same
+ * slot compete for it: reads of other blocks age the current one, which is
+ * only replaced once its count dropped to zero. Frequently read blocks thus
+ * keep their slot.
+ */
+struct ouichefs_hot_slot {
+	uint32_t block;
+	uint32_t count;
+};
+
+/*
+ * Reads a metadata block and accounts it in the read frequency table.
+ * Updates are racy on purpose, the result is only a hint.
+ */
+struct buffer_head *ouichefs_bread_hot(struct super_block *sb, uint32_t block)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_hot_slot *hot = sbi->hot;
+	struct ouichefs_hot_slot *slot;
+	uint32_t count;
+
+	if (hot) {
+		slot = &hot[hash_32(block, OUICHEFS_HOT_BITS)];
+		count = READ_ONCE(slot->count);
+		if (READ_ONCE(slot->block) == block) {
+			WRITE_ONCE(slot->count, count + 1);
+		} else if (count > 1) {
+			WRITE_ONCE(slot->count, count - 1);
+		} else {
+			WRITE_ONCE(slot->block, block);
+			WRITE_ONCE(slot->count, 1);
+		}
+	}
+	return ouichefs_bread(sb, block);
+}
+
+static bool ouichefs_hot_list_valid(struct ouichefs_sb_info *sbi,
+				    struct ouichefs_hot_list *list)
+{
+	if (list->magic != OUICHEFS_HOT_LIST_MAGIC ||
+	    list->nr_blocks > sbi->hot_list_len)
+		return false;
+	return list->crc == crc32_le(~0, (unsigned char *)list->blocks,
+				     list->nr_blocks * sizeof(uint32_t));
+}
+
+/*
+ * Sets up the read frequency table and starts reading the blocks of the hot
+ * list saved at the last unmount. The list is sorted by block number, so the
+ * reads are merged and sent in disk order.
+ */
+void ouichefs_hot_init(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_hot_list *list;
+	struct buffer_head *bh;
+	struct blk_plug plug;
+	uint32_t i, nr = 0;
+
+	if (!(sbi->feature_compat & OUICHEFS_FEATURE_COMPAT_HOT_LIST))
+		return;
+
+	/* Without table, nothing is recorded, which is fine */
+	sbi->hot = kcalloc(OUICHEFS_HOT_SLOTS, sizeof(*sbi->hot), GFP_KERNEL);
+
+	if (!sbi->hot_list_block)
+		return;
+	if (sbi->hot_list_block < OUICHEFS_GET_DATA_START(sbi) ||
+	    sbi->hot_list_block >= sbi->nr_blocks) {
+		pr_warn("Invalid hot list block %u, ignoring it\n",
+			sbi->hot_list_block);
+		return;
+	}
+
+	bh = ouichefs_bread(sb, sbi->hot_list_block);
+	if (!bh)
+		return;
+	list = (struct ouichefs_hot_list *)bh->b_data;
+	if (!ouichefs_hot_list_valid(sbi, list)) {
+		pr_debug("No valid hot list in block %u\n",
+			 sbi->hot_list_block);
+		goto release;
+	}
+
+	blk_start_plug(&plug);
+	for (i = 0; i < list->nr_blocks; i++) {
+		if (list->blocks[i] >= sbi->nr_blocks)
+			continue;
+		ouichefs_breadahead(sb, list->blocks[i]);
+		nr++;
+	}
+	blk_finish_plug(&plug);
+	pr_debug("Prewarming %u hot blocks\n", nr);
+release:
+	brelse(bh);
+}
+
+static int ouichefs_hot_cmp_count(const void *a, const void *b)
+{
+	const struct ouichefs_hot_slot *x = a, *y = b;
+
+	/* Most frequently read first */
+	if (x->count != y->count)
+		return x->count < y->count ? 1 : -1;
+	return 0;
+}
+
+static int ouichefs_hot_cmp_block(const void *a, const void *b)
+{
+	uint32_t ba = *(const uint32_t *)a, bb = *(const uint32_t *)b;
+
+	return ba < bb ? -1 : ba > bb;
+}
+
+/*
+ * Saves the most frequently read metadata blocks to the hot list, which is
+ * allocated on first use. The hot list is only a hint protected by a
+ * checksum, so it is written in place, outside of the journal.
+ */
+void ouichefs_hot_save(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_hot_slot *slots;
+	struct ouichefs_hot_list *list;
+	struct ouichefs_handle handle;
+	struct buffer_head *bh;
+	uint32_t i, nr = 0, bno;
+	int ret;
+
+	if (!sbi->hot || sb_rdonly(sb))
+		return;
+
+	slots = kmalloc_array(OUICHEFS_HOT_SLOTS, sizeof(*slots), GFP_KERNEL);
+	if (!slots)
+		return;
+
+	/* Blocks read only once are not worth it */
+	for (i = 0; i < OUICHEFS_HOT_SLOTS; i++) {
+		if (sbi->hot[i].count > 1)
+			slots[nr++] = sbi->hot[i];
+	}
+	if (!nr && !sbi->hot_list_block)
+		goto free;
+	sort(slots, nr, sizeof(*slots), ouichefs_hot_cmp_count, NULL);
+	nr = min_t(uint32_t, nr, sbi->hot_list_len);
+
+	if (!sbi->hot_list_block) {
+		ouichefs_journal_start(sb, &handle);
+		ret = ouichefs_alloc_block(sb, &bno, 0);
+		if (!ret)
+			sbi->hot_list_block = bno;
+		ouichefs_journal_stop(&handle);
+		if (ret) {
+			pr_debug("Failed to allocate hot list block: %d\n",
+				 ret);
+			goto free;
+		}
+	}
+
+	bh = sb_getblk(sb, sbi->hot_list_block);
+	if (!bh)
+		goto free;
+	lock_buffer(bh);
+	memset(bh->b_data, 0, sb->s_blocksize);
+	list = (struct ouichefs_hot_list *)bh->b_data;
+	list->magic = OUICHEFS_HOT_LIST_MAGIC;
+	list->nr_blocks = nr;
+	for (i = 0; i < nr; i++)
+		list->blocks[i] = slots[i].block;
+	sort(list->blocks, nr, sizeof(uint32_t), ouichefs_hot_cmp_block, NULL);
+	list->crc = crc32_le(~0, (unsigned char *)list->blocks,
+			     nr * sizeof(uint32_t));
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+	brelse(bh);
+	pr_debug("Saved %u hot blocks to block %u\n", nr, sbi->hot_list_block);
+free:
+	kfree(slots);
+}
+
+void ouichefs_hot_release(struct super_block *sb)
+{
+	kfree(OUICHEFS_SB(sb)->hot);
+}
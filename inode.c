@@ -17,6 +17,13 @@
 #include "ouichefs.h"
 #include "bitmap.h"
 
+/*
+ * Blocks logging one inode may add to a transaction: its inode data block,
+ * plus the idfree, id_idx, bfree, meta and new inode data blocks of a copy
+ * if a snapshot shares its inode data entry
+ */
+#define OUICHEFS_INODE_CREDITS 6
+
 static const struct inode_operations ouichefs_inode_ops;
 
 /*
@@ -34,7 +41,7 @@ int ouichefs_ifill(struct inode *inode, bool create)
 
 	pr_debug("Loading inode %lu from disk\n", inode->i_ino);
 
-	cinode = ouichefs_get_inode_data(sb, &bh, inode->i_ino, create, false);
+	cinode = ouichefs_get_inode_data(sb, &bh, inode->i_ino, create, NULL);
 	if (IS_ERR(cinode))
 		return PTR_ERR(cinode);
 
@@ -52,6 +59,10 @@ int ouichefs_ifill(struct inode *inode, bool create)
 	set_nlink(inode, le32_to_cpu(cinode->i_nlink));
 
 	ci->index_block = le32_to_cpu(cinode->index_block);
+	ci->parent = le32_to_cpu(cinode->i_parent);
+	ci->r_stats.bytes = le64_to_cpu(cinode->r_bytes);
+	ci->r_stats.blocks = le64_to_cpu(cinode->r_blocks);
+	ci->r_stats.files = le64_to_cpu(cinode->r_files);
 
 	if (S_ISDIR(inode->i_mode)) {
 		inode->i_fop = &ouichefs_dir_ops;
@@ -71,8 +82,8 @@ struct inode *ouichefs_iget(struct super_block *sb, uint32_t ino, bool create)
 {
 	struct inode *inode = NULL;
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-	uint32_t inode_block = OUICHEFS_GET_INODE_BLOCK(ino);
-	uint32_t inode_shift = OUICHEFS_GET_INODE_SHIFT(ino);
+	uint32_t inode_block = OUICHEFS_GET_INODE_BLOCK(sbi, ino);
+	uint32_t inode_shift = OUICHEFS_GET_INODE_SHIFT(sbi, ino);
 	int ret;
 
 	pr_debug("ino=%u, inode_block=%u, inode_shift=%u, create=%i\n",
@@ -105,15 +116,245 @@ struct inode *ouichefs_iget(struct super_block *sb, uint32_t ino, bool create)
 	return inode;
 }
 
+/*
+ * Computes how much an inode contributes to the statistics of the directories
+ * above it: itself, plus everything below it if it is a directory. Changes
+ * deferred by ouichefs_dir_stats_defer() are left out, since they have not
+ * reached these directories yet.
+ */
+void ouichefs_inode_usage(struct inode *inode, struct ouichefs_dir_stats *usage)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	usage->bytes = i_size_read(inode);
+	usage->blocks = inode->i_blocks;
+	usage->files = 1;
+
+	spin_lock(&sbi->dstats_lock);
+	usage->bytes -= ci->pending.bytes;
+	usage->blocks -= ci->pending.blocks;
+	if (S_ISDIR(inode->i_mode)) {
+		usage->bytes += ci->r_stats.bytes;
+		usage->blocks += ci->r_stats.blocks;
+		usage->files += ci->r_stats.files;
+	}
+	spin_unlock(&sbi->dstats_lock);
+}
+
+/*
+ * Adds delta to the recursive statistics of every directory above dentry,
+ * up to the root. dentry itself is not updated and may still be negative.
+ * The walk stops at the first unhashed dentry: an unlinked file still open,
+ * or a subtree detached by rmtree, no longer counts in the directories it
+ * was removed from.
+ */
+void ouichefs_dir_stats_propagate(struct dentry *dentry,
+				  const struct ouichefs_dir_stats *delta)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(dentry->d_sb);
+	struct ouichefs_inode_info *ci;
+	struct dentry *parent, *d;
+
+	if (!delta->bytes && !delta->blocks && !delta->files)
+		return;
+
+	d = dget(dentry);
+	while (!IS_ROOT(d) && !d_unhashed(d)) {
+		parent = dget_parent(d);
+		dput(d);
+		d = parent;
+
+		ci = OUICHEFS_INODE(d_inode(d));
+		spin_lock(&sbi->dstats_lock);
+		ci->r_stats.bytes += delta->bytes;
+		ci->r_stats.blocks += delta->blocks;
+		ci->r_stats.files += delta->files;
+		spin_unlock(&sbi->dstats_lock);
+		mark_inode_dirty(&ci->vfs_inode);
+	}
+	dput(d);
+}
+
+/*
+ * Returns the credits a handle needs to update the statistics of all
+ * directories above dentry with ouichefs_dir_stats_propagate().
+ */
+unsigned int ouichefs_dir_stats_credits(struct dentry *dentry)
+{
+	unsigned int nr = 0;
+	struct dentry *d;
+
+	rcu_read_lock();
+	for (d = dentry; !IS_ROOT(d) && !d_unhashed(d);
+	     d = READ_ONCE(d->d_parent))
+		nr++;
+	rcu_read_unlock();
+	return nr * OUICHEFS_INODE_CREDITS;
+}
+
+/*
+ * Records a change of the size or block count of a regular file without
+ * updating the directories above it. Consecutive writes thereby walk up to
+ * the root once, when ouichefs_dir_stats_flush() runs on release or fsync,
+ * instead of once per write.
+ */
+void ouichefs_dir_stats_defer(struct inode *inode,
+			      const struct ouichefs_dir_stats *delta)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	spin_lock(&sbi->dstats_lock);
+	ci->pending.bytes += delta->bytes;
+	ci->pending.blocks += delta->blocks;
+	spin_unlock(&sbi->dstats_lock);
+}
+
+/*
+ * Adds the changes deferred for the inode of dentry to the directories above
+ * it.
+ */
+void ouichefs_dir_stats_flush(struct dentry *dentry)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(dentry->d_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(d_inode(dentry));
+	struct ouichefs_dir_stats delta;
+	struct ouichefs_handle handle;
+
+	spin_lock(&sbi->dstats_lock);
+	delta = ci->pending;
+	memset(&ci->pending, 0, sizeof(ci->pending));
+	spin_unlock(&sbi->dstats_lock);
+	if (!delta.bytes && !delta.blocks)
+		return;
+
+	ouichefs_journal_start_credits(dentry->d_sb, &handle,
+				       ouichefs_dir_stats_credits(dentry));
+	ouichefs_dir_stats_propagate(dentry, &delta);
+	ouichefs_journal_stop(&handle);
+}
+
+/*
+ * Gets the back-reference and index block of an inode. Inodes in the inode
+ * cache may be newer than their inode data on disk, so prefer those.
+ */
+static int ouichefs_get_backref(struct super_block *sb, uint32_t ino,
+				uint32_t *parent, uint32_t *index_block)
+{
+	struct ouichefs_inode_data *idata;
+	struct ouichefs_inode_info *ci;
+	struct buffer_head *bh;
+	struct inode *inode;
+
+	inode = ilookup(sb, ino);
+	if (inode) {
+		ci = OUICHEFS_INODE(inode);
+		*parent = ci->parent;
+		*index_block = ci->index_block;
+		iput(inode);
+	} else {
+		idata = ouichefs_get_inode_data(sb, &bh, ino, false, NULL);
+		if (IS_ERR(idata))
+			return PTR_ERR(idata);
+		*parent = le32_to_cpu(idata->i_parent);
+		*index_block = le32_to_cpu(idata->index_block);
+		brelse(bh);
+	}
+
+	/* Deleted inodes have neither */
+	if (!*parent || !*index_block)
+		return -ENOENT;
+	return 0;
+}
+
+/*
+ * Resolves an inode number to its path relative to the root of the file
+ * system by following the parent back-references, i.e. with one inode data
+ * and one directory block read per level. The path is written to the end of
+ * buf (size bytes) and its offset inside buf is returned on success.
+ */
+int ouichefs_ino_to_path(struct super_block *sb, uint32_t ino, char *buf,
+			 int size)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_dir_block *dblock;
+	struct ouichefs_file *f = NULL;
+	struct buffer_head *bh;
+	uint32_t parent, p_parent, index_block, depth = 0;
+	int i, len, pos = size - 1, ret;
+
+	if (ino == 0 || ino >= sbi->nr_inodes)
+		return -EINVAL;
+	if (sbi->ifree_bitmap && test_bit(ino, sbi->ifree_bitmap))
+		return -ENOENT;
+
+	buf[pos] = '\0';
+	ret = ouichefs_get_backref(sb, ino, &parent, &index_block);
+	if (ret)
+		return ret;
+
+	while (ino != 1) {
+		/* There cannot be more levels than inodes; We're in a loop */
+		if (unlikely(++depth >= sbi->nr_inodes)) {
+			pr_warn("Back-references of ino %u form a cycle\n", ino);
+			return -EUCLEAN;
+		}
+
+		/* Get the back-reference of our parent and its dir block */
+		ret = ouichefs_get_backref(sb, parent, &p_parent,
+					   &index_block);
+		if (ret)
+			return ret;
+		bh = ouichefs_bread(sb, index_block);
+		if (!bh)
+			return -EIO;
+		dblock = (struct ouichefs_dir_block *)bh->b_data;
+
+		/* Search for our entry in the parent directory */
+		for (i = 0; i < sbi->max_subfiles; i++) {
+			f = &dblock->files[i];
+			if (!f->inode || f->inode == ino)
+				break;
+		}
+		if (i == sbi->max_subfiles || !f->inode) {
+			brelse(bh);
+			pr_warn("ino %u not found in its parent %u\n", ino, parent);
+			return -EUCLEAN;
+		}
+
+		/* Prepend "/<name>" */
+		len = strnlen(f->filename, OUICHEFS_FILENAME_LEN);
+		if (pos < len + 1) {
+			brelse(bh);
+			return -ENAMETOOLONG;
+		}
+		pos -= len;
+		memcpy(buf + pos, f->filename, len);
+		buf[--pos] = '/';
+		brelse(bh);
+
+		/* Continue with the parent */
+		ino = parent;
+		parent = p_parent;
+	}
+
+	/* The root itself */
+	if (pos == size - 1)
+		buf[--pos] = '/';
+	return pos;
+}
+
 /*
  * Look for dentry in dir.
  * Fill dentry with NULL if not in dir, with the corresponding inode if found.
  * Returns NULL on success.
  */
-static struct dentry *ouichefs_lookup(struct inode *dir, struct dentry *dentry,
-				      unsigned int flags)
+static struct dentry *__ouichefs_lookup(struct inode *dir,
+					struct dentry *dentry)
 {
 	struct super_block *sb = dir->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct ouichefs_inode_info *ci_dir = OUICHEFS_INODE(dir);
 	struct inode *inode = NULL;
 	struct buffer_head *bh = NULL;
@@ -126,13 +367,13 @@ static struct dentry *ouichefs_lookup(struct inode *dir, struct dentry *dentry,
 		return ERR_PTR(-ENAMETOOLONG);
 
 	/* Read the directory index block on disk */
-	bh = sb_bread(sb, ci_dir->index_block);
+	bh = ouichefs_bread_hot(sb, ci_dir->index_block);
 	if (!bh)
 		return ERR_PTR(-EIO);
 	dblock = (struct ouichefs_dir_block *)bh->b_data;
 
 	/* Search for the file in directory */
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
+	for (i = 0; i < sbi->max_subfiles; i++) {
 		f = &dblock->files[i];
 		if (!f->inode)
 			break;
@@ -148,9 +389,11 @@ static struct dentry *ouichefs_lookup(struct inode *dir, struct dentry *dentry,
 	}
 	brelse(bh);
 
-	/* Update directory access time */
-	dir->i_atime = current_time(dir);
-	mark_inode_dirty(dir);
+	/* Update directory access time, unless mounted ro or noatime */
+	if (!IS_NOATIME(dir)) {
+		dir->i_atime = current_time(dir);
+		mark_inode_dirty(dir);
+	}
 
 	/* Fill the dentry with the inode */
 	d_add(dentry, inode);
@@ -158,10 +401,23 @@ static struct dentry *ouichefs_lookup(struct inode *dir, struct dentry *dentry,
 	return NULL;
 }
 
+static struct dentry *ouichefs_lookup(struct inode *dir, struct dentry *dentry,
+				      unsigned int flags)
+{
+	u64 start = local_clock();
+	struct dentry *ret;
+
+	ret = __ouichefs_lookup(dir, dentry);
+	ouichefs_lat_end(OUICHEFS_SB(dir->i_sb), OUICHEFS_LAT_LOOKUP, start);
+	return ret;
+}
+
 /*
- * Create a new inode in dir.
+ * Creates a new inode in dir. If index_block is not 0, the new inode shares
+ * it (and thereby all of its data) instead of getting a fresh one.
  */
-static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
+struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode,
+				 uint32_t index_block)
 {
 	struct inode *inode;
 	struct ouichefs_inode_info *ci;
@@ -193,17 +449,25 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 	}
 	ci = OUICHEFS_INODE(inode);
 
-	/* Get a free block for this new inode's index */
-	ret = ouichefs_alloc_block(sb, &bno);
+	/* Get a free block for this new inode's index, or share one */
+	if (index_block) {
+		ret = ouichefs_get_block(sb, index_block);
+		bno = index_block;
+	} else {
+		ret = ouichefs_alloc_block(sb, &bno,
+					   OUICHEFS_INODE(dir)->index_block);
+	}
 	if (ret < 0)
 		goto put_inode_data;
 	ci->index_block = bno;
+	ci->parent = dir->i_ino;
+	memset(&ci->r_stats, 0, sizeof(ci->r_stats));
 
 	/* Initialize inode */
 	inode_init_owner(&nop_mnt_idmap, inode, dir, mode);
 	inode->i_blocks = 1;
 	if (S_ISDIR(mode)) {
-		i_size_write(inode, OUICHEFS_BLOCK_SIZE);
+		i_size_write(inode, sb->s_blocksize);
 		inode->i_fop = &ouichefs_dir_ops;
 		set_nlink(inode, 2); /* . and .. */
 	} else if (S_ISREG(mode)) {
@@ -223,13 +487,13 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 	struct ouichefs_inode *oi;
 put_inode_data:
 	/* Open inode on disk to clean up allocated inode data */
-	bh = sb_bread(sb, OUICHEFS_GET_INODE_BLOCK(ino));
+	bh = ouichefs_bread(sb, OUICHEFS_GET_INODE_BLOCK(sbi, ino));
 	if (unlikely(!bh))
 		goto put_inode;
 	oi = (struct ouichefs_inode *)bh->b_data;
-	oi += OUICHEFS_GET_INODE_SHIFT(ino);
+	oi += OUICHEFS_GET_INODE_SHIFT(sbi, ino);
 	ouichefs_put_inode_data(sb, ino, oi, 0);
-	mark_buffer_dirty(bh);
+	ouichefs_journal_dirty(sb, bh);
 	brelse(bh);
 put_inode:
 	iput(inode);
@@ -246,13 +510,15 @@ put_ino:
  *   - cleanup index block of the new inode
  *   - add new file/directory in parent index
  */
-static int ouichefs_create(struct mnt_idmap *idmap, struct inode *dir,
-			   struct dentry *dentry, umode_t mode, bool excl)
+static int __ouichefs_create(struct inode *dir, struct dentry *dentry,
+			     umode_t mode)
 {
 	struct super_block *sb = dir->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct inode *inode;
 	uint32_t dir_index_block = OUICHEFS_INODE(dir)->index_block;
 	struct ouichefs_dir_block *dblock;
+	struct ouichefs_dir_stats usage;
 	char *fblock;
 	struct buffer_head *bh, *bh2;
 	int ret = 0, i;
@@ -262,12 +528,12 @@ static int ouichefs_create(struct mnt_idmap *idmap, struct inode *dir,
 		return -ENAMETOOLONG;
 
 	/* Check that we can modify the directory block, clone it otherwise */
-	ret = ouichefs_cow_block(sb, &dir_index_block, OUICHEFS_DIR);
+	ret = ouichefs_cow_block(dir, &dir_index_block, OUICHEFS_DIR);
 	if (unlikely(ret < 0))
 		return ret;
 
 	/* Read parent directory index */
-	bh = sb_bread(sb, dir_index_block);
+	bh = ouichefs_bread(sb, dir_index_block);
 	if (unlikely(!bh)) {
 		ret = -EIO;
 		goto end;
@@ -275,13 +541,13 @@ static int ouichefs_create(struct mnt_idmap *idmap, struct inode *dir,
 	dblock = (struct ouichefs_dir_block *)bh->b_data;
 
 	/* Check if parent directory is full */
-	if (dblock->files[OUICHEFS_MAX_SUBFILES - 1].inode != 0) {
+	if (dblock->files[sbi->max_subfiles - 1].inode != 0) {
 		ret = -EMLINK;
 		goto end;
 	}
 
 	/* Get a new free inode */
-	inode = ouichefs_new_inode(dir, mode);
+	inode = ouichefs_new_inode(dir, mode, 0);
 	if (IS_ERR(inode)) {
 		ret = PTR_ERR(inode);
 		goto end;
@@ -291,24 +557,24 @@ static int ouichefs_create(struct mnt_idmap *idmap, struct inode *dir,
 	 * Scrub index_block for new file/directory to avoid previous data
 	 * messing with new file/directory.
 	 */
-	bh2 = sb_bread(sb, OUICHEFS_INODE(inode)->index_block);
+	bh2 = ouichefs_bread(sb, OUICHEFS_INODE(inode)->index_block);
 	if (!bh2) {
 		ret = -EIO;
 		goto iput;
 	}
 	fblock = (char *)bh2->b_data;
-	memset(fblock, 0, OUICHEFS_BLOCK_SIZE);
-	mark_buffer_dirty(bh2);
+	memset(fblock, 0, sb->s_blocksize);
+	ouichefs_journal_dirty(sb, bh2);
 	brelse(bh2);
 
 	/* Find first free slot in parent index and register new inode */
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++)
+	for (i = 0; i < sbi->max_subfiles; i++)
 		if (dblock->files[i].inode == 0)
 			break;
 	dblock->files[i].inode = inode->i_ino;
 	strscpy(dblock->files[i].filename, dentry->d_name.name,
 		OUICHEFS_FILENAME_LEN);
-	mark_buffer_dirty(bh);
+	ouichefs_journal_dirty(sb, bh);
 	brelse(bh);
 
 	/* Update stats and mark dir and new inode dirty */
@@ -319,6 +585,10 @@ static int ouichefs_create(struct mnt_idmap *idmap, struct inode *dir,
 	OUICHEFS_INODE(dir)->index_block = dir_index_block;
 	mark_inode_dirty(dir);
 
+	/* Account the new inode in all directories above it */
+	ouichefs_inode_usage(inode, &usage);
+	ouichefs_dir_stats_propagate(dentry, &usage);
+
 	/* setup dentry */
 	d_instantiate(dentry, inode);
 
@@ -339,36 +609,43 @@ end:
 	return ret;
 }
 
+static int ouichefs_create(struct mnt_idmap *idmap, struct inode *dir,
+			   struct dentry *dentry, umode_t mode, bool excl)
+{
+	struct ouichefs_handle handle;
+	u64 start = local_clock();
+	int ret;
+
+	ouichefs_journal_start_credits(dir->i_sb, &handle,
+				       ouichefs_dir_stats_credits(dentry));
+	ret = __ouichefs_create(dir, dentry, mode);
+	ouichefs_journal_stop(&handle);
+	ouichefs_lat_end(OUICHEFS_SB(dir->i_sb), OUICHEFS_LAT_CREATE, start);
+	return ret;
+}
+
 /*
- * Remove a link for a file. If link count is 0, destroy file in this way:
- *   - remove the file from its parent directory.
- *   - cleanup blocks containing data
- *   - cleanup file index block
- *   - cleanup inode
+ * Removes the entry of the inode ino from the directory dir and updates the
+ * directory. The directory block is cloned first if a snapshot shares it.
  */
-static int ouichefs_unlink(struct inode *dir, struct dentry *dentry)
+int ouichefs_dir_remove_entry(struct inode *dir, uint32_t ino, bool is_dir)
 {
 	struct super_block *sb = dir->i_sb;
-	struct inode *inode = d_inode(dentry);
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct buffer_head *bh = NULL;
-	struct ouichefs_inode *disk_inode = NULL;
 	struct ouichefs_dir_block *dir_block = NULL;
-	bool is_dir = S_ISDIR(inode->i_mode);
-	uint32_t ino = inode->i_ino;
 	uint32_t dir_index_block = OUICHEFS_INODE(dir)->index_block;
-	uint32_t bno;
 	int i, ret, f_id, nr_subs;
 
 	f_id = -1;
-	bno = OUICHEFS_INODE(inode)->index_block;
 
 	/* Check that we can modify the directory block, clone it otherwise */
-	ret = ouichefs_cow_block(sb, &dir_index_block, OUICHEFS_DIR);
+	ret = ouichefs_cow_block(dir, &dir_index_block, OUICHEFS_DIR);
 	if (unlikely(ret < 0))
 		return ret;
 
 	/* Read parent directory index */
-	bh = sb_bread(sb, dir_index_block);
+	bh = ouichefs_bread(sb, dir_index_block);
 	if (unlikely(!bh)) {
 		ret = -EIO;
 		goto failed;
@@ -376,7 +653,7 @@ static int ouichefs_unlink(struct inode *dir, struct dentry *dentry)
 	dir_block = (struct ouichefs_dir_block *)bh->b_data;
 
 	/* Search for inode in parent index and get number of subfiles */
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
+	for (i = 0; i < sbi->max_subfiles; i++) {
 		if (dir_block->files[i].inode == ino)
 			f_id = i;
 		else if (dir_block->files[i].inode == 0)
@@ -385,11 +662,11 @@ static int ouichefs_unlink(struct inode *dir, struct dentry *dentry)
 	nr_subs = i;
 
 	/* Remove file from parent directory */
-	if (f_id != OUICHEFS_MAX_SUBFILES - 1)
+	if (f_id != sbi->max_subfiles - 1)
 		memmove(dir_block->files + f_id, dir_block->files + f_id + 1,
 			(nr_subs - f_id - 1) * sizeof(struct ouichefs_file));
 	memset(&dir_block->files[nr_subs - 1], 0, sizeof(struct ouichefs_file));
-	mark_buffer_dirty(bh);
+	ouichefs_journal_dirty(sb, bh);
 	brelse(bh);
 
 	/* Update inode stats */
@@ -399,9 +676,33 @@ static int ouichefs_unlink(struct inode *dir, struct dentry *dentry)
 	OUICHEFS_INODE(dir)->index_block = dir_index_block;
 	mark_inode_dirty(dir);
 
+	return 0;
+
+failed:
+	if (dir_index_block != OUICHEFS_INODE(dir)->index_block)
+		ouichefs_put_block(sb, dir_index_block, OUICHEFS_DIR);
+	return ret;
+}
+
+/*
+ * Releases the index block and the live inode data of an inode that is no
+ * longer linked in any directory. The inode number is freed once no snapshot
+ * references it anymore.
+ */
+int ouichefs_release_inode(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct buffer_head *bh = NULL;
+	struct ouichefs_inode *disk_inode = NULL;
+	bool is_dir = S_ISDIR(inode->i_mode);
+	uint32_t ino = inode->i_ino;
+	uint32_t bno = OUICHEFS_INODE(inode)->index_block;
+
 	/* Cleanup inode and mark dirty */
 	inode->i_blocks = 0;
 	OUICHEFS_INODE(inode)->index_block = 0;
+	OUICHEFS_INODE(inode)->parent = 0;
 	i_size_write(inode, 0);
 	i_uid_write(inode, 0);
 	i_gid_write(inode, 0);
@@ -417,37 +718,76 @@ static int ouichefs_unlink(struct inode *dir, struct dentry *dentry)
 	ouichefs_put_block(sb, bno, is_dir ? OUICHEFS_DIR : OUICHEFS_INDEX);
 
 	/* Opening inode on disk to delete it */
-	bh = sb_bread(sb, OUICHEFS_GET_INODE_BLOCK(ino));
+	bh = ouichefs_bread(sb, OUICHEFS_GET_INODE_BLOCK(sbi, ino));
 	if (unlikely(!bh))
 		return -EIO;
 	disk_inode = (struct ouichefs_inode *)bh->b_data;
-	disk_inode += OUICHEFS_GET_INODE_SHIFT(ino);
+	disk_inode += OUICHEFS_GET_INODE_SHIFT(sbi, ino);
 
 	/* Perform data cleanup */
 	pr_debug("Putting inode %u (idx %u, index block %u)\n", ino, disk_inode->i_data[0], bno);
 	ouichefs_put_inode_data(sb, ino, disk_inode, 0);
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
+	ouichefs_journal_dirty_sync(sb, bh);
 	brelse(bh);
 
 	return 0;
+}
 
-failed:
-	if (dir_index_block != OUICHEFS_INODE(dir)->index_block)
-		ouichefs_put_block(sb, dir_index_block, OUICHEFS_DIR);
+/*
+ * Remove a link for a file. If link count is 0, destroy file in this way:
+ *   - remove the file from its parent directory.
+ *   - cleanup blocks containing data
+ *   - cleanup file index block
+ *   - cleanup inode
+ */
+static int __ouichefs_unlink(struct inode *dir, struct dentry *dentry)
+{
+	struct inode *inode = d_inode(dentry);
+	struct ouichefs_dir_stats usage;
+	int ret;
+
+	/* Remove file from parent directory */
+	ret = ouichefs_dir_remove_entry(dir, inode->i_ino,
+					S_ISDIR(inode->i_mode));
+	if (ret)
+		return ret;
+
+	/* Remove the inode from the statistics of all directories above it */
+	ouichefs_inode_usage(inode, &usage);
+	usage.bytes = -usage.bytes;
+	usage.blocks = -usage.blocks;
+	usage.files = -usage.files;
+	ouichefs_dir_stats_propagate(dentry, &usage);
+
+	return ouichefs_release_inode(inode);
+}
+
+static int ouichefs_unlink(struct inode *dir, struct dentry *dentry)
+{
+	struct ouichefs_handle handle;
+	u64 start = local_clock();
+	int ret;
+
+	ouichefs_journal_start_credits(dir->i_sb, &handle,
+				       ouichefs_dir_stats_credits(dentry));
+	ret = __ouichefs_unlink(dir, dentry);
+	ouichefs_journal_stop(&handle);
+	ouichefs_lat_end(OUICHEFS_SB(dir->i_sb), OUICHEFS_LAT_UNLINK, start);
 	return ret;
 }
 
-static int ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
-			   struct dentry *old_dentry, struct inode *new_dir,
-			   struct dentry *new_dentry, unsigned int flags)
+static int __ouichefs_rename(struct inode *old_dir, struct dentry *old_dentry,
+			     struct inode *new_dir, struct dentry *new_dentry,
+			     unsigned int flags)
 {
 	struct super_block *sb = old_dir->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct ouichefs_inode_info *ci_old = OUICHEFS_INODE(old_dir);
 	struct ouichefs_inode_info *ci_new = OUICHEFS_INODE(new_dir);
 	struct inode *src = d_inode(old_dentry);
 	struct buffer_head *bh_old = NULL, *bh_new = NULL;
 	struct ouichefs_dir_block *dir_block = NULL;
+	struct ouichefs_dir_stats usage;
 	int i, f_id = -1, new_pos = -1, ret, nr_subs, f_pos = -1;
 	uint32_t new_index_block = ci_new->index_block;
 
@@ -460,16 +800,16 @@ static int ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
 		return -ENAMETOOLONG;
 
 	/* Check that we can modify the directory block, clone it otherwise */
-	ret = ouichefs_cow_block(sb, &new_index_block, OUICHEFS_DIR);
+	ret = ouichefs_cow_block(new_dir, &new_index_block, OUICHEFS_DIR);
 	if (unlikely(ret < 0))
 		return ret;
 
 	/* Fail if new_dentry exists or if new_dir is full */
-	bh_new = sb_bread(sb, new_index_block);
+	bh_new = ouichefs_bread(sb, new_index_block);
 	if (!bh_new)
 		return -EIO;
 	dir_block = (struct ouichefs_dir_block *)bh_new->b_data;
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
+	for (i = 0; i < sbi->max_subfiles; i++) {
 		/* if old_dir == new_dir, save the renamed file position */
 		if (new_dir == old_dir) {
 			if (strncmp(dir_block->files[i].filename,
@@ -490,9 +830,13 @@ static int ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
 	if (old_dir == new_dir) {
 		strscpy(dir_block->files[f_pos].filename,
 			new_dentry->d_name.name, OUICHEFS_FILENAME_LEN);
-		mark_buffer_dirty(bh_new);
-		ret = 0;
-		goto relse_new;
+		ouichefs_journal_dirty(sb, bh_new);
+		brelse(bh_new);
+
+		new_dir->i_ctime = new_dir->i_mtime = current_time(new_dir);
+		ci_new->index_block = new_index_block;
+		mark_inode_dirty(new_dir);
+		return 0;
 	}
 
 	/* If new directory is empty, fail */
@@ -505,7 +849,11 @@ static int ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
 	dir_block->files[new_pos].inode = src->i_ino;
 	strscpy(dir_block->files[new_pos].filename, new_dentry->d_name.name,
 		OUICHEFS_FILENAME_LEN);
-	mark_buffer_dirty(bh_new);
+	ouichefs_journal_dirty(sb, bh_new);
+
+	/* Update back-reference of the moved inode */
+	OUICHEFS_INODE(src)->parent = new_dir->i_ino;
+	mark_inode_dirty(src);
 	brelse(bh_new);
 
 	/* Update new parent inode metadata */
@@ -517,16 +865,16 @@ static int ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
 	mark_inode_dirty(new_dir);
 
 	/* remove target from old parent directory */
-	ret = ouichefs_cow_block(sb, &ci_old->index_block, OUICHEFS_DIR);
+	ret = ouichefs_cow_block(old_dir, &ci_old->index_block, OUICHEFS_DIR);
 	if (unlikely(ret < 0))
 		return ret;
-	bh_old = sb_bread(sb, ci_old->index_block);
+	bh_old = ouichefs_bread(sb, ci_old->index_block);
 	if (!bh_old)
 		return -EIO;
 	dir_block = (struct ouichefs_dir_block *)bh_old->b_data;
 
 	/* Search for inode in old directory and number of subfiles */
-	for (i = 0; OUICHEFS_MAX_SUBFILES; i++) {
+	for (i = 0; i < sbi->max_subfiles; i++) {
 		if (dir_block->files[i].inode == src->i_ino)
 			f_id = i;
 		else if (dir_block->files[i].inode == 0)
@@ -535,11 +883,11 @@ static int ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
 	nr_subs = i;
 
 	/* Remove file from old parent directory */
-	if (f_id != OUICHEFS_MAX_SUBFILES - 1)
+	if (f_id != sbi->max_subfiles - 1)
 		memmove(dir_block->files + f_id, dir_block->files + f_id + 1,
 			(nr_subs - f_id - 1) * sizeof(struct ouichefs_file));
 	memset(&dir_block->files[nr_subs - 1], 0, sizeof(struct ouichefs_file));
-	mark_buffer_dirty(bh_old);
+	ouichefs_journal_dirty(sb, bh_old);
 	brelse(bh_old);
 
 	/* Update old parent inode metadata */
@@ -549,11 +897,39 @@ static int ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
 		inode_dec_link_count(old_dir);
 	mark_inode_dirty(old_dir);
 
+	/* Move the statistics of src from the old to the new parents */
+	ouichefs_inode_usage(src, &usage);
+	ouichefs_dir_stats_propagate(new_dentry, &usage);
+	usage.bytes = -usage.bytes;
+	usage.blocks = -usage.blocks;
+	usage.files = -usage.files;
+	ouichefs_dir_stats_propagate(old_dentry, &usage);
+
 	return 0;
 
 relse_new:
 	brelse(bh_new);
-	ouichefs_put_block(sb, new_index_block, OUICHEFS_DIR);
+	if (new_index_block != ci_new->index_block)
+		ouichefs_put_block(sb, new_index_block, OUICHEFS_DIR);
+	return ret;
+}
+
+static int ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
+			   struct dentry *old_dentry, struct inode *new_dir,
+			   struct dentry *new_dentry, unsigned int flags)
+{
+	struct ouichefs_handle handle;
+	u64 start = local_clock();
+	int ret;
+
+	ouichefs_journal_start_credits(old_dir->i_sb, &handle,
+				       ouichefs_dir_stats_credits(old_dentry) +
+				       ouichefs_dir_stats_credits(new_dentry));
+	ret = __ouichefs_rename(old_dir, old_dentry, new_dir, new_dentry,
+				flags);
+	ouichefs_journal_stop(&handle);
+	ouichefs_lat_end(OUICHEFS_SB(old_dir->i_sb), OUICHEFS_LAT_RENAME,
+			 start);
 	return ret;
 }
 
@@ -574,7 +950,7 @@ static int ouichefs_rmdir(struct inode *dir, struct dentry *dentry)
 	/* If the directory is not empty, fail */
 	if (inode->i_nlink > 2)
 		return -ENOTEMPTY;
-	bh = sb_bread(sb, OUICHEFS_INODE(inode)->index_block);
+	bh = ouichefs_bread(sb, OUICHEFS_INODE(inode)->index_block);
 	if (!bh)
 		return -EIO;
 	dblock = (struct ouichefs_dir_block *)bh->b_data;
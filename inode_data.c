@@ -14,14 +14,17 @@
 #include <linux/printk.h>
 
 #include "ouichefs.h"
+#include "ouichefs_trace.h"
 #include "bitmap.h"
 
 
 /*
  * This function loads inode data from disk, allocating a new inode data entry
- * if it is new ('allocate'). If we want to write to the inode data, 'is_cow'
- * must be set. Setting both is illegal. The buffer_head that the inode data
- * resides in is returned in 'id_bh'; You have to release it once you are done.
+ * if it is new ('allocate'). If we want to write to the inode data, 'copied'
+ * must point to a bool, set to true if the entry was shared with a snapshot
+ * and had to be copied. Setting both is illegal. The buffer_head that the
+ * inode data resides in is returned in 'id_bh'; You have to release it once
+ * you are done.
  *
  * If the given inode does not exist in the current snapshot, -EINVAL is
  * returned.
@@ -29,9 +32,10 @@
 struct ouichefs_inode_data *ouichefs_get_inode_data(struct super_block *sb,
 						    struct buffer_head **id_bh,
 						    uint32_t ino, bool allocate,
-						    bool is_cow)
+						    bool *copied)
 {
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	bool is_cow = copied;
 	struct buffer_head *bh_ino, *bh_idx, *bh_id;
 	struct ouichefs_inode_data *inode_data = NULL;
 	struct ouichefs_inode_data_index_block *ididx = NULL;
@@ -40,11 +44,11 @@ struct ouichefs_inode_data *ouichefs_get_inode_data(struct super_block *sb,
 	int ret;
 
 	/* Open inode on disk; That is the snapshot -> inode data mapping */
-	bh_ino = sb_bread(sb, OUICHEFS_GET_INODE_BLOCK(ino));
+	bh_ino = ouichefs_bread_hot(sb, OUICHEFS_GET_INODE_BLOCK(sbi, ino));
 	if (unlikely(!bh_ino))
 		return ERR_PTR(-EIO);
 	inode = (struct ouichefs_inode *)bh_ino->b_data;
-	inode += OUICHEFS_GET_INODE_SHIFT(ino);
+	inode += OUICHEFS_GET_INODE_SHIFT(sbi, ino);
 	idx = inode->i_data[0];
 
 	/* Check if idx is valid; Map new idx if necessary */
@@ -62,13 +66,13 @@ struct ouichefs_inode_data *ouichefs_get_inode_data(struct super_block *sb,
 		return ERR_PTR(-EINVAL);
 	}
 
-	pr_debug("ino=%u, idx=%u, IDIDX_BLOCK=%u, IDIDX_INDEX=%lu, IDIDX_SHIFT=%lu\n",
+	pr_debug("ino=%u, idx=%u, IDIDX_BLOCK=%u, IDIDX_INDEX=%u, IDIDX_SHIFT=%u\n",
 		ino, idx, OUICHEFS_GET_IDIDX_BLOCK(sbi, idx),
 		OUICHEFS_GET_IDIDX_INDEX(sbi, idx), OUICHEFS_GET_IDIDX_SHIFT(sbi, idx)
 	);
 
 	/* Open the inode data index */
-	bh_idx = sb_bread(sb, OUICHEFS_GET_IDIDX_BLOCK(sbi, idx));
+	bh_idx = ouichefs_bread_hot(sb, OUICHEFS_GET_IDIDX_BLOCK(sbi, idx));
 	if (unlikely(!bh_idx)) {
 		ret = -EIO;
 		goto failed_idx;
@@ -78,7 +82,7 @@ struct ouichefs_inode_data *ouichefs_get_inode_data(struct super_block *sb,
 
 	/* Check if bno is valid; Allocate new block if necessary */
 	if (allocate && bno == 0) {
-		ret = ouichefs_alloc_block(sb, &bno);
+		ret = ouichefs_alloc_zeroed_block(sb, &bno);
 
 		if (unlikely(ret))
 			goto failed_bno;
@@ -90,7 +94,7 @@ struct ouichefs_inode_data *ouichefs_get_inode_data(struct super_block *sb,
 	}
 
 	/* Open the inode data block */
-	bh_id = sb_bread(sb, bno);
+	bh_id = ouichefs_bread_hot(sb, bno);
 	if (unlikely(!bh_id)) {
 		ret = -EIO;
 		goto failed_alloc_bno;
@@ -101,8 +105,7 @@ struct ouichefs_inode_data *ouichefs_get_inode_data(struct super_block *sb,
 	/* Set reference counter if this is a new inode */
 	if (allocate) {
 		inode_data->refcount = 1;
-		mark_buffer_dirty(bh_id);
-		sync_dirty_buffer(bh_id);
+		ouichefs_journal_dirty_sync(sb, bh_id);
 	} else if (inode_data->refcount == 0)
 		pr_warn("Refcount is 0! (idx=%u, ino=%u)\n", idx, ino);
 
@@ -124,29 +127,32 @@ struct ouichefs_inode_data *ouichefs_get_inode_data(struct super_block *sb,
 		pr_debug("ino=%u, idx=%u, bno=%u, refcount=%u: CoWing it!\n",
 			ino, idx, bno, inode_data->refcount);
 		inode_data->refcount--;
-		mark_buffer_dirty(bh_id);
-		sync_dirty_buffer(bh_id);
+		ouichefs_journal_dirty_sync(sb, bh_id);
+		ouichefs_stat_inc(sbi, OUICHEFS_STAT_IDE_COW);
+		*copied = true;
 		brelse(bh_id);
 		brelse(bh_idx);
 		brelse(bh_ino);
-		return ouichefs_get_inode_data(sb, id_bh, ino, true, true);
+		return ouichefs_get_inode_data(sb, id_bh, ino, true, copied);
 	}
 
 	pr_debug("ino=%u, idx=%u, bno=%u, refcount=%u\n",
 		ino, idx, bno, inode_data->refcount);
+	trace_ouichefs_get_inode_data(sb, ino, idx, bno, inode_data->refcount,
+				      allocate, is_cow);
 
 	/* Update and release intermediate blocks */
 	if (ididx->blocks[OUICHEFS_GET_IDIDX_INDEX(sbi, idx)] != bno) {
 		pr_debug("Allocated bno=%u (idx=%u, ino=%u)\n",
 			bno, idx, ino);
 		ididx->blocks[OUICHEFS_GET_IDIDX_INDEX(sbi, idx)] = bno;
-		mark_buffer_dirty(bh_idx);
+		ouichefs_journal_dirty(sb, bh_idx);
 	}
 	brelse(bh_idx);
 	if (inode->i_data[0] != idx) {
 		pr_debug("Mapped idx=%u (ino=%u)\n", idx, ino);
 		inode->i_data[0] = idx;
-		mark_buffer_dirty(bh_ino);
+		ouichefs_journal_dirty(sb, bh_ino);
 	}
 	brelse(bh_ino);
 
@@ -167,6 +173,56 @@ failed_idx:
 	return ERR_PTR(ret);
 }
 
+/*
+ * Reads the inode data of ino in the current snapshot without modifying
+ * anything. Unlike ouichefs_get_inode_data(), this does not warn about free
+ * entries: the inode may be freed concurrently. Returns -ENOENT if ino has
+ * no inode data. The buffer_head is returned in 'id_bh', as above.
+ */
+struct ouichefs_inode_data *ouichefs_peek_inode_data(struct super_block *sb,
+						     struct buffer_head **id_bh,
+						     uint32_t ino)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_data_index_block *ididx;
+	struct ouichefs_inode_data *inode_data;
+	struct ouichefs_inode *inode;
+	struct buffer_head *bh;
+	uint32_t idx, bno;
+
+	bh = ouichefs_bread_hot(sb, OUICHEFS_GET_INODE_BLOCK(sbi, ino));
+	if (unlikely(!bh))
+		return ERR_PTR(-EIO);
+	inode = (struct ouichefs_inode *)bh->b_data;
+	inode += OUICHEFS_GET_INODE_SHIFT(sbi, ino);
+	idx = inode->i_data[0];
+	brelse(bh);
+	if (idx == 0 || idx >= sbi->nr_inode_data_entries)
+		return ERR_PTR(-ENOENT);
+
+	bh = ouichefs_bread_hot(sb, OUICHEFS_GET_IDIDX_BLOCK(sbi, idx));
+	if (unlikely(!bh))
+		return ERR_PTR(-EIO);
+	ididx = (struct ouichefs_inode_data_index_block *)bh->b_data;
+	bno = ididx->blocks[OUICHEFS_GET_IDIDX_INDEX(sbi, idx)];
+	brelse(bh);
+	if (bno < OUICHEFS_GET_DATA_START(sbi) || bno >= sbi->nr_blocks)
+		return ERR_PTR(-ENOENT);
+
+	bh = ouichefs_bread_hot(sb, bno);
+	if (unlikely(!bh))
+		return ERR_PTR(-EIO);
+	inode_data = (struct ouichefs_inode_data *)bh->b_data;
+	inode_data += OUICHEFS_GET_IDIDX_SHIFT(sbi, idx);
+	if (inode_data->refcount == 0) {
+		brelse(bh);
+		return ERR_PTR(-ENOENT);
+	}
+
+	*id_bh = bh;
+	return inode_data;
+}
+
 /*
  * Shares inode data across two snapshots
  */
@@ -192,7 +248,7 @@ int ouichefs_link_inode_data(struct super_block *sb, uint32_t ino,
 	}
 
 	/* Open the inode data index */
-	bh = sb_bread(sb, OUICHEFS_GET_IDIDX_BLOCK(sbi, idx));
+	bh = ouichefs_bread(sb, OUICHEFS_GET_IDIDX_BLOCK(sbi, idx));
 	if (unlikely(!bh))
 		return -EIO;
 	ididx = (struct ouichefs_inode_data_index_block *)bh->b_data;
@@ -207,7 +263,7 @@ int ouichefs_link_inode_data(struct super_block *sb, uint32_t ino,
 	}
 
 	/* Open the inode data block */
-	bh = sb_bread(sb, bno);
+	bh = ouichefs_bread(sb, bno);
 	if (unlikely(!bh))
 		return -EIO;
 	inode_data = (struct ouichefs_inode_data *)bh->b_data;
@@ -226,7 +282,7 @@ int ouichefs_link_inode_data(struct super_block *sb, uint32_t ino,
 	 * it up early
 	 */
 	ouichefs_get_block(sb, inode_data->index_block);
-	mark_buffer_dirty(bh);
+	ouichefs_journal_dirty(sb, bh);
 	brelse(bh);
 
 	/* Replace the inode data */
@@ -262,7 +318,7 @@ void ouichefs_put_inode_data(struct super_block *sb, uint32_t ino,
 	}
 
 	/* Open the inode data index */
-	bh_idx = sb_bread(sb, OUICHEFS_GET_IDIDX_BLOCK(sbi, idx));
+	bh_idx = ouichefs_bread(sb, OUICHEFS_GET_IDIDX_BLOCK(sbi, idx));
 	if (unlikely(!bh_idx))
 		goto check_free_ino;
 	ididx = (struct ouichefs_inode_data_index_block *)bh_idx->b_data;
@@ -280,7 +336,7 @@ void ouichefs_put_inode_data(struct super_block *sb, uint32_t ino,
 	 * other than the refcount may be 0 already (if the inode was never
 	 * written before deletion)
 	 */
-	bh_bno = sb_bread(sb, bno);
+	bh_bno = ouichefs_bread(sb, bno);
 	if (unlikely(!bh_bno))
 		goto brelse_idx;
 	inode_data = (struct ouichefs_inode_data *)bh_bno->b_data;
@@ -313,7 +369,7 @@ void ouichefs_put_inode_data(struct super_block *sb, uint32_t ino,
 
 		/* Check if the whole inode data block is empty */
 		inode_data = (struct ouichefs_inode_data *)bh_bno->b_data;
-		for (int i = 0; i < OUICHEFS_IDE_PER_DATA_BLOCK; i++) {
+		for (int i = 0; i < sbi->ide_per_block; i++) {
 			if ((inode_data + i)->refcount > 0)
 				goto dirty_bno;
 		}
@@ -325,12 +381,12 @@ void ouichefs_put_inode_data(struct super_block *sb, uint32_t ino,
 		/* Unmap associated block in ididx */
 		pr_debug("Unmap inode data block %u\n", bno);
 		ididx->blocks[OUICHEFS_GET_IDIDX_INDEX(sbi, idx)] = 0;
-		mark_buffer_dirty(bh_idx);
+		ouichefs_journal_dirty(sb, bh_idx);
 		goto brelse_idx;
 	}
 
 dirty_bno:
-	mark_buffer_dirty(bh_bno);
+	ouichefs_journal_dirty(sb, bh_bno);
 brelse_bno:
 	brelse(bh_bno);
 brelse_idx:
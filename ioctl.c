@@ -0,0 +1,405 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include <linux/slab.h>
+#include <linux/capability.h>
+#include <linux/buffer_head.h>
+#include <linux/blkdev.h>
+#include <linux/sched/signal.h>
+#include <linux/string.h>
+#include <linux/file.h>
+
+#include "ouichefs.h"
+#include "ouichefs_ioctl.h"
+
+/*
+ * Returns the recursive statistics of a directory. These are maintained
+ * incrementally, so this is O(1) regardless of the size of the subtree.
+ */
+static long ouichefs_ioc_get_dirstats(struct file *file, void __user *arg)
+{
+	struct inode *inode = file_inode(file);
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_ioc_dirstats stats;
+
+	if (!S_ISDIR(inode->i_mode))
+		return -ENOTDIR;
+
+	spin_lock(&sbi->dstats_lock);
+	stats.bytes = ci->r_stats.bytes;
+	stats.blocks = ci->r_stats.blocks;
+	stats.files = ci->r_stats.files;
+	spin_unlock(&sbi->dstats_lock);
+
+	if (copy_to_user(arg, &stats, sizeof(stats)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * Resolves an inode number to a path using the parent back-references
+ * stored in the inode data, without walking the directory tree.
+ */
+static long ouichefs_ioc_ino_to_path(struct file *file, void __user *arg)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+	struct ouichefs_ioc_ino_path req;
+	char *buf;
+	int pos, len;
+	long ret = 0;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	buf = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	pos = ouichefs_ino_to_path(sb, req.ino, buf, PATH_MAX);
+	if (pos < 0) {
+		ret = pos;
+		goto out;
+	}
+
+	/* Copy the path including its terminating NUL */
+	len = PATH_MAX - pos;
+	if (len > req.size) {
+		ret = -ENAMETOOLONG;
+		goto out;
+	}
+	if (copy_to_user(u64_to_user_ptr(req.path), buf + pos, len))
+		ret = -EFAULT;
+
+out:
+	kfree(buf);
+	return ret;
+}
+
+/* Number of inode store blocks kept in flight while streaming through it */
+#define OUICHEFS_BULKSTAT_RA 16
+
+static_assert(OUICHEFS_MAX_SNAPSHOTS <= 32,
+	      "ouichefs_ioc_bstat.snapshots cannot fit OUICHEFS_MAX_SNAPSHOTS!");
+
+/*
+ * Buffers kept open while streaming through the inode store. Inodes with
+ * close numbers usually share their inode store, id_idx and inode data
+ * blocks, so most lookups do not need to touch the buffer cache at all.
+ */
+struct ouichefs_bulkstat_cursor {
+	struct buffer_head *bh_ino;
+	struct buffer_head *bh_idx;
+	struct buffer_head *bh_id;
+};
+
+static struct buffer_head *cursor_bread(struct super_block *sb,
+					struct buffer_head **bh,
+					sector_t block)
+{
+	if (*bh && (*bh)->b_blocknr == block)
+		return *bh;
+	brelse(*bh);
+	*bh = ouichefs_bread(sb, block);
+	return *bh;
+}
+
+static void cursor_release(struct ouichefs_bulkstat_cursor *cur)
+{
+	brelse(cur->bh_ino);
+	brelse(cur->bh_idx);
+	brelse(cur->bh_id);
+}
+
+/*
+ * Fills in the metadata of a single used inode.
+ */
+static int ouichefs_bulkstat_one(struct super_block *sb,
+				 struct ouichefs_bulkstat_cursor *cur,
+				 uint32_t ino, struct ouichefs_ioc_bstat *bs)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_data_index_block *ididx;
+	struct ouichefs_inode_data *idata;
+	struct ouichefs_inode *disk_inode;
+	struct inode *inode;
+	uint32_t idx, bno;
+
+	memset(bs, 0, sizeof(*bs));
+	bs->ino = ino;
+
+	/* Snapshot presence straight from the inode store */
+	if (!cursor_bread(sb, &cur->bh_ino, OUICHEFS_GET_INODE_BLOCK(sbi, ino)))
+		return -EIO;
+	disk_inode = (struct ouichefs_inode *)cur->bh_ino->b_data;
+	disk_inode += OUICHEFS_GET_INODE_SHIFT(sbi, ino);
+	for (int i = 0; i < OUICHEFS_MAX_SNAPSHOTS; i++) {
+		if (disk_inode->i_data[i])
+			bs->snapshots |= 1u << i;
+	}
+
+	/* Only exists in snapshots */
+	idx = disk_inode->i_data[0];
+	if (!idx)
+		return 0;
+
+	/* Cached inodes may be newer than their inode data on disk */
+	inode = ilookup(sb, ino);
+	if (inode) {
+		bs->mode = inode->i_mode;
+		bs->uid = i_uid_read(inode);
+		bs->gid = i_gid_read(inode);
+		bs->nlink = inode->i_nlink;
+		bs->blocks = inode->i_blocks;
+		bs->index_block = OUICHEFS_INODE(inode)->index_block;
+		bs->size = i_size_read(inode);
+		bs->atime = inode->i_atime.tv_sec;
+		bs->atime_nsec = inode->i_atime.tv_nsec;
+		bs->mtime = inode->i_mtime.tv_sec;
+		bs->mtime_nsec = inode->i_mtime.tv_nsec;
+		bs->ctime = inode->i_ctime.tv_sec;
+		bs->ctime_nsec = inode->i_ctime.tv_nsec;
+		iput(inode);
+		return 0;
+	}
+
+	/* Find the inode data entry through the id_idx */
+	if (unlikely(idx >= sbi->nr_inode_data_entries)) {
+		pr_warn("Illegal access to idx=%u (ino=%u)\n", idx, ino);
+		return -EUCLEAN;
+	}
+	if (!cursor_bread(sb, &cur->bh_idx, OUICHEFS_GET_IDIDX_BLOCK(sbi, idx)))
+		return -EIO;
+	ididx = (struct ouichefs_inode_data_index_block *)cur->bh_idx->b_data;
+	bno = ididx->blocks[OUICHEFS_GET_IDIDX_INDEX(sbi, idx)];
+	if (unlikely(bno < OUICHEFS_GET_DATA_START(sbi) || bno >= sbi->nr_blocks)) {
+		pr_warn("Illegal access to bno=%u (idx=%u, ino=%u)\n",
+			bno, idx, ino);
+		return -EUCLEAN;
+	}
+	if (!cursor_bread(sb, &cur->bh_id, bno))
+		return -EIO;
+	idata = (struct ouichefs_inode_data *)cur->bh_id->b_data;
+	idata += OUICHEFS_GET_IDIDX_SHIFT(sbi, idx);
+
+	bs->mode = le32_to_cpu(idata->i_mode);
+	bs->uid = le32_to_cpu(idata->i_uid);
+	bs->gid = le32_to_cpu(idata->i_gid);
+	bs->nlink = le32_to_cpu(idata->i_nlink);
+	bs->blocks = le32_to_cpu(idata->i_blocks);
+	bs->index_block = le32_to_cpu(idata->index_block);
+	bs->size = le32_to_cpu(idata->i_size);
+	bs->atime = le32_to_cpu(idata->i_atime);
+	bs->atime_nsec = le64_to_cpu(idata->i_natime);
+	bs->mtime = le32_to_cpu(idata->i_mtime);
+	bs->mtime_nsec = le64_to_cpu(idata->i_nmtime);
+	bs->ctime = le32_to_cpu(idata->i_ctime);
+	bs->ctime_nsec = le64_to_cpu(idata->i_nctime);
+	return 0;
+}
+
+/*
+ * Returns the first inode at or after ino that may be used. Read-only mounts
+ * have no ifree bitmap, every inode is returned.
+ */
+static uint32_t ouichefs_next_inode(struct ouichefs_sb_info *sbi, uint32_t ino)
+{
+	if (!sbi->ifree_bitmap)
+		return ino;
+	return find_next_zero_bit(sbi->ifree_bitmap, sbi->nr_inodes, ino);
+}
+
+/*
+ * Streams the inode store in order, skipping free inodes using the in-memory
+ * ifree bitmap. The inode store is read ahead, so full metadata scans run at
+ * sequential read speed instead of one random read per stat().
+ */
+static long ouichefs_ioc_bulkstat(struct file *file, void __user *arg)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_bulkstat_cursor cur = { 0 };
+	struct ouichefs_ioc_bstat __user *ubuf;
+	struct ouichefs_ioc_bulkstat req;
+	struct ouichefs_ioc_bstat bs;
+	struct blk_plug plug;
+	uint32_t ino, block, ra_block = 0, done = 0;
+	long ret = 0;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+	ubuf = u64_to_user_ptr(req.buf);
+
+	/* Inode 0 does not exist */
+	ino = max_t(uint32_t, req.start_ino, 1);
+	for (ino = ouichefs_next_inode(sbi, ino);
+	     ino < sbi->nr_inodes && done < req.count;
+	     ino = ouichefs_next_inode(sbi, ino + 1)) {
+		/* Keep the next inode store blocks in flight */
+		block = OUICHEFS_GET_INODE_BLOCK(sbi, ino);
+		if (ra_block <= block)
+			ra_block = block + 1;
+		blk_start_plug(&plug);
+		while (ra_block < block + OUICHEFS_BULKSTAT_RA &&
+		       ra_block <= sbi->nr_istore_blocks)
+			ouichefs_breadahead(sb, ra_block++);
+		blk_finish_plug(&plug);
+
+		ret = ouichefs_bulkstat_one(sb, &cur, ino, &bs);
+		if (ret)
+			break;
+		/* Free inodes are only visited without ifree bitmap */
+		if (bs.snapshots) {
+			if (copy_to_user(&ubuf[done], &bs, sizeof(bs))) {
+				ret = -EFAULT;
+				break;
+			}
+			done++;
+		}
+
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+		cond_resched();
+	}
+	cursor_release(&cur);
+
+	/* Report partial progress, errors only if nothing was done */
+	if (ret && !done)
+		return ret;
+	req.start_ino = ino;
+	req.count = done;
+	if (copy_to_user(arg, &req, sizeof(req)))
+		return -EFAULT;
+	return 0;
+}
+
+static long ouichefs_ioc_rmtree(struct file *file, void __user *arg)
+{
+	struct ouichefs_ioc_rmtree req;
+	char *name;
+	long ret;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	name = strndup_user(u64_to_user_ptr(req.name), NAME_MAX + 1);
+	if (IS_ERR(name))
+		return PTR_ERR(name);
+
+	ret = ouichefs_rmtree(file, name);
+	kfree(name);
+	return ret;
+}
+
+static long ouichefs_ioc_clone_tree(struct file *file, void __user *arg)
+{
+	struct ouichefs_ioc_clone_tree req;
+	struct fd src;
+	char *name;
+	long ret;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	src = fdget(req.src_fd);
+	if (!src.file)
+		return -EBADF;
+
+	name = strndup_user(u64_to_user_ptr(req.name), NAME_MAX + 1);
+	if (IS_ERR(name)) {
+		ret = PTR_ERR(name);
+		goto put_src;
+	}
+
+	ret = ouichefs_clone_tree(file, src.file, name);
+	kfree(name);
+put_src:
+	fdput(src);
+	return ret;
+}
+
+static long ouichefs_ioc_grow(struct file *file, void __user *arg)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+	struct ouichefs_ioc_grow req;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	/* Block numbers are 32-bit, the rest of a larger device is unused */
+	if (!req.nr_blocks)
+		req.nr_blocks = min_t(u64, U32_MAX,
+				      bdev_nr_bytes(sb->s_bdev) >>
+					      sb->s_blocksize_bits);
+	if (req.nr_blocks > U32_MAX)
+		return -EFBIG;
+
+	return ouichefs_grow(sb, req.nr_blocks);
+}
+
+/*
+ * Returns the write amplification counters of an inode. They live in
+ * memory only, so they start from zero whenever the inode is loaded.
+ */
+static long ouichefs_ioc_get_wstats(struct file *file, void __user *arg)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(file_inode(file));
+	struct ouichefs_ioc_wstats stats;
+
+	stats.bytes = atomic64_read(&ci->wa[OUICHEFS_WA_BYTES]);
+	stats.data_blocks = atomic64_read(&ci->wa[OUICHEFS_WA_DATA]);
+	stats.cow_data = atomic64_read(&ci->wa[OUICHEFS_WA_COW_DATA]);
+	stats.cow_index = atomic64_read(&ci->wa[OUICHEFS_WA_COW_INDEX]);
+	stats.cow_dir = atomic64_read(&ci->wa[OUICHEFS_WA_COW_DIR]);
+	stats.cow_inode_data =
+		atomic64_read(&ci->wa[OUICHEFS_WA_COW_INODE_DATA]);
+	stats.inode_data = atomic64_read(&ci->wa[OUICHEFS_WA_IDE_COW]);
+
+	if (copy_to_user(arg, &stats, sizeof(stats)))
+		return -EFAULT;
+	return 0;
+}
+
+long ouichefs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	void __user *argp = (void __user *)arg;
+
+	switch (cmd) {
+	case OUICHEFS_IOC_GET_DIRSTATS:
+		return ouichefs_ioc_get_dirstats(file, argp);
+	case OUICHEFS_IOC_INO_TO_PATH:
+		return ouichefs_ioc_ino_to_path(file, argp);
+	case OUICHEFS_IOC_BULKSTAT:
+		return ouichefs_ioc_bulkstat(file, argp);
+	case OUICHEFS_IOC_RMTREE:
+		return ouichefs_ioc_rmtree(file, argp);
+	case OUICHEFS_IOC_CLONE_TREE:
+		return ouichefs_ioc_clone_tree(file, argp);
+	case OUICHEFS_IOC_GROW:
+		return ouichefs_ioc_grow(file, argp);
+	case OUICHEFS_IOC_GET_WSTATS:
+		return ouichefs_ioc_get_wstats(file, argp);
+	default:
+		return -ENOTTY;
+	}
+}
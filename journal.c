@@ -0,0 +1,948 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/crc32.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/sched.h>
+#include <linux/sched/mm.h>
+#include <linux/slab.h>
+#include <linux/xarray.h>
+#include <linux/workqueue.h>
+
+#include "ouichefs.h"
+#include "bitmap.h"
+
+/*
+ * Metadata journal of ouiche_fs
+ *
+ * All metadata changes are grouped into transactions. Instead of writing
+ * modified metadata buffers directly, they are pinned in the running
+ * transaction. A commit waits for all handles to end, copies the content of
+ * all pinned blocks, the superblock and the touched bitmap blocks and writes
+ * them to the log region, followed by a commit block. Only after that, the
+ * copies are written to their home location. The log holds at most one
+ * transaction; it is overwritten by the next commit once all home writes of
+ * the previous one are durable.
+ *
+ * Data blocks freed by a transaction are not handed out again before it is
+ * committed. Otherwise, file data written to such a block could be
+ * overwritten by a replay of its old metadata content. They are zeroed on
+ * disk after the commit: file data is not journaled, so a new block of a
+ * file may be committed before its data is written.
+ *
+ * Each handle reserves room in the log for the blocks it may add (its
+ * credits), and waits for a commit if the running transaction is full. Every
+ * block a handle adds uses up one of its credits. Operations that add more
+ * than the default ask for more when they start, and long running ones make
+ * sure they have enough left between independent steps, restarting the
+ * handle if the transaction is full. A transaction is never written home
+ * without being logged first: if that fails, the journal is aborted and the
+ * file system goes read-only.
+ */
+
+/* Interval of the periodic commit */
+#define OUICHEFS_JOURNAL_INTERVAL (5 * HZ)
+
+/* Blocks a handle reserves in the log unless it asks for more */
+#define OUICHEFS_JOURNAL_CREDITS 16
+
+struct ouichefs_transaction {
+	/*
+	 * Home location -> pinned buffer_head, or a value entry for bitmap
+	 * blocks, which are copied from the in-memory bitmaps on commit
+	 */
+	struct xarray blocks;
+	struct xarray freed; /* Data blocks freed by this transaction */
+	atomic_t nr_blocks;
+	atomic_t nr_freed;
+	atomic_t reserved; /* Credits of the running handles */
+	u64 seq;
+};
+
+struct ouichefs_journal {
+	struct super_block *sb;
+	uint32_t start; /* First block of the log */
+	uint32_t max_blocks; /* Maximal number of logged blocks */
+	uint32_t credits; /* Blocks reserved by each handle by default */
+
+	struct rw_semaphore lock; /* Shared by handles, exclusive on commit */
+	struct mutex commit_mutex; /* Serializes commits */
+	struct ouichefs_transaction *running;
+	atomic64_t running_seq;
+	u64 committed_seq; /* Last transaction on disk */
+	bool need_flush; /* Home writes are not durable yet */
+	bool aborted; /* Nothing is written anymore */
+	bool clean; /* The log holds no transaction */
+	struct delayed_work commit_work;
+};
+
+/* A block of a committing transaction */
+struct ouichefs_jblock {
+	uint32_t home;
+	bool generated; /* Not backed by a pinned buffer_head */
+	struct page *page;
+};
+
+static struct ouichefs_transaction *ouichefs_transaction_alloc(u64 seq)
+{
+	struct ouichefs_transaction *t;
+
+	t = kzalloc(sizeof(*t), GFP_NOFS);
+	if (!t)
+		return NULL;
+	xa_init(&t->blocks);
+	xa_init(&t->freed);
+	t->seq = seq;
+	return t;
+}
+
+/* Returns true if the current task runs in a handle of sb */
+static bool ouichefs_journal_nested(struct super_block *sb)
+{
+	struct ouichefs_handle *cur = current->journal_info;
+
+	return cur && cur->magic == OUICHEFS_HANDLE_MAGIC && cur->sb == sb;
+}
+
+/*
+ * Reserves nr more blocks of the log in the running transaction. Returns
+ * false if the blocks it already holds and the credits of all handles would
+ * not fit in the log along with the superblock anymore. Must be called with
+ * the journal locked.
+ */
+static bool ouichefs_journal_reserve(struct ouichefs_journal *j,
+				     unsigned int nr)
+{
+	struct ouichefs_transaction *t = j->running;
+
+	if (atomic_add_return(nr, &t->reserved) +
+	    atomic_read(&t->nr_blocks) < j->max_blocks || j->aborted)
+		return true;
+	atomic_sub(nr, &t->reserved);
+	return false;
+}
+
+/*
+ * Uses up a credit of the handle of the current task for a block added to
+ * the running transaction. Without credits left, the block takes a free slot
+ * of the log, if there is any.
+ */
+static void ouichefs_journal_charge(struct ouichefs_journal *j)
+{
+	struct ouichefs_transaction *t = j->running;
+	struct ouichefs_handle *h = current->journal_info;
+
+	if (!ouichefs_journal_nested(j->sb))
+		return;
+	if (h->credits) {
+		h->credits--;
+		atomic_dec(&t->reserved);
+		return;
+	}
+	if (atomic_read(&t->nr_blocks) + atomic_read(&t->reserved) >=
+	    j->max_blocks)
+		pr_warn_ratelimited("Handle exceeded its credits, transaction %llu does not fit in the log\n",
+				    t->seq);
+}
+
+static void ouichefs_journal_add(struct ouichefs_journal *j, uint32_t block,
+				 struct buffer_head *bh)
+{
+	struct ouichefs_transaction *t = j->running;
+	void *entry = bh ? (void *)bh : xa_mk_value(0);
+
+	if (xa_load(&t->blocks, block))
+		return;
+	if (xa_insert(&t->blocks, block, entry, GFP_NOFS | __GFP_NOFAIL))
+		return; /* Someone else was faster */
+	if (bh)
+		get_bh(bh);
+
+	/* First block of this transaction: make sure it is committed */
+	if (atomic_inc_return(&t->nr_blocks) == 1)
+		queue_delayed_work(system_long_wq, &j->commit_work,
+				   OUICHEFS_JOURNAL_INTERVAL);
+	ouichefs_journal_charge(j);
+}
+
+/*
+ * Adds a modified metadata buffer to the running transaction. Without a
+ * journal, this simply marks the buffer dirty.
+ */
+void ouichefs_journal_dirty(struct super_block *sb, struct buffer_head *bh)
+{
+	struct ouichefs_journal *j = OUICHEFS_SB(sb)->journal;
+
+	if (!j) {
+		mark_buffer_dirty(bh);
+		return;
+	}
+	ouichefs_journal_add(j, bh->b_blocknr, bh);
+}
+
+/*
+ * Same as ouichefs_journal_dirty(), but writes the buffer synchronously if
+ * there is no journal. The journal makes this obsolete.
+ */
+void ouichefs_journal_dirty_sync(struct super_block *sb,
+				 struct buffer_head *bh)
+{
+	struct ouichefs_journal *j = OUICHEFS_SB(sb)->journal;
+
+	if (!j) {
+		mark_buffer_dirty(bh);
+		ouichefs_sync_buffer(sb, bh);
+		return;
+	}
+	ouichefs_journal_add(j, bh->b_blocknr, bh);
+}
+
+/*
+ * Adds a bitmap block to the running transaction.
+ */
+void ouichefs_journal_bitmap(struct ouichefs_sb_info *sbi, uint32_t block)
+{
+	if (sbi->journal)
+		ouichefs_journal_add(sbi->journal, block, NULL);
+}
+
+/*
+ * Defers freeing the data block bno until the running transaction is
+ * committed. Returns false if there is no journal.
+ */
+bool ouichefs_journal_defer_free(struct ouichefs_sb_info *sbi, uint32_t bno)
+{
+	struct ouichefs_journal *j = sbi->journal;
+
+	if (!j)
+		return false;
+
+	if (xa_insert(&j->running->freed, bno, xa_mk_value(0),
+		      GFP_NOFS | __GFP_NOFAIL)) {
+		pr_warn("Block %u freed twice\n", bno);
+		return true;
+	}
+	atomic_inc(&j->running->nr_freed);
+	ouichefs_journal_add(j, OUICHEFS_GET_BFREE_START(sbi) +
+			     bno / sbi->bits_per_block, NULL);
+	return true;
+}
+
+/*
+ * Starts a handle with extra credits on top of the default ones. A nested
+ * handle adds them to the outermost one if the log has room for them.
+ */
+void ouichefs_journal_start_credits(struct super_block *sb,
+				    struct ouichefs_handle *h,
+				    unsigned int extra)
+{
+	struct ouichefs_journal *j = OUICHEFS_SB(sb)->journal;
+	struct ouichefs_handle *outer = current->journal_info;
+	unsigned int credits;
+
+	h->magic = OUICHEFS_HANDLE_MAGIC;
+	h->sb = sb;
+	h->outer = false;
+	h->credits = 0;
+	if (!j)
+		return;
+	if (ouichefs_journal_nested(sb)) {
+		if (extra && ouichefs_journal_reserve(j, extra))
+			outer->credits += extra;
+		return;
+	}
+
+	/* A handle never reserves more than the whole log */
+	credits = min(j->credits + extra, j->max_blocks - 1);
+
+	/* Wait for a commit until the log has room for this handle */
+	down_read(&j->lock);
+	while (!ouichefs_journal_reserve(j, credits)) {
+		up_read(&j->lock);
+		ouichefs_journal_commit(sb);
+		down_read(&j->lock);
+	}
+	h->credits = credits;
+	h->prev = current->journal_info;
+	h->outer = true;
+	current->journal_info = h;
+}
+
+void ouichefs_journal_start(struct super_block *sb, struct ouichefs_handle *h)
+{
+	ouichefs_journal_start_credits(sb, h, 0);
+}
+
+void ouichefs_journal_stop(struct ouichefs_handle *h)
+{
+	struct ouichefs_journal *j = OUICHEFS_SB(h->sb)->journal;
+	bool full;
+
+	if (!h->outer)
+		return;
+
+	current->journal_info = h->prev;
+	atomic_sub(h->credits, &j->running->reserved);
+	full = atomic_read(&j->running->nr_blocks) >= j->max_blocks * 3 / 4;
+	up_read(&j->lock);
+
+	/* Throttle writers once the transaction gets too large */
+	if (full)
+		ouichefs_journal_commit(h->sb);
+}
+
+/*
+ * Makes sure the handle can add nr more blocks. If the running transaction
+ * has no room for them, the handle is restarted, so this must only be called
+ * where the changes made so far may be committed on their own.
+ */
+void ouichefs_journal_ensure_credits(struct ouichefs_handle *h,
+				     unsigned int nr)
+{
+	struct ouichefs_journal *j = OUICHEFS_SB(h->sb)->journal;
+
+	if (!h->outer || h->credits >= nr)
+		return;
+	if (ouichefs_journal_reserve(j, nr - h->credits)) {
+		h->credits = nr;
+		return;
+	}
+	ouichefs_journal_stop(h);
+	ouichefs_journal_start_credits(h->sb, h,
+				       nr > j->credits ? nr - j->credits : 0);
+}
+
+static void ouichefs_journal_copy_bitmap(struct ouichefs_sb_info *sbi,
+					 struct ouichefs_transaction *t,
+					 uint32_t block, void *dst)
+{
+	unsigned long *bitmap = sbi->ifree_bitmap;
+	spinlock_t *lock = &sbi->ifree_lock;
+	uint32_t first = OUICHEFS_GET_IFREE_START(sbi);
+	struct super_block *sb = sbi->sb;
+	unsigned long bno, start;
+	void *entry;
+
+	if (block >= OUICHEFS_GET_IDFREE_START(sbi)) {
+		bitmap = sbi->idfree_bitmap;
+		lock = &sbi->idfree_lock;
+		first = OUICHEFS_GET_IDFREE_START(sbi);
+	} else if (block >= OUICHEFS_GET_BFREE_START(sbi)) {
+		bitmap = sbi->bfree_bitmap;
+		lock = &sbi->bfree_lock;
+		first = OUICHEFS_GET_BFREE_START(sbi);
+	}
+
+	spin_lock(lock);
+	memcpy(dst,
+	       (void *)bitmap + ((size_t)(block - first) << sb->s_blocksize_bits),
+	       sb->s_blocksize);
+	spin_unlock(lock);
+
+	/* The committed state already contains the deferred frees */
+	if (bitmap != sbi->bfree_bitmap)
+		return;
+	start = (unsigned long)(block - first) * sbi->bits_per_block;
+	xa_for_each_range(&t->freed, bno, entry, start,
+			  start + sbi->bits_per_block - 1)
+		__set_bit(bno - start, (unsigned long *)dst);
+}
+
+/*
+ * Copies everything the transaction t modified. Must be called with the
+ * journal locked exclusively, so no handle is modifying metadata.
+ */
+static int ouichefs_journal_copy(struct ouichefs_journal *j,
+				 struct ouichefs_transaction *t,
+				 struct ouichefs_jblock *jb, unsigned int *nr)
+{
+	struct super_block *sb = j->sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_sb_info *disk_sb;
+	struct buffer_head *bh;
+	unsigned long block;
+	unsigned int n = 0;
+	void *entry;
+
+	/* The superblock holds counters and snapshots, always log it */
+	bh = ouichefs_bread(sb, OUICHEFS_SB_BLOCK_NR);
+	if (!bh)
+		return -EIO;
+	jb[n].home = OUICHEFS_SB_BLOCK_NR;
+	jb[n].generated = true;
+	jb[n].page = alloc_page(GFP_NOFS | __GFP_NOFAIL);
+	disk_sb = page_address(jb[n].page);
+	memcpy(disk_sb, bh->b_data, sb->s_blocksize);
+	brelse(bh);
+	ouichefs_sb_to_disk(sb, disk_sb);
+	disk_sb->nr_free_blocks += atomic_read(&t->nr_freed);
+	n++;
+
+	xa_for_each(&t->blocks, block, entry) {
+		/* Content of freed blocks does not matter anymore */
+		if (block == OUICHEFS_SB_BLOCK_NR || xa_load(&t->freed, block))
+			continue;
+
+		jb[n].home = block;
+		jb[n].generated = xa_is_value(entry);
+		jb[n].page = alloc_page(GFP_NOFS | __GFP_NOFAIL);
+		if (jb[n].generated)
+			ouichefs_journal_copy_bitmap(sbi, t, block,
+						     page_address(jb[n].page));
+		else
+			memcpy(page_address(jb[n].page),
+			       ((struct buffer_head *)entry)->b_data,
+			       sb->s_blocksize);
+		n++;
+	}
+
+	*nr = n;
+	return 0;
+}
+
+static struct bio *ouichefs_journal_bio(struct bio *bio, struct super_block *sb,
+					uint32_t block, struct page *page,
+					blk_opf_t opf)
+{
+	ouichefs_io_add(OUICHEFS_SB(sb), block,
+			op_is_write(opf) ? OUICHEFS_IO_WRITE : OUICHEFS_IO_READ,
+			1);
+	bio = blk_next_bio(bio, sb->s_bdev, 1, opf, GFP_NOFS);
+	bio->bi_iter.bi_sector =
+		(sector_t)block << (sb->s_blocksize_bits - SECTOR_SHIFT);
+	__bio_add_page(bio, page, sb->s_blocksize, 0);
+	return bio;
+}
+
+static int ouichefs_journal_wait(struct super_block *sb, struct bio *bio)
+{
+	int ret;
+
+	if (!bio)
+		return 0;
+	ret = ouichefs_submit_bio_wait(sb, bio);
+	bio_put(bio);
+	return ret;
+}
+
+/*
+ * Writes the transaction to the log: descriptor and blocks first, then the
+ * commit block once they are on disk.
+ */
+static int ouichefs_journal_write_log(struct ouichefs_journal *j, u64 seq,
+				      struct ouichefs_jblock *jb,
+				      unsigned int nr)
+{
+	struct super_block *sb = j->sb;
+	struct ouichefs_journal_header *desc, *commit;
+	struct page *desc_page, *commit_page;
+	struct bio *bio = NULL;
+	unsigned int i;
+	u32 crc;
+	int ret;
+
+	desc_page = alloc_page(GFP_NOFS | __GFP_ZERO | __GFP_NOFAIL);
+	commit_page = alloc_page(GFP_NOFS | __GFP_ZERO | __GFP_NOFAIL);
+	desc = page_address(desc_page);
+	commit = page_address(commit_page);
+
+	desc->magic = OUICHEFS_JOURNAL_DESC_MAGIC;
+	desc->nr_blocks = nr;
+	desc->seq = seq;
+	for (i = 0; i < nr; i++)
+		desc->blocks[i] = jb[i].home;
+
+	crc = crc32_le(~0, (void *)desc, sb->s_blocksize);
+	for (i = 0; i < nr; i++)
+		crc = crc32_le(crc, page_address(jb[i].page),
+			       sb->s_blocksize);
+	commit->magic = OUICHEFS_JOURNAL_COMMIT_MAGIC;
+	commit->nr_blocks = nr;
+	commit->seq = seq;
+	commit->crc = crc;
+
+	/* The previous transaction must be home before we overwrite it */
+	if (j->need_flush) {
+		ret = blkdev_issue_flush(sb->s_bdev);
+		if (ret)
+			goto out;
+		j->need_flush = false;
+	}
+
+	j->clean = false;
+	bio = ouichefs_journal_bio(bio, sb, j->start, desc_page,
+				   REQ_OP_WRITE | REQ_SYNC);
+	for (i = 0; i < nr; i++)
+		bio = ouichefs_journal_bio(bio, sb, j->start + 1 + i,
+					   jb[i].page, REQ_OP_WRITE | REQ_SYNC);
+	ret = ouichefs_journal_wait(sb, bio);
+	if (ret)
+		goto out;
+
+	bio = ouichefs_journal_bio(NULL, sb, j->start + 1 + nr, commit_page,
+				   REQ_OP_WRITE | REQ_SYNC | REQ_PREFLUSH |
+				   REQ_FUA);
+	ret = ouichefs_journal_wait(sb, bio);
+
+out:
+	__free_page(desc_page);
+	__free_page(commit_page);
+	return ret;
+}
+
+/*
+ * Writes all blocks to their home location. Cached copies of generated
+ * blocks are updated as well, since they bypass the buffer cache.
+ */
+static int ouichefs_journal_write_home(struct ouichefs_journal *j,
+				       struct ouichefs_jblock *jb,
+				       unsigned int nr)
+{
+	struct super_block *sb = j->sb;
+	struct buffer_head *bh;
+	struct bio *bio = NULL;
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		bio = ouichefs_journal_bio(bio, sb, jb[i].home, jb[i].page,
+					   REQ_OP_WRITE);
+		if (!jb[i].generated)
+			continue;
+
+		bh = sb_find_get_block(sb, jb[i].home);
+		if (bh) {
+			lock_buffer(bh);
+			memcpy(bh->b_data, page_address(jb[i].page),
+			       sb->s_blocksize);
+			set_buffer_uptodate(bh);
+			unlock_buffer(bh);
+			put_bh(bh);
+		}
+	}
+	j->need_flush = true;
+	return ouichefs_journal_wait(sb, bio);
+}
+
+static int ouichefs_journal_zeroout(struct super_block *sb, uint32_t block,
+				    uint32_t nr)
+{
+	unsigned int shift = sb->s_blocksize_bits - SECTOR_SHIFT;
+
+	ouichefs_io_add(OUICHEFS_SB(sb), block, OUICHEFS_IO_WRITE, nr);
+	return blkdev_issue_zeroout(sb->s_bdev, (sector_t)block << shift,
+				    (sector_t)nr << shift, GFP_NOFS, 0);
+}
+
+/*
+ * Zeroes the data blocks freed by t on disk, one run of contiguous blocks
+ * at a time. Must be called once t is home, before they can be reused.
+ */
+static int ouichefs_journal_zero_freed(struct ouichefs_journal *j,
+				       struct ouichefs_transaction *t)
+{
+	unsigned long index, start = 0, nr = 0;
+	void *entry;
+	int ret;
+
+	xa_for_each(&t->freed, index, entry) {
+		if (nr && index == start + nr) {
+			nr++;
+			continue;
+		}
+		if (nr) {
+			ret = ouichefs_journal_zeroout(j->sb, start, nr);
+			if (ret)
+				return ret;
+		}
+		start = index;
+		nr = 1;
+	}
+	if (!nr)
+		return 0;
+	return ouichefs_journal_zeroout(j->sb, start, nr);
+}
+
+/*
+ * Stops writing anything after a transaction could not be committed. The
+ * disk keeps the last committed state; the file system goes read-only so
+ * that no later change is lost silently.
+ */
+static void ouichefs_journal_abort(struct ouichefs_journal *j, int err)
+{
+	if (j->aborted)
+		return;
+	j->aborted = true;
+	pr_err("Aborting the journal (%d), the file system is read-only\n",
+	       err);
+	j->sb->s_flags |= SB_RDONLY;
+}
+
+/*
+ * Releases a transaction: makes its freed blocks available again if it is
+ * on disk, and unpins all buffers.
+ */
+static void ouichefs_transaction_finish(struct ouichefs_sb_info *sbi,
+					struct ouichefs_transaction *t,
+					bool committed)
+{
+	unsigned long index;
+	void *entry;
+
+	if (committed) {
+		xa_for_each(&t->freed, index, entry)
+			put_free_bit(sbi->bfree_bitmap, sbi->nr_blocks, index,
+				     &sbi->nr_free_blocks, &sbi->bfree_lock);
+	}
+	xa_for_each(&t->blocks, index, entry) {
+		if (!xa_is_value(entry))
+			put_bh(entry);
+	}
+	xa_destroy(&t->freed);
+	xa_destroy(&t->blocks);
+	kfree(t);
+}
+
+/* Must be called with commit_mutex held */
+static int __ouichefs_journal_commit(struct ouichefs_journal *j)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(j->sb);
+	struct ouichefs_transaction *t, *next;
+	struct ouichefs_jblock *jb = NULL;
+	unsigned int nr = 0, i;
+	unsigned int nofs;
+	int ret;
+
+	nofs = memalloc_nofs_save();
+	next = ouichefs_transaction_alloc(atomic64_read(&j->running_seq) + 1);
+	if (!next) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* Wait for all handles, then swap in a new transaction */
+	down_write(&j->lock);
+	t = j->running;
+	if (!atomic_read(&t->nr_blocks) && !atomic_read(&t->nr_freed)) {
+		up_write(&j->lock);
+		kfree(next);
+		ret = 0;
+		goto out;
+	}
+	jb = kvmalloc_array(atomic_read(&t->nr_blocks) + 1, sizeof(*jb),
+			    GFP_KERNEL);
+	if (!jb) {
+		up_write(&j->lock);
+		kfree(next);
+		ret = -ENOMEM;
+		goto out;
+	}
+	j->running = next;
+	atomic64_set(&j->running_seq, next->seq);
+	ret = j->aborted ? -EROFS : ouichefs_journal_copy(j, t, jb, &nr);
+	up_write(&j->lock);
+
+	/* Handles can run again; the copies are written from here on */
+	if (!ret && nr > j->max_blocks) {
+		/* Handles added more blocks than they had credits for */
+		pr_err("Transaction %llu has %u blocks, the log holds %u\n",
+		       t->seq, nr, j->max_blocks);
+		ret = -ENOSPC;
+	}
+	if (!ret) {
+		ret = ouichefs_journal_write_log(j, t->seq, jb, nr);
+		if (ret)
+			pr_err("Failed to write transaction %llu to the log: %d\n",
+			       t->seq, ret);
+	}
+	if (!ret) {
+		/* The log stays valid for a replay if this fails */
+		ret = ouichefs_journal_write_home(j, jb, nr);
+		if (ret)
+			pr_err("Failed to write back transaction %llu: %d\n",
+			       t->seq, ret);
+	}
+	if (!ret) {
+		ret = ouichefs_journal_zero_freed(j, t);
+		if (ret)
+			pr_err("Failed to zero the blocks freed by transaction %llu: %d\n",
+			       t->seq, ret);
+	}
+
+	if (ret) {
+		ouichefs_journal_abort(j, ret);
+	} else {
+		pr_debug("Committed transaction %llu (%u blocks, %d freed)\n",
+			 t->seq, nr, atomic_read(&t->nr_freed));
+		j->committed_seq = t->seq;
+	}
+	ouichefs_transaction_finish(sbi, t, !ret);
+	for (i = 0; i < nr; i++)
+		__free_page(jb[i].page);
+	kvfree(jb);
+out:
+	memalloc_nofs_restore(nofs);
+	return ret;
+}
+
+/*
+ * Commits the running transaction and waits until it is on disk. Concurrent
+ * callers share a single commit.
+ */
+int ouichefs_journal_commit(struct super_block *sb)
+{
+	struct ouichefs_journal *j = OUICHEFS_SB(sb)->journal;
+	u64 seq;
+	int ret = 0;
+
+	/* We cannot wait for our own handle to end */
+	if (!j || ouichefs_journal_nested(sb))
+		return 0;
+
+	seq = atomic64_read(&j->running_seq);
+	mutex_lock(&j->commit_mutex);
+	if (j->committed_seq < seq)
+		ret = __ouichefs_journal_commit(j);
+	mutex_unlock(&j->commit_mutex);
+	return ret;
+}
+
+static void ouichefs_journal_commit_work(struct work_struct *work)
+{
+	struct ouichefs_journal *j = container_of(to_delayed_work(work),
+						  struct ouichefs_journal,
+						  commit_work);
+
+	ouichefs_journal_commit(j->sb);
+}
+
+/*
+ * Invalidates the log, so it is not replayed. All home writes are made
+ * durable first. The descriptor keeps the last sequence number, so sequence
+ * numbers are never reused.
+ */
+static int ouichefs_journal_invalidate(struct ouichefs_journal *j)
+{
+	struct page *page = alloc_page(GFP_NOFS | __GFP_ZERO);
+	struct ouichefs_journal_header *desc;
+	struct bio *bio;
+	int ret;
+
+	if (!page)
+		return -ENOMEM;
+	desc = page_address(page);
+	desc->seq = j->committed_seq;
+	bio = ouichefs_journal_bio(NULL, j->sb, j->start, page,
+				   REQ_OP_WRITE | REQ_SYNC | REQ_PREFLUSH |
+				   REQ_FUA);
+	ret = ouichefs_journal_wait(j->sb, bio);
+	__free_page(page);
+	j->need_flush = false;
+	if (!ret)
+		j->clean = true;
+	return ret;
+}
+
+/*
+ * Replays the transaction in the log if it is complete. Home blocks are
+ * written through the buffer cache, so blocks read before (e.g. the
+ * superblock) see the replayed content.
+ */
+static int ouichefs_journal_replay(struct ouichefs_journal *j)
+{
+	struct super_block *sb = j->sb;
+	struct ouichefs_journal_header *desc, *commit;
+	struct buffer_head *bh_desc, *bh_commit = NULL, *bh, *bh_home;
+	unsigned int i;
+	u32 crc;
+	int ret = 0;
+
+	bh_desc = ouichefs_bread(sb, j->start);
+	if (!bh_desc)
+		return -EIO;
+	desc = (struct ouichefs_journal_header *)bh_desc->b_data;
+	if (desc->magic != OUICHEFS_JOURNAL_DESC_MAGIC) {
+		/* Clean */
+		j->committed_seq = desc->seq;
+		j->clean = true;
+		goto out;
+	}
+	j->committed_seq = desc->seq;
+	if (bdev_read_only(sb->s_bdev)) {
+		pr_err("Journal needs recovery, but the device is read-only\n");
+		ret = -EROFS;
+		goto out;
+	}
+	if (desc->nr_blocks > j->max_blocks) {
+		pr_warn("Corrupted journal descriptor, ignoring it\n");
+		goto invalidate;
+	}
+
+	/* Only replay complete transactions */
+	bh_commit = ouichefs_bread(sb, j->start + 1 + desc->nr_blocks);
+	if (!bh_commit) {
+		ret = -EIO;
+		goto out;
+	}
+	commit = (struct ouichefs_journal_header *)bh_commit->b_data;
+	if (commit->magic != OUICHEFS_JOURNAL_COMMIT_MAGIC ||
+	    commit->seq != desc->seq || commit->nr_blocks != desc->nr_blocks) {
+		pr_info("Discarding incomplete transaction %llu\n", desc->seq);
+		goto invalidate;
+	}
+	crc = crc32_le(~0, bh_desc->b_data, sb->s_blocksize);
+	for (i = 0; i < desc->nr_blocks; i++) {
+		bh = ouichefs_bread(sb, j->start + 1 + i);
+		if (!bh) {
+			ret = -EIO;
+			goto out;
+		}
+		crc = crc32_le(crc, bh->b_data, sb->s_blocksize);
+		brelse(bh);
+	}
+	if (crc != commit->crc) {
+		pr_info("Discarding torn transaction %llu\n", desc->seq);
+		goto invalidate;
+	}
+
+	for (i = 0; i < desc->nr_blocks; i++) {
+		if (desc->blocks[i] >= OUICHEFS_SB(sb)->nr_blocks) {
+			pr_warn("Skipping invalid home block %u\n",
+				desc->blocks[i]);
+			continue;
+		}
+		bh = ouichefs_bread(sb, j->start + 1 + i);
+		bh_home = sb_getblk(sb, desc->blocks[i]);
+		if (!bh || !bh_home) {
+			brelse(bh);
+			brelse(bh_home);
+			ret = -EIO;
+			goto out;
+		}
+		lock_buffer(bh_home);
+		memcpy(bh_home->b_data, bh->b_data, sb->s_blocksize);
+		set_buffer_uptodate(bh_home);
+		mark_buffer_dirty(bh_home);
+		unlock_buffer(bh_home);
+		brelse(bh_home);
+		brelse(bh);
+	}
+	ret = sync_blockdev(sb->s_bdev);
+	if (ret)
+		goto out;
+	pr_info("Replayed transaction %llu (%u blocks)\n", desc->seq,
+		desc->nr_blocks);
+
+invalidate:
+	ret = ouichefs_journal_invalidate(j);
+out:
+	brelse(bh_commit);
+	brelse(bh_desc);
+	return ret;
+}
+
+/*
+ * Sets up the journal of the file system and replays it if necessary. This
+ * must happen before any other metadata is read.
+ */
+int ouichefs_journal_load(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_journal *j;
+	int ret;
+
+	if (!sbi->nr_journal_blocks)
+		return 0;
+	if (sbi->nr_journal_blocks < 3 ||
+	    sbi->journal_start + sbi->nr_journal_blocks > sbi->nr_blocks) {
+		pr_err("Invalid journal (start=%u, size=%u)\n",
+		       sbi->journal_start, sbi->nr_journal_blocks);
+		return -EINVAL;
+	}
+
+	j = kzalloc(sizeof(*j), GFP_KERNEL);
+	if (!j)
+		return -ENOMEM;
+	j->sb = sb;
+	j->start = sbi->journal_start;
+	j->max_blocks = min_t(uint32_t, sbi->journal_max_blocks,
+			      sbi->nr_journal_blocks - 2);
+	j->credits = min_t(uint32_t, OUICHEFS_JOURNAL_CREDITS,
+			   (j->max_blocks - 1) / 2);
+	init_rwsem(&j->lock);
+	mutex_init(&j->commit_mutex);
+	INIT_DELAYED_WORK(&j->commit_work, ouichefs_journal_commit_work);
+
+	ret = ouichefs_journal_replay(j);
+	if (ret)
+		goto free;
+
+	j->running = ouichefs_transaction_alloc(j->committed_seq + 1);
+	if (!j->running) {
+		ret = -ENOMEM;
+		goto free;
+	}
+	atomic64_set(&j->running_seq, j->running->seq);
+	sbi->journal = j;
+	return 0;
+
+free:
+	kfree(j);
+	return ret;
+}
+
+/*
+ * Commits everything and marks the log clean, before the file system goes
+ * read-only. Nothing is written if no transaction was committed since the
+ * log was last marked clean, e.g. on a read-only mount.
+ */
+int ouichefs_journal_flush(struct super_block *sb)
+{
+	struct ouichefs_journal *j = OUICHEFS_SB(sb)->journal;
+	int ret;
+
+	if (!j)
+		return 0;
+
+	cancel_delayed_work_sync(&j->commit_work);
+	ret = ouichefs_journal_commit(sb);
+	if (ret)
+		return ret;
+
+	/* An aborted log may still hold a transaction to replay */
+	if (j->aborted)
+		return -EROFS;
+	if (j->clean)
+		return 0;
+	return ouichefs_journal_invalidate(j);
+}
+
+/*
+ * Flushes the journal and frees it. Called on unmount.
+ */
+void ouichefs_journal_release(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_journal *j = sbi->journal;
+
+	if (!j)
+		return;
+
+	if (ouichefs_journal_flush(sb))
+		pr_err("Failed to cleanly close the journal\n");
+
+	/* Nothing can be pinned anymore, but the freed list may be left */
+	ouichefs_transaction_finish(sbi, j->running, false);
+	sbi->journal = NULL;
+	kfree(j);
+}
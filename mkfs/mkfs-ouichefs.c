@@ -5,20 +5,55 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <endian.h>
 #include <string.h>
+#include <getopt.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 
 #define OUICHEFS_MAGIC 0x48434957
 
 #define OUICHEFS_SB_BLOCK_NR 0
 
-#define OUICHEFS_BLOCK_SIZE (1 << 12) /* 4 KiB */
-#define OUICHEFS_MAX_FILESIZE (1 << 22) /* 4 MiB */
+#define OUICHEFS_MIN_BLOCK_SIZE (1 << 10) /* 1 KiB */
+#define OUICHEFS_MAX_BLOCK_SIZE (1 << 16) /* 64 KiB */
+#define OUICHEFS_DEFAULT_BLOCK_SIZE (1 << 12) /* 4 KiB */
 #define OUICHEFS_FILENAME_LEN 28
-#define OUICHEFS_MAX_SUBFILES 128
 #define OUICHEFS_MAX_SNAPSHOTS 32
-#define OUICHEFS_META_BLOCK_LEN (OUICHEFS_BLOCK_SIZE / sizeof(uint8_t))
-#define OUICHEFS_INDEX_BLOCK_LEN (OUICHEFS_BLOCK_SIZE / sizeof(uint32_t))
+#define OUICHEFS_META_BLOCK_LEN (block_size / sizeof(uint8_t))
+#define OUICHEFS_INDEX_BLOCK_LEN (block_size / sizeof(uint32_t))
+#define OUICHEFS_MAX_FILESIZE ((uint64_t)OUICHEFS_INDEX_BLOCK_LEN * block_size)
+#define OUICHEFS_JOURNAL_MIN_BLOCKS 3 /* descriptor, 1 block, commit */
+#define OUICHEFS_JOURNAL_DEFAULT_BLOCKS 1024
+#define OUICHEFS_VERSION 1
+#define OUICHEFS_FEATURE_COMPAT_HOT_LIST 0x1 /* Hot list read ahead at mount */
+#define OUICHEFS_FEATURE_INCOMPAT_GROUPS 0x1 /* Metadata blocks before their data */
+#define OUICHEFS_GROUP_BLOCKS (1 + OUICHEFS_META_BLOCK_LEN)
+/* Block numbers and inode data entry numbers are 32-bit */
+#define OUICHEFS_MAX_BLOCKS ((unsigned long long)UINT32_MAX)
+#define OUICHEFS_MAX_INODES \
+	(UINT32_MAX / OUICHEFS_MAX_SNAPSHOTS / OUICHEFS_INODES_PER_BLOCK * \
+	 OUICHEFS_INODES_PER_BLOCK)
+
+/* Size of a block in bytes, chosen with -b. All sizes above derive from it. */
+static uint32_t block_size = OUICHEFS_DEFAULT_BLOCK_SIZE;
+
+/* Optional features, chosen with -O */
+struct ouichefs_feature {
+	const char *name;
+	uint32_t *mask; /* One of the features below */
+	uint32_t bit;
+};
+
+static uint32_t feature_compat = OUICHEFS_FEATURE_COMPAT_HOT_LIST;
+static uint32_t feature_ro_compat;
+static uint32_t feature_incompat;
+
+static const struct ouichefs_feature features[] = {
+	{ "hot_list", &feature_compat, OUICHEFS_FEATURE_COMPAT_HOT_LIST },
+	{ "groups", &feature_incompat, OUICHEFS_FEATURE_INCOMPAT_GROUPS },
+};
 
 struct ouichefs_inode_data {
 	uint32_t i_mode; /* File mode */
@@ -35,11 +70,11 @@ struct ouichefs_inode_data {
 	uint32_t i_nlink; /* Hard links count */
 	uint32_t index_block; /* Index block / dir block of this inode */
 	uint8_t refcount; /* How many inodes link to this */
-};
-
-/* Stored in the id_idx region. Links inode data entry numbers to a block. */
-struct ouichefs_inode_data_index_block {
-	uint32_t blocks[OUICHEFS_INDEX_BLOCK_LEN];
+	uint64_t r_bytes; /* Directories only: bytes of all inodes below */
+	uint64_t r_blocks; /* Directories only: blocks of all inodes below */
+	uint64_t r_files; /* Directories only: number of inodes below */
+	uint32_t i_parent; /* Inode of the directory containing this inode */
+	uint32_t i_reserved;
 };
 
 /*
@@ -53,15 +88,15 @@ struct ouichefs_inode {
 };
 
 #define OUICHEFS_INODES_PER_BLOCK \
-	(OUICHEFS_BLOCK_SIZE / sizeof(struct ouichefs_inode))
+	(block_size / sizeof(struct ouichefs_inode))
 #define OUICHEFS_IDE_PER_DATA_BLOCK \
-	(OUICHEFS_BLOCK_SIZE / sizeof(struct ouichefs_inode_data))
+	(block_size / sizeof(struct ouichefs_inode_data))
 #define OUICHEFS_IDE_PER_INDEX_BLOCK \
 	(OUICHEFS_IDE_PER_DATA_BLOCK * OUICHEFS_INDEX_BLOCK_LEN)
 
 struct ouichefs_snapshot_info {
-	int64_t m_time; /* Modification time (sec) */
-	uint8_t id; /* Unique identifier of this snapshot */
+	int64_t created; /* Creation time (sec) */
+	uint32_t id; /* Unique identifier of this snapshot */
 };
 
 struct ouichefs_superblock {
@@ -82,41 +117,91 @@ struct ouichefs_superblock {
 	uint32_t nr_idfree_blocks; /* Number of inode data free bitmap blocks */
 	uint32_t nr_ididx_blocks; /* Number of inode data index blocks */
 	uint32_t nr_meta_blocks; /* Number of metadata blocks */
+	uint32_t journal_start; /* First block of the journal */
+	uint32_t nr_journal_blocks; /* Size of the journal, 0 if there is none */
+	uint32_t hot_list_block; /* Block holding the hot list, 0 if none */
+	uint32_t block_size; /* Size of a block in bytes, a power of two */
+	uint32_t version; /* Version of the on-disk format */
+	uint32_t feature_compat; /* Features older kernels can ignore */
+	uint32_t feature_ro_compat; /* Features older kernels can only read */
+	uint32_t feature_incompat; /* Features older kernels cannot mount */
 
 	/* List of all snapshots */
 	struct ouichefs_snapshot_info snapshots[OUICHEFS_MAX_SNAPSHOTS];
-} __attribute__((aligned(OUICHEFS_BLOCK_SIZE)));
-_Static_assert(sizeof(struct ouichefs_superblock) == OUICHEFS_BLOCK_SIZE,
-	       "Superblock size mismatch");
-
-struct ouichefs_metadata_block {
-	/* One reference counter for each block */
-	uint8_t refcount[OUICHEFS_META_BLOCK_LEN];
-};
-_Static_assert(sizeof(struct ouichefs_metadata_block) == OUICHEFS_BLOCK_SIZE,
-	       "Metadata block size mismatch");
-
-struct ouichefs_file_index_block {
-	uint32_t blocks[OUICHEFS_BLOCK_SIZE >> 2];
-};
-_Static_assert(sizeof(struct ouichefs_file_index_block) == OUICHEFS_BLOCK_SIZE,
-	       "Index block size mismatch");
-
-struct ouichefs_dir_block {
-	struct ouichefs_file {
-		uint32_t inode;
-		char filename[OUICHEFS_FILENAME_LEN];
-	} files[OUICHEFS_MAX_SUBFILES];
 };
-_Static_assert(sizeof(struct ouichefs_dir_block) == OUICHEFS_BLOCK_SIZE,
-	       "Dir block size mismatch");
+_Static_assert(sizeof(struct ouichefs_superblock) <= OUICHEFS_MIN_BLOCK_SIZE,
+	       "Superblock does not fit in the smallest block");
+_Static_assert(OUICHEFS_DEFAULT_BLOCK_SIZE / sizeof(uint32_t) *
+	       OUICHEFS_DEFAULT_BLOCK_SIZE >= (1 << 22),
+	       "Files are smaller than 4 MiB with the default block size");
 
 static inline void usage(char *appname)
 {
 	fprintf(stderr,
 		"Usage:\n"
-		"%s disk\n",
-		appname);
+		"%s [-b block_size] [-g] [-j journal_blocks] [-O features]\n"
+		"\t[-r max_blocks] disk\n"
+		"\t-b: size of a block in bytes, a power of two from %d to %d\n"
+		"\t    (default: %d). Files are limited to block_size^2 / 4\n"
+		"\t    bytes: 256 KiB with 1 KiB blocks, 1 MiB with 2 KiB\n"
+		"\t    blocks, 4 MiB with 4 KiB blocks\n"
+		"\t-g: same as -O groups\n"
+		"\t-j: size of the metadata journal in blocks, 0 disables it\n"
+		"\t    (default: 1/64 of the disk, at most %d blocks)\n"
+		"\t-O: comma-separated features to enable, ^feature disables it\n"
+		"\t    hot_list: read ahead hot metadata blocks at mount (default)\n"
+		"\t    groups: place each metadata block right before the\n"
+		"\t            block_size data blocks it covers\n"
+		"\t-r: reserve block bitmap space to grow the partition online\n"
+		"\t    up to max_blocks blocks (requires -O groups)\n",
+		appname, OUICHEFS_MIN_BLOCK_SIZE, OUICHEFS_MAX_BLOCK_SIZE,
+		OUICHEFS_DEFAULT_BLOCK_SIZE, OUICHEFS_JOURNAL_DEFAULT_BLOCKS);
+}
+
+/*
+ * Parses a -O argument: a comma-separated list of feature names, each
+ * optionally prefixed with '^' to disable it. Returns -1 on unknown names.
+ */
+static int parse_features(char *list)
+{
+	char *name;
+	int i, disable;
+
+	for (name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+		disable = name[0] == '^';
+		if (disable)
+			name++;
+		for (i = 0; i < sizeof(features) / sizeof(features[0]); i++) {
+			if (!strcmp(name, features[i].name))
+				break;
+		}
+		if (i == sizeof(features) / sizeof(features[0])) {
+			fprintf(stderr, "Unknown feature: %s\n", name);
+			return -1;
+		}
+		if (disable)
+			*features[i].mask &= ~features[i].bit;
+		else
+			*features[i].mask |= features[i].bit;
+	}
+	return 0;
+}
+
+/* Whether each metadata block is placed right before the blocks it covers */
+static inline int has_groups(struct ouichefs_superblock *sb)
+{
+	return le32toh(sb->feature_incompat) & OUICHEFS_FEATURE_INCOMPAT_GROUPS;
+}
+
+/*
+ * Number of metadata blocks written right after the inode data index. With
+ * the group layout, only the one of the first group is there.
+ */
+static inline uint32_t meta_region_blocks(struct ouichefs_superblock *sb)
+{
+	if (has_groups(sb))
+		return 1;
+	return le32toh(sb->nr_meta_blocks);
 }
 
 /* Returns ceil(a/b) */
@@ -128,7 +213,9 @@ static inline uint32_t idiv_ceil(uint32_t a, uint32_t b)
 	return ret;
 }
 
-static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats)
+static struct ouichefs_superblock *write_superblock(int fd, uint64_t disk_size,
+						    long nr_journal_blocks,
+						    uint32_t max_blocks)
 {
 	int ret;
 	struct ouichefs_superblock *sb;
@@ -137,31 +224,64 @@ static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats)
 	uint32_t nr_data_blocks = 0, nr_istore_blocks = 0, nr_ididx_blocks = 0;
 	uint32_t nr_meta_blocks = 0, mod;
 
-	sb = malloc(sizeof(struct ouichefs_superblock));
+	/* The superblock takes a whole block, zero-padded */
+	sb = calloc(1, block_size);
 	if (!sb)
 		return NULL;
 
-	nr_blocks = fstats->st_size / OUICHEFS_BLOCK_SIZE;
+	/* Block numbers are 32 bits wide, ignore what is beyond */
+	if (disk_size / block_size > UINT32_MAX) {
+		fprintf(stderr,
+			"Disk is larger than %llu GiB, only using the first %llu GiB (block numbers are 32-bit; blocks larger than 4 KiB need a kernel with pages at least as large)\n",
+			OUICHEFS_MAX_BLOCKS * block_size >> 30,
+			OUICHEFS_MAX_BLOCKS * block_size >> 30);
+		nr_blocks = OUICHEFS_MAX_BLOCKS;
+	} else {
+		nr_blocks = disk_size / block_size;
+	}
+
+	/* One inode per block, as long as all inode data entries fit */
 	nr_inodes = nr_blocks;
+	if (nr_inodes > OUICHEFS_MAX_INODES)
+		nr_inodes = OUICHEFS_MAX_INODES;
 	nr_inode_data_entries = nr_inodes * OUICHEFS_MAX_SNAPSHOTS;
 	mod = nr_inodes % OUICHEFS_INODES_PER_BLOCK;
 	if (mod != 0)
 		nr_inodes += mod;
 	nr_istore_blocks = idiv_ceil(nr_inodes, OUICHEFS_INODES_PER_BLOCK);
-	nr_ifree_blocks = idiv_ceil(nr_inodes, OUICHEFS_BLOCK_SIZE * 8);
-	nr_bfree_blocks = idiv_ceil(nr_blocks, OUICHEFS_BLOCK_SIZE * 8);
-	nr_idfree_blocks = idiv_ceil(nr_inode_data_entries, OUICHEFS_BLOCK_SIZE * 8);
+	nr_ifree_blocks = idiv_ceil(nr_inodes, block_size * 8);
+	// Reserve room for the block free bitmap to grow online to max_blocks
+	nr_bfree_blocks = idiv_ceil(max_blocks > nr_blocks ? max_blocks :
+				    nr_blocks, block_size * 8);
+	nr_idfree_blocks = idiv_ceil(nr_inode_data_entries, block_size * 8);
 	nr_ididx_blocks = idiv_ceil(nr_inode_data_entries, OUICHEFS_IDE_PER_INDEX_BLOCK);
 
 	nr_data_blocks = nr_blocks - 1 - nr_istore_blocks - nr_ifree_blocks -
 			 nr_bfree_blocks - nr_idfree_blocks - nr_ididx_blocks;
 
+	/* The journal lives in the last blocks of the disk */
+	if (nr_journal_blocks < 0) {
+		nr_journal_blocks = nr_blocks / 64;
+		if (nr_journal_blocks > OUICHEFS_JOURNAL_DEFAULT_BLOCKS)
+			nr_journal_blocks = OUICHEFS_JOURNAL_DEFAULT_BLOCKS;
+		if (nr_journal_blocks < 16)
+			nr_journal_blocks = 0;
+	}
+	if (nr_journal_blocks && (nr_journal_blocks < OUICHEFS_JOURNAL_MIN_BLOCKS ||
+				  nr_journal_blocks >= nr_data_blocks / 2)) {
+		fprintf(stderr, "Invalid journal size: %ld blocks\n",
+			nr_journal_blocks);
+		free(sb);
+		return NULL;
+	}
+	nr_data_blocks -= nr_journal_blocks;
+
 	// Partition data blocks such that every data block has a metadata block
 	// TODO: This leaves us with a bit more metadata blocks then we actually need
+	// With the group layout, this is the number of groups
 	nr_meta_blocks = idiv_ceil(nr_data_blocks, OUICHEFS_META_BLOCK_LEN + 1);
 	nr_data_blocks -= nr_meta_blocks;
 
-	memset(sb, 0, sizeof(struct ouichefs_superblock));
 	sb->magic = htole32(OUICHEFS_MAGIC);
 	sb->nr_blocks = htole32(nr_blocks);
 	sb->nr_inodes = htole32(nr_inodes);
@@ -172,21 +292,31 @@ static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats)
 	sb->nr_idfree_blocks = htole32(nr_idfree_blocks);
 	sb->nr_ididx_blocks = htole32(nr_ididx_blocks);
 	sb->nr_meta_blocks = htole32(nr_meta_blocks);
+	sb->journal_start = htole32(nr_journal_blocks ?
+				    nr_blocks - nr_journal_blocks : 0);
+	sb->nr_journal_blocks = htole32(nr_journal_blocks);
+	sb->block_size = htole32(block_size);
+	sb->version = htole32(OUICHEFS_VERSION);
+	sb->feature_compat = htole32(feature_compat);
+	sb->feature_ro_compat = htole32(feature_ro_compat);
+	sb->feature_incompat = htole32(feature_incompat);
 	// The -1 are the root inode and the dir block it points to
 	sb->nr_free_inodes = htole32(nr_inodes - 1);
 	sb->nr_free_blocks = htole32(nr_data_blocks - 1);
 	sb->nr_free_inode_data_entries = htole32(nr_inode_data_entries - 1);
-	sb->snapshots[0].m_time = htole64(0);
+	sb->snapshots[0].created = htole64(0);
 	sb->snapshots[0].id = 0;
 
-	ret = write(fd, sb, sizeof(struct ouichefs_superblock));
-	if (ret != sizeof(struct ouichefs_superblock)) {
+	ret = write(fd, sb, block_size);
+	if (ret != block_size) {
 		free(sb);
 		return NULL;
 	}
 
 	printf("Superblock: (%ld)\n"
 	       "\tmagic=%#x\n"
+	       "\tblock_size=%u\n"
+	       "\tversion=%u (features=%#x/%#x/%#x)\n"
 	       "\tnr_blocks=%u\n"
 	       "\tnr_inodes=%u (istore=%u blocks)\n"
 	       "\tnr_inode_data_entries=%u (ididx=%u blocks)\n"
@@ -194,14 +324,20 @@ static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats)
 	       "\tnr_bfree_blocks=%u\n"
 	       "\tnr_idfree_blocks=%u\n"
 	       "\tnr_meta_blocks=%u\n"
+	       "\tnr_journal_blocks=%u (start=%u)\n"
 	       "\tnr_free_inodes=%u\n"
 	       "\tnr_free_blocks=%u\n"
 	       "\tnr_free_inode_data_entries=%u\n",
-	       sizeof(struct ouichefs_superblock), sb->magic, sb->nr_blocks,
+	       sizeof(struct ouichefs_superblock), sb->magic, sb->block_size,
+	       sb->version, sb->feature_compat, sb->feature_ro_compat,
+	       sb->feature_incompat,
+	       sb->nr_blocks,
 	       sb->nr_inodes, sb->nr_istore_blocks,
 	       sb->nr_inode_data_entries, sb->nr_ididx_blocks,
 	       sb->nr_ifree_blocks, sb->nr_bfree_blocks, sb->nr_idfree_blocks,
-	       sb->nr_meta_blocks, sb->nr_free_inodes, sb->nr_free_blocks,
+	       sb->nr_meta_blocks,
+	       sb->nr_journal_blocks, sb->journal_start,
+	       sb->nr_free_inodes, sb->nr_free_blocks,
 	       sb->nr_free_inode_data_entries
 	);
 
@@ -216,26 +352,26 @@ static int write_inode_store(int fd, struct ouichefs_superblock *sb)
 	char *block;
 
 	/* Allocate a zeroed block for inode store */
-	block = malloc(OUICHEFS_BLOCK_SIZE);
+	block = malloc(block_size);
 	if (!block)
 		return -1;
-	memset(block, 0, OUICHEFS_BLOCK_SIZE);
+	memset(block, 0, block_size);
 
 	/* Root inode (inode 1) points to first inode data entry (idx 1) */
 	inode = (struct ouichefs_inode *)block + 1;
 	inode->i_data[0] = 1;
 
-	ret = write(fd, block, OUICHEFS_BLOCK_SIZE);
-	if (ret != OUICHEFS_BLOCK_SIZE) {
+	ret = write(fd, block, block_size);
+	if (ret != block_size) {
 		ret = -1;
 		goto end;
 	}
 
 	/* Reset inode store blocks to zero */
-	memset(block, 0, OUICHEFS_BLOCK_SIZE);
+	memset(block, 0, block_size);
 	for (i = 1; i < sb->nr_istore_blocks; i++) {
-		ret = write(fd, block, OUICHEFS_BLOCK_SIZE);
-		if (ret != OUICHEFS_BLOCK_SIZE) {
+		ret = write(fd, block, block_size);
+		if (ret != block_size) {
 			ret = -1;
 			goto end;
 		}
@@ -244,7 +380,7 @@ static int write_inode_store(int fd, struct ouichefs_superblock *sb)
 
 	printf("Inode store: wrote %d blocks (lseek %ld)\n"
 	       "\tinode size = %ld B\n",
-	       i, lseek(fd, 0, SEEK_CUR) / OUICHEFS_BLOCK_SIZE,
+	       i, lseek(fd, 0, SEEK_CUR) / block_size,
 	       sizeof(struct ouichefs_inode));
 
 end:
@@ -259,18 +395,18 @@ static int write_ifree_blocks(int fd, struct ouichefs_superblock *sb)
 	char *block;
 	uint64_t *ifree;
 
-	block = malloc(OUICHEFS_BLOCK_SIZE);
+	block = malloc(block_size);
 	if (!block)
 		return -1;
 	ifree = (uint64_t *)block;
 
 	/* Set all bits to 1 */
-	memset(ifree, 0xff, OUICHEFS_BLOCK_SIZE);
+	memset(ifree, 0xff, block_size);
 
 	/* First ifree block, containing first used inode */
 	ifree[0] = htole64(0xfffffffffffffffc);
-	ret = write(fd, ifree, OUICHEFS_BLOCK_SIZE);
-	if (ret != OUICHEFS_BLOCK_SIZE) {
+	ret = write(fd, ifree, block_size);
+	if (ret != block_size) {
 		ret = -1;
 		goto end;
 	}
@@ -278,8 +414,8 @@ static int write_ifree_blocks(int fd, struct ouichefs_superblock *sb)
 	/* All ifree blocks except the one containing 2 first inodes */
 	ifree[0] = 0xffffffffffffffff;
 	for (i = 1; i < le32toh(sb->nr_ifree_blocks); i++) {
-		ret = write(fd, ifree, OUICHEFS_BLOCK_SIZE);
-		if (ret != OUICHEFS_BLOCK_SIZE) {
+		ret = write(fd, ifree, block_size);
+		if (ret != block_size) {
 			ret = -1;
 			goto end;
 		}
@@ -287,7 +423,7 @@ static int write_ifree_blocks(int fd, struct ouichefs_superblock *sb)
 	ret = 0;
 
 	printf("Ifree blocks: wrote %d blocks (lseek %ld)\n",
-		i, lseek(fd, 0, SEEK_CUR) / OUICHEFS_BLOCK_SIZE);
+		i, lseek(fd, 0, SEEK_CUR) / block_size);
 
 end:
 	free(block);
@@ -295,52 +431,96 @@ end:
 	return ret;
 }
 
+/* Marks blocks [start, end) covered by the idx-th bfree block as used */
+static void bfree_mark_used(uint64_t *bfree, uint32_t idx, uint64_t start,
+			    uint64_t end)
+{
+	uint64_t first = (uint64_t)idx * block_size * 8;
+	uint64_t last = first + block_size * 8;
+	uint64_t b;
+
+	if (start < first)
+		start = first;
+	if (end > last)
+		end = last;
+	for (b = start; b < end; b++) {
+		/* Whole words at once, the reserved bitmap blocks may be many */
+		if ((b - first) % 64 == 0 && end - b >= 64) {
+			bfree[(b - first) / 64] = 0;
+			b += 63;
+			continue;
+		}
+		bfree[(b - first) / 64] &= htole64(~(1ULL << ((b - first) % 64)));
+	}
+}
+
+/* Marks the journal blocks covered by the idx-th bfree block as used */
+static void bfree_mark_journal(uint64_t *bfree, uint32_t idx,
+			       struct ouichefs_superblock *sb)
+{
+	uint32_t start = le32toh(sb->journal_start);
+
+	bfree_mark_used(bfree, idx, start,
+			(uint64_t)start + le32toh(sb->nr_journal_blocks));
+}
+
+/*
+ * Group layout: marks the metadata blocks of all groups but the first one
+ * covered by the idx-th bfree block as used
+ */
+static void bfree_mark_groups(uint64_t *bfree, uint32_t idx,
+			      struct ouichefs_superblock *sb)
+{
+	uint64_t first = (uint64_t)idx * block_size * 8;
+	uint64_t last = first + block_size * 8;
+	uint32_t meta_start = 1 + le32toh(sb->nr_istore_blocks) +
+			      le32toh(sb->nr_ifree_blocks) +
+			      le32toh(sb->nr_bfree_blocks) +
+			      le32toh(sb->nr_idfree_blocks) +
+			      le32toh(sb->nr_ididx_blocks);
+	uint64_t b;
+	uint32_t g;
+
+	if (!has_groups(sb))
+		return;
+	for (g = 1; g < le32toh(sb->nr_meta_blocks); g++) {
+		b = meta_start + (uint64_t)g * OUICHEFS_GROUP_BLOCKS;
+		if (b < first || b >= last)
+			continue;
+		bfree[(b - first) / 64] &= htole64(~(1ULL << ((b - first) % 64)));
+	}
+}
+
 static int write_bfree_blocks(int fd, struct ouichefs_superblock *sb)
 {
 	int ret = 0;
 	uint32_t i;
 	char *block;
-	uint64_t *bfree, mask, line;
+	uint64_t *bfree;
 	uint32_t nr_used = le32toh(sb->nr_istore_blocks) +
 			   le32toh(sb->nr_ifree_blocks) +
 			   le32toh(sb->nr_bfree_blocks) +
 			   le32toh(sb->nr_idfree_blocks) +
 			   le32toh(sb->nr_ididx_blocks) +
-			   le32toh(sb->nr_meta_blocks) + 3;
+			   meta_region_blocks(sb) + 3;
 
-	block = malloc(OUICHEFS_BLOCK_SIZE);
+	block = malloc(block_size);
 	if (!block)
 		return -1;
 	bfree = (uint64_t *)block;
 
 	/*
-	 * First blocks (incl. sb + istore + ifree + bfree + meta + 1 used block)
-	 * we suppose it won't go further than the first block
+	 * First blocks (incl. sb + istore + ifree + bfree + meta + 2 used
+	 * blocks). With small blocks, they may span several bfree blocks.
 	 */
-	memset(bfree, 0xff, OUICHEFS_BLOCK_SIZE);
-	i = 0;
-	while (nr_used) {
-		line = 0xffffffffffffffff;
-		for (mask = 0x1; mask != 0x0; mask <<= 1) {
-			line &= ~mask;
-			nr_used--;
-			if (!nr_used)
-				break;
-		}
-		bfree[i] = htole64(line);
-		i++;
-	}
-	ret = write(fd, bfree, OUICHEFS_BLOCK_SIZE);
-	if (ret != OUICHEFS_BLOCK_SIZE) {
-		ret = -1;
-		goto end;
-	}
-
-	/* other blocks */
-	memset(bfree, 0xff, OUICHEFS_BLOCK_SIZE);
-	for (i = 1; i < le32toh(sb->nr_bfree_blocks); i++) {
-		ret = write(fd, bfree, OUICHEFS_BLOCK_SIZE);
-		if (ret != OUICHEFS_BLOCK_SIZE) {
+	for (i = 0; i < le32toh(sb->nr_bfree_blocks); i++) {
+		memset(bfree, 0xff, block_size);
+		bfree_mark_used(bfree, i, 0, nr_used);
+		bfree_mark_used(bfree, i, le32toh(sb->nr_blocks), UINT64_MAX);
+		bfree_mark_journal(bfree, i, sb);
+		bfree_mark_groups(bfree, i, sb);
+		ret = write(fd, bfree, block_size);
+		if (ret != block_size) {
 			ret = -1;
 			goto end;
 		}
@@ -348,7 +528,7 @@ static int write_bfree_blocks(int fd, struct ouichefs_superblock *sb)
 	ret = 0;
 
 	printf("Bfree blocks: wrote %d blocks (lseek %ld)\n",
-		i, lseek(fd, 0, SEEK_CUR) / OUICHEFS_BLOCK_SIZE);
+		i, lseek(fd, 0, SEEK_CUR) / block_size);
 end:
 	free(block);
 
@@ -362,18 +542,18 @@ static int write_idfree_blocks(int fd, struct ouichefs_superblock *sb)
 	char *block;
 	uint64_t *idfree;
 
-	block = malloc(OUICHEFS_BLOCK_SIZE);
+	block = malloc(block_size);
 	if (!block)
 		return -1;
 	idfree = (uint64_t *)block;
 
 	/* Set all bits to 1 */
-	memset(idfree, 0xff, OUICHEFS_BLOCK_SIZE);
+	memset(idfree, 0xff, block_size);
 
 	/* First ifree block, containing first used inode */
 	idfree[0] = htole64(0xfffffffffffffffc);
-	ret = write(fd, idfree, OUICHEFS_BLOCK_SIZE);
-	if (ret != OUICHEFS_BLOCK_SIZE) {
+	ret = write(fd, idfree, block_size);
+	if (ret != block_size) {
 		ret = -1;
 		goto end;
 	}
@@ -381,8 +561,8 @@ static int write_idfree_blocks(int fd, struct ouichefs_superblock *sb)
 	/* All ifree blocks except the one containing 2 first inodes */
 	idfree[0] = 0xffffffffffffffff;
 	for (i = 1; i < le32toh(sb->nr_idfree_blocks); i++) {
-		ret = write(fd, idfree, OUICHEFS_BLOCK_SIZE);
-		if (ret != OUICHEFS_BLOCK_SIZE) {
+		ret = write(fd, idfree, block_size);
+		if (ret != block_size) {
 			ret = -1;
 			goto end;
 		}
@@ -390,7 +570,7 @@ static int write_idfree_blocks(int fd, struct ouichefs_superblock *sb)
 	ret = 0;
 
 	printf("Idfree blocks: wrote %d blocks (lseek %ld)\n",
-		i, lseek(fd, 0, SEEK_CUR) / OUICHEFS_BLOCK_SIZE);
+		i, lseek(fd, 0, SEEK_CUR) / block_size);
 
 end:
 	free(block);
@@ -403,34 +583,34 @@ static int write_ididx_blocks(int fd, struct ouichefs_superblock *sb)
 {
 	int ret = 0, i = 0;
 	char *block;
-	struct ouichefs_inode_data_index_block *ididx;
+	uint32_t *ididx;
 	uint32_t second_data_block = 2 + le32toh(sb->nr_istore_blocks) +
 				     le32toh(sb->nr_bfree_blocks) +
 				     le32toh(sb->nr_ifree_blocks) +
 				     le32toh(sb->nr_idfree_blocks) +
 				     le32toh(sb->nr_ididx_blocks) +
-				     le32toh(sb->nr_meta_blocks);
+				     meta_region_blocks(sb);
 
-	block = malloc(OUICHEFS_BLOCK_SIZE);
+	block = malloc(block_size);
 	if (!block)
 		return -1;
-	memset(block, 0, OUICHEFS_BLOCK_SIZE);
+	memset(block, 0, block_size);
 
 	// First ididx block must link root inode (1) with idx 1,
 	// which is in the 0th inode data block (at pos 1)
-	ididx = (struct ouichefs_inode_data_index_block *) block;
-	ididx->blocks[0] = second_data_block;
-	ret = write(fd, block, OUICHEFS_BLOCK_SIZE);
-	if (ret != OUICHEFS_BLOCK_SIZE) {
+	ididx = (uint32_t *)block;
+	ididx[0] = htole32(second_data_block);
+	ret = write(fd, block, block_size);
+	if (ret != block_size) {
 		ret = -1;
 		goto end;
 	}
 
 	// Write other blocks
-	memset(block, 0, OUICHEFS_BLOCK_SIZE);
+	memset(block, 0, block_size);
 	for (i = 1; i < le32toh(sb->nr_ididx_blocks); i++) {
-		ret = write(fd, block, OUICHEFS_BLOCK_SIZE);
-		if (ret != OUICHEFS_BLOCK_SIZE) {
+		ret = write(fd, block, block_size);
+		if (ret != block_size) {
 			ret = -1;
 			goto end;
 		}
@@ -438,7 +618,7 @@ static int write_ididx_blocks(int fd, struct ouichefs_superblock *sb)
 	ret = 0;
 
 	printf("Inode data index blocks: wrote %u blocks (lseek %ld)\n",
-		i, lseek(fd, 0, SEEK_CUR) / OUICHEFS_BLOCK_SIZE);
+		i, lseek(fd, 0, SEEK_CUR) / block_size);
 end:
 	free(block);
 
@@ -449,30 +629,30 @@ static int write_metadata_blocks(int fd, struct ouichefs_superblock *sb)
 {
 	int ret = 0, i = 0;
 	char *block;
-	struct ouichefs_metadata_block *meta;
+	uint8_t *refcount;
 
-	block = malloc(OUICHEFS_BLOCK_SIZE);
+	block = malloc(block_size);
 	if (!block)
 		return -1;
-	memset(block, 0, OUICHEFS_BLOCK_SIZE);
+	memset(block, 0, block_size);
 
 	// First metadata block must have the refcount counter set to 1
 	// since the index block uses the first block as its dir block
 	// The second block is used as it's inode_data
-	meta = (struct ouichefs_metadata_block *) block;
-	meta->refcount[0] = 1;
-	meta->refcount[1] = 1;
-	ret = write(fd, block, OUICHEFS_BLOCK_SIZE);
-	if (ret != OUICHEFS_BLOCK_SIZE) {
+	refcount = (uint8_t *)block;
+	refcount[0] = 1;
+	refcount[1] = 1;
+	ret = write(fd, block, block_size);
+	if (ret != block_size) {
 		ret = -1;
 		goto end;
 	}
 
 	// Write other blocks
-	memset(block, 0, OUICHEFS_BLOCK_SIZE);
-	for (i = 1; i < le32toh(sb->nr_meta_blocks); i++) {
-		ret = write(fd, block, OUICHEFS_BLOCK_SIZE);
-		if (ret != OUICHEFS_BLOCK_SIZE) {
+	memset(block, 0, block_size);
+	for (i = 1; i < meta_region_blocks(sb); i++) {
+		ret = write(fd, block, block_size);
+		if (ret != block_size) {
 			ret = -1;
 			goto end;
 		}
@@ -480,7 +660,7 @@ static int write_metadata_blocks(int fd, struct ouichefs_superblock *sb)
 	ret = 0;
 
 	printf("Metadata blocks: wrote %u blocks (lseek %ld)\n",
-		i, lseek(fd, 0, SEEK_CUR) / OUICHEFS_BLOCK_SIZE);
+		i, lseek(fd, 0, SEEK_CUR) / block_size);
 end:
 	free(block);
 
@@ -497,17 +677,17 @@ static int write_data_blocks(int fd, struct ouichefs_superblock *sb)
 					le32toh(sb->nr_ifree_blocks) +
 					le32toh(sb->nr_idfree_blocks) +
 					le32toh(sb->nr_ididx_blocks) +
-					le32toh(sb->nr_meta_blocks);
+					meta_region_blocks(sb);
 
-	block = malloc(OUICHEFS_BLOCK_SIZE);
+	block = malloc(block_size);
 	if (!block)
 		return -1;
-	memset(block, 0, OUICHEFS_BLOCK_SIZE);
+	memset(block, 0, block_size);
 
 	// Write first data block; Its the dir_block for the root inode
 	// and it is empty
-	ret = write(fd, block, OUICHEFS_BLOCK_SIZE);
-	if (ret != OUICHEFS_BLOCK_SIZE) {
+	ret = write(fd, block, block_size);
+	if (ret != block_size) {
 		ret = -1;
 		goto end;
 	}
@@ -523,21 +703,22 @@ static int write_data_blocks(int fd, struct ouichefs_superblock *sb)
 			S_IWGRP | S_IXUSR | S_IXGRP | S_IXOTH);
 	idata->i_uid = 0;
 	idata->i_gid = 0;
-	idata->i_size = htole32(OUICHEFS_BLOCK_SIZE);
+	idata->i_size = htole32(block_size);
 	idata->i_ctime = idata->i_atime = idata->i_mtime = htole32(0);
 	idata->i_nctime = idata->i_natime = idata->i_nmtime = htole64(0);
 	idata->i_blocks = htole32(1);
 	idata->i_nlink = htole32(2);
 	idata->index_block = htole32(first_data_block);
 	idata->refcount = 1;
+	idata->i_parent = htole32(1); /* The root is its own parent */
 
-	ret = write(fd, block, OUICHEFS_BLOCK_SIZE);
-	if (ret != OUICHEFS_BLOCK_SIZE) {
+	ret = write(fd, block, block_size);
+	if (ret != block_size) {
 		ret = -1;
 		goto end;
 	}
 	printf("Inode data blocks: wrote 1 block (lseek %ld)\n",
-		lseek(fd, 0, SEEK_CUR) / OUICHEFS_BLOCK_SIZE);
+		lseek(fd, 0, SEEK_CUR) / block_size);
 	ret = 0;
 end:
 	free(block);
@@ -545,20 +726,149 @@ end:
 	return ret;
 }
 
+/* Group layout: zeroes the metadata blocks of all groups but the first one */
+static int write_group_meta_blocks(int fd, struct ouichefs_superblock *sb)
+{
+	int ret = 0;
+	uint32_t g;
+	char *block;
+	uint32_t meta_start = 1 + le32toh(sb->nr_istore_blocks) +
+			      le32toh(sb->nr_ifree_blocks) +
+			      le32toh(sb->nr_bfree_blocks) +
+			      le32toh(sb->nr_idfree_blocks) +
+			      le32toh(sb->nr_ididx_blocks);
+
+	if (!has_groups(sb))
+		return 0;
+
+	block = malloc(block_size);
+	if (!block)
+		return -1;
+	memset(block, 0, block_size);
+
+	for (g = 1; g < le32toh(sb->nr_meta_blocks); g++) {
+		off_t off = (off_t)(meta_start + g * OUICHEFS_GROUP_BLOCKS) *
+			    block_size;
+
+		ret = pwrite(fd, block, block_size, off);
+		if (ret != block_size) {
+			ret = -1;
+			goto end;
+		}
+	}
+	ret = 0;
+
+	printf("Group metadata blocks: wrote %u blocks\n", g - 1);
+end:
+	free(block);
+
+	return ret;
+}
+
+static int write_journal_blocks(int fd, struct ouichefs_superblock *sb)
+{
+	int ret = 0;
+	uint32_t i;
+	char *block;
+
+	if (!le32toh(sb->nr_journal_blocks))
+		return 0;
+
+	block = malloc(block_size);
+	if (!block)
+		return -1;
+	memset(block, 0, block_size);
+
+	/* A zeroed descriptor marks the journal as clean */
+	if (lseek(fd, (off_t)le32toh(sb->journal_start) * block_size,
+		  SEEK_SET) < 0) {
+		ret = -1;
+		goto end;
+	}
+	for (i = 0; i < le32toh(sb->nr_journal_blocks); i++) {
+		ret = write(fd, block, block_size);
+		if (ret != block_size) {
+			ret = -1;
+			goto end;
+		}
+	}
+	ret = 0;
+
+	printf("Journal blocks: wrote %u blocks (lseek %ld)\n",
+		i, lseek(fd, 0, SEEK_CUR) / block_size);
+end:
+	free(block);
+
+	return ret;
+}
+
 int main(int argc, char **argv)
 {
 	int ret = EXIT_SUCCESS, fd;
-	long int min_size;
+	uint64_t min_size;
 	struct stat stat_buf;
+	uint64_t disk_size;
 	struct ouichefs_superblock *sb = NULL;
-
-	if (argc != 2 || argv[1][0] == '-') {
+	long nr_journal_blocks = -1;
+	unsigned long long max_blocks = 0;
+	long size;
+	char *end;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:gj:O:r:")) != -1) {
+		switch (opt) {
+		case 'b':
+			size = strtol(optarg, &end, 10);
+			if (*end != '\0' || size < OUICHEFS_MIN_BLOCK_SIZE ||
+			    size > OUICHEFS_MAX_BLOCK_SIZE || (size & (size - 1))) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			block_size = size;
+			break;
+		case 'g':
+			feature_incompat |= OUICHEFS_FEATURE_INCOMPAT_GROUPS;
+			break;
+		case 'j':
+			nr_journal_blocks = strtol(optarg, &end, 10);
+			if (*end != '\0' || nr_journal_blocks < 0) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'O':
+			if (parse_features(optarg)) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'r':
+			max_blocks = strtoull(optarg, &end, 10);
+			if (*end != '\0' || max_blocks > OUICHEFS_MAX_BLOCKS) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1) {
 		usage(argv[0]);
 		return EXIT_FAILURE;
 	}
+	if (max_blocks && !(feature_incompat & OUICHEFS_FEATURE_INCOMPAT_GROUPS)) {
+		fprintf(stderr, "Growing online requires -O groups\n");
+		return EXIT_FAILURE;
+	}
+	if (OUICHEFS_MAX_FILESIZE < (1 << 22))
+		fprintf(stderr, "Warning: files are limited to %" PRIu64
+			" KiB with %u B blocks\n", OUICHEFS_MAX_FILESIZE >> 10,
+			block_size);
 
 	/* Open disk image */
-	fd = open(argv[1], O_RDWR);
+	fd = open(argv[optind], O_RDWR);
 	if (fd == -1) {
 		perror("open():");
 		return EXIT_FAILURE;
@@ -572,18 +882,27 @@ int main(int argc, char **argv)
 		goto fclose;
 	}
 
+	/* fstat() reports a size of 0 for block devices */
+	disk_size = stat_buf.st_size;
+	if (S_ISBLK(stat_buf.st_mode) && ioctl(fd, BLKGETSIZE64, &disk_size)) {
+		perror("ioctl(BLKGETSIZE64):");
+		ret = EXIT_FAILURE;
+		goto fclose;
+	}
+
 	/* Check if image is large enough */
-	min_size = 100 * OUICHEFS_BLOCK_SIZE;
-	if (stat_buf.st_size < min_size) {
+	min_size = 100 * (uint64_t)block_size;
+	if (disk_size < min_size) {
 		fprintf(stderr,
-			"File is not large enough (size=%ld, min size=%ld)\n",
-			stat_buf.st_size, min_size);
+			"File is not large enough (size=%" PRIu64
+			", min size=%" PRIu64 ")\n", disk_size, min_size);
 		ret = EXIT_FAILURE;
 		goto fclose;
 	}
 
 	/* Write superblock (block 0) */
-	sb = write_superblock(fd, &stat_buf);
+	sb = write_superblock(fd, disk_size, nr_journal_blocks,
+			      max_blocks);
 	if (!sb) {
 		perror("write_superblock():");
 		ret = EXIT_FAILURE;
@@ -646,6 +965,22 @@ int main(int argc, char **argv)
 		goto free_sb;
 	}
 
+	/* Write metadata blocks of the other groups */
+	ret = write_group_meta_blocks(fd, sb);
+	if (ret != 0) {
+		perror("write_group_meta_blocks():");
+		ret = EXIT_FAILURE;
+		goto free_sb;
+	}
+
+	/* Write journal blocks */
+	ret = write_journal_blocks(fd, sb);
+	if (ret != 0) {
+		perror("write_journal_blocks():");
+		ret = EXIT_FAILURE;
+		goto free_sb;
+	}
+
 free_sb:
 	free(sb);
 fclose:
@@ -11,6 +11,12 @@
 #include <linux/build_bug.h>
 #include <linux/fs.h>
 #include <linux/time64.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/reciprocal_div.h>
+#include <linux/sched/clock.h>
+#include <linux/workqueue.h>
 
 // TYPE DEFINITIONS: Makes it easier to update code if we want to adjust the size of some fields
 #define ouichefs_snap_id_t uint32_t   /* Unique ID of a snapshot */
@@ -20,19 +26,40 @@
 // MAGIC values: Change at will - but be careful
 #define OUICHEFS_MAGIC 0x48434957
 #define OUICHEFS_SB_BLOCK_NR 0
-#define OUICHEFS_BLOCK_SIZE (1 << 12) /* 4 KiB */
-
-// DERIVATIVE values; They are computed from/constraint by the layout and magic values
-/* num. of data blocks a single index block can reference */
-#define OUICHEFS_INDEX_BLOCK_LEN (OUICHEFS_BLOCK_SIZE / sizeof(uint32_t))
-/* num. of blocks a single meta block stores data for */
-#define OUICHEFS_META_BLOCK_LEN \
-	(OUICHEFS_BLOCK_SIZE / sizeof(ouichefs_snap_index_t))
-#define OUICHEFS_MAX_FILESIZE (OUICHEFS_INDEX_BLOCK_LEN * OUICHEFS_BLOCK_SIZE)
+/* Range of block sizes, chosen at mkfs time and stored in the superblock */
+#define OUICHEFS_MIN_BLOCK_SIZE (1 << 10) /* 1 KiB */
+#define OUICHEFS_MAX_BLOCK_SIZE (1 << 16) /* 64 KiB */
+
+// DERIVATIVE values; Those depending on the block size (how many entries fit
+// in index, metadata, directory, bitmap, ... blocks) are computed at mount
+// time and kept in struct ouichefs_sb_info
 #define OUICHEFS_FILENAME_LEN 28 /* max. character length of a filename */
-#define OUICHEFS_MAX_SUBFILES 128 /* How many files a directory can hold */
 /* Maximal number of CONCURRENTLY existing snapshots */
 #define OUICHEFS_MAX_SNAPSHOTS 32
+#define OUICHEFS_JOURNAL_DESC_MAGIC 0x4a444553 /* Journal descriptor block */
+#define OUICHEFS_JOURNAL_COMMIT_MAGIC 0x4a434d54 /* Journal commit block */
+#define OUICHEFS_HANDLE_MAGIC 0x4a48444c /* In-memory journal handle */
+#define OUICHEFS_HOT_LIST_MAGIC 0x484f544c /* "HOTL" */
+/* Placement of the metadata blocks, see OUICHEFS_GET_META_BLOCK() */
+#define OUICHEFS_LAYOUT_FLAT 0 /* All metadata blocks before the data blocks */
+#define OUICHEFS_LAYOUT_GROUPS 1 /* Each metadata block before its data */
+
+/*
+ * On-disk format. The version only changes with incompatible reworks of the
+ * whole format, everything else is an optional feature:
+ * - compat: can be ignored by kernels that do not know it
+ * - ro_compat: kernels that do not know it may only mount read-only
+ * - incompat: kernels that do not know it must not mount at all
+ */
+#define OUICHEFS_VERSION 1
+/* Hot list of metadata blocks read ahead at mount, see hotlist.c */
+#define OUICHEFS_FEATURE_COMPAT_HOT_LIST 0x1
+/* Group layout, see OUICHEFS_LAYOUT_GROUPS */
+#define OUICHEFS_FEATURE_INCOMPAT_GROUPS 0x1
+/* Features supported by this module */
+#define OUICHEFS_FEATURE_COMPAT_SUPP OUICHEFS_FEATURE_COMPAT_HOT_LIST
+#define OUICHEFS_FEATURE_RO_COMPAT_SUPP 0
+#define OUICHEFS_FEATURE_INCOMPAT_SUPP OUICHEFS_FEATURE_INCOMPAT_GROUPS
 
 /*
  * ouiche_fs partition layout
@@ -55,6 +82,8 @@
  * |    data       |
  * |      blocks   |  rest of the blocks
  * +---------------+
+ * |    journal    |  sb->nr_journal_blocks blocks (marked used in bfree)
+ * +---------------+
  *
  */
 
@@ -75,11 +104,16 @@ struct ouichefs_inode_data {
 	uint32_t i_nlink; /* Hard links count */
 	uint32_t index_block; /* Index block / dir block of this inode */
 	ouichefs_snap_index_t refcount; /* How many inodes link to this */
+	uint64_t r_bytes; /* Directories only: bytes of all inodes below */
+	uint64_t r_blocks; /* Directories only: blocks of all inodes below */
+	uint64_t r_files; /* Directories only: number of inodes below */
+	uint32_t i_parent; /* Inode of the directory containing this inode */
+	uint32_t i_reserved;
 };
 
 /* Stored in the id_idx region. Links inode data entry numbers to a block. */
 struct ouichefs_inode_data_index_block {
-	uint32_t blocks[OUICHEFS_INDEX_BLOCK_LEN];
+	DECLARE_FLEX_ARRAY(uint32_t, blocks); /* sbi->index_len entries */
 };
 
 /*
@@ -92,18 +126,64 @@ struct ouichefs_inode {
 	uint32_t i_data[OUICHEFS_MAX_SNAPSHOTS];
 };
 
+/*
+ * Recursive statistics of a directory, i.e. the sum over everything below it.
+ * Also used to describe the usage of a single inode and deltas thereof.
+ */
+struct ouichefs_dir_stats {
+	int64_t bytes;
+	int64_t blocks;
+	int64_t files;
+};
+
+/* Write amplification counters, see ouichefs_wa_add() */
+enum ouichefs_wa {
+	OUICHEFS_WA_BYTES, /* Bytes written by write() */
+	OUICHEFS_WA_DATA, /* Data blocks written back */
+	/* Blocks copied by CoW, in the order of enum ouichefs_datablock_type */
+	OUICHEFS_WA_COW_DATA,
+	OUICHEFS_WA_COW_INDEX,
+	OUICHEFS_WA_COW_DIR,
+	OUICHEFS_WA_COW_INODE_DATA,
+	OUICHEFS_WA_IDE_COW, /* Inode data entries copied by CoW */
+	OUICHEFS_NR_WA,
+};
+
 /* In-memory layout of our inodes */
 struct ouichefs_inode_info {
 	uint32_t index_block;
+	uint32_t parent; /* Back-reference to the containing directory */
+	struct ouichefs_dir_stats r_stats; /* Protected by sbi->dstats_lock */
+	/* Not yet propagated to the parents, protected by sbi->dstats_lock */
+	struct ouichefs_dir_stats pending;
+	atomic64_t wa[OUICHEFS_NR_WA]; /* Since the inode was loaded */
+	int log_err; /* Set if the inode could not be logged when dirtied */
 	struct inode vfs_inode;
 };
 
-#define OUICHEFS_INODES_PER_BLOCK \
-	(OUICHEFS_BLOCK_SIZE / sizeof(struct ouichefs_inode))
-#define OUICHEFS_IDE_PER_DATA_BLOCK \
-	(OUICHEFS_BLOCK_SIZE / sizeof(struct ouichefs_inode_data))
-#define OUICHEFS_IDE_PER_INDEX_BLOCK \
-	(OUICHEFS_IDE_PER_DATA_BLOCK * OUICHEFS_INDEX_BLOCK_LEN)
+/*
+ * Header of the journal descriptor and commit blocks. A committed transaction
+ * is laid out as: descriptor | nr_blocks logged blocks | commit.
+ */
+struct ouichefs_journal_header {
+	uint32_t magic; /* Descriptor or commit magic */
+	uint32_t nr_blocks; /* Number of logged blocks */
+	uint64_t seq; /* Sequence number of the transaction */
+	uint32_t crc; /* Commit only: crc32 of descriptor and logged blocks */
+	uint32_t blocks[]; /* Descriptor only: home location of each block */
+};
+
+/*
+ * List of the most frequently read metadata blocks at the last unmount, read
+ * ahead at mount time. Sorted by block number.
+ */
+struct ouichefs_hot_list {
+	uint32_t magic;
+	uint32_t nr_blocks;
+	uint32_t crc; /* crc32 of blocks[0..nr_blocks) */
+	uint32_t reserved;
+	uint32_t blocks[];
+};
 
 struct ouichefs_snapshot_info {
 	time64_t created; /* Creation time (sec) */
@@ -118,7 +198,7 @@ struct ouichefs_sb_info {
 
 	uint32_t nr_istore_blocks; /* Number of inode store blocks */
 	uint32_t nr_ifree_blocks; /* Number of inode free bitmap blocks */
-	uint32_t nr_bfree_blocks; /* Number of block free bitmap blocks */
+	uint32_t nr_bfree_blocks; /* Number of block free bitmap blocks, incl. reserved ones */
 
 	uint32_t nr_free_inodes; /* Number of free inodes */
 	uint32_t nr_free_blocks; /* Number of free blocks */
@@ -128,6 +208,14 @@ struct ouichefs_sb_info {
 	uint32_t nr_idfree_blocks; /* Number of inode data entry free bitmap blocks */
 	uint32_t nr_ididx_blocks; /* Number of inode data index blocks */
 	uint32_t nr_meta_blocks; /* Number of metadata blocks */
+	uint32_t journal_start; /* First block of the journal */
+	uint32_t nr_journal_blocks; /* Size of the journal, 0 if there is none */
+	uint32_t hot_list_block; /* Block holding the hot list, 0 if none */
+	uint32_t block_size; /* Size of a block in bytes, a power of two */
+	uint32_t version; /* OUICHEFS_VERSION of the on-disk format */
+	uint32_t feature_compat; /* OUICHEFS_FEATURE_COMPAT_* */
+	uint32_t feature_ro_compat; /* OUICHEFS_FEATURE_RO_COMPAT_* */
+	uint32_t feature_incompat; /* OUICHEFS_FEATURE_INCOMPAT_* */
 
 	/* List of all snapshots. */
 	struct ouichefs_snapshot_info snapshots[OUICHEFS_MAX_SNAPSHOTS];
@@ -136,31 +224,87 @@ struct ouichefs_sb_info {
 	/*
 	 * TODO: This scales really poorly with large file systems, especially
 	 * 'idfree_bitmap'. Switch to direct buffer_head access after a certain
-	 * 'nr_inode_data_entries' threshold is reached.
+	 * 'nr_inode_data_entries' threshold is reached. Until then,
+	 * 'idfree_bitmap' is only loaded on first use, see ouichefs_load_idfree().
 	 */
 	unsigned long *ifree_bitmap; /* In-memory free inodes bitmap */
 	unsigned long *bfree_bitmap; /* In-memory free blocks bitmap */
 	unsigned long *idfree_bitmap; /* In-memory free blocks bitmap */
+	/* One bit per bitmap block modified since the last sync */
+	unsigned long *ifree_dirty;
+	unsigned long *bfree_dirty;
+	unsigned long *idfree_dirty;
 
 	spinlock_t ifree_lock; /* Lock for ifree_bitmap */
 	spinlock_t bfree_lock; /* Lock for bfree_bitmap */
 	spinlock_t idfree_lock; /* Lock for bfree_bitmap */
+	spinlock_t dstats_lock; /* Lock for the r_stats of all inodes */
+	struct mutex idfree_mutex; /* Serializes loading idfree_bitmap */
+
+	struct super_block *sb; /* Back pointer, used by the reclaim worker */
+	struct list_head reclaim_list; /* Detached directories to reclaim */
+	spinlock_t reclaim_lock; /* Lock for reclaim_list */
+	struct work_struct reclaim_work; /* Reclaims reclaim_list */
+	struct rw_semaphore detach_rwsem; /* Read: detaching, write: snapshot */
+
+	struct ouichefs_journal *journal; /* NULL if there is no journal */
+	struct ouichefs_hot_slot *hot; /* Read frequency of metadata blocks */
+	struct ouichefs_stats __percpu *stats; /* Performance counters */
+	struct dentry *debugfs; /* /sys/kernel/debug/ouichefs/<dev>/ */
+	struct ouichefs_wa_epoch *wa_epochs; /* The last OUICHEFS_WA_EPOCHS */
+	unsigned int wa_epoch; /* Number of epochs started */
+	spinlock_t wa_lock; /* Lock for wa_epochs */
+	uint32_t layout; /* OUICHEFS_LAYOUT_*, from the incompat features */
+
+	/*
+	 * Block geometry, derived from block_size at mount. Sizes are powers
+	 * of two wherever possible, so the layout helpers below use shifts
+	 * and masks; the other divisions go through reciprocals.
+	 */
+	uint32_t index_len; /* Block numbers per (inode data) index block */
+	uint32_t meta_len; /* Refcounts per metadata block */
+	uint32_t max_subfiles; /* How many files a directory can hold */
+	uint32_t bits_per_block; /* Bits per bitmap block */
+	uint32_t ide_per_block; /* Inode data entries per data block */
+	uint32_t group_blocks; /* Blocks per group: meta block and its data */
+	uint32_t hot_list_len; /* Blocks listed in the hot list */
+	uint32_t journal_max_blocks; /* Blocks a single transaction can log */
+	unsigned int inode_bits; /* log2 of the inodes per inode store block */
+	unsigned int index_bits; /* log2 of index_len */
+	unsigned int meta_bits; /* log2 of meta_len */
+	struct reciprocal_value ide_per_block_rv;
+	struct reciprocal_value group_blocks_rv;
+};
+
+/*
+ * A journal handle. Every modification of metadata happens between
+ * ouichefs_journal_start() and ouichefs_journal_stop(), which makes it part
+ * of exactly one transaction. Handles nest; only the outermost one counts.
+ */
+struct ouichefs_handle {
+	uint32_t magic; /* Tells our handles from those of other fs */
+	struct super_block *sb;
+	void *prev; /* Handle of another file system, if any */
+	bool outer;
+	unsigned int credits; /* Blocks it may still add to the transaction */
 };
 
 struct ouichefs_metadata_block {
-	/* One reference counter for each block */
-	ouichefs_snap_index_t refcount[OUICHEFS_META_BLOCK_LEN];
+	/* One reference counter for each block, sbi->meta_len entries */
+	DECLARE_FLEX_ARRAY(ouichefs_snap_index_t, refcount);
 };
 
 struct ouichefs_file_index_block {
-	uint32_t blocks[OUICHEFS_INDEX_BLOCK_LEN];
+	DECLARE_FLEX_ARRAY(uint32_t, blocks); /* sbi->index_len entries */
+};
+
+struct ouichefs_file {
+	uint32_t inode;
+	char filename[OUICHEFS_FILENAME_LEN];
 };
 
 struct ouichefs_dir_block {
-	struct ouichefs_file {
-		uint32_t inode;
-		char filename[OUICHEFS_FILENAME_LEN];
-	} files[OUICHEFS_MAX_SUBFILES];
+	DECLARE_FLEX_ARRAY(struct ouichefs_file, files); /* sbi->max_subfiles */
 };
 
 enum ouichefs_datablock_type {
@@ -170,6 +314,101 @@ enum ouichefs_datablock_type {
 	OUICHEFS_INODE_DATA,  /* list of struct ouichefs_inode_data */
 };
 
+/* Regions of the partition layout, see ouichefs_block_region() */
+enum ouichefs_region {
+	OUICHEFS_REGION_SB,
+	OUICHEFS_REGION_ISTORE,
+	OUICHEFS_REGION_IFREE,
+	OUICHEFS_REGION_BFREE,
+	OUICHEFS_REGION_IDFREE,
+	OUICHEFS_REGION_IDIDX,
+	OUICHEFS_REGION_META,
+	OUICHEFS_REGION_DATA,
+	OUICHEFS_REGION_JOURNAL,
+	OUICHEFS_NR_REGIONS,
+};
+
+/* Performance counters, exported in /sys/fs/ouichefs/<dev>/stats/ */
+enum ouichefs_stat {
+	OUICHEFS_STAT_ALLOC, /* Blocks allocated */
+	OUICHEFS_STAT_FREE, /* Blocks freed */
+	/* Blocks copied by CoW, in the order of enum ouichefs_datablock_type */
+	OUICHEFS_STAT_COW_DATA,
+	OUICHEFS_STAT_COW_INDEX,
+	OUICHEFS_STAT_COW_DIR,
+	OUICHEFS_STAT_COW_INODE_DATA,
+	OUICHEFS_STAT_REF_INC, /* Block refcount increments */
+	OUICHEFS_STAT_REF_DEC, /* Block refcount decrements */
+	OUICHEFS_STAT_IDE_COW, /* Inode data entries copied by CoW */
+	OUICHEFS_STAT_REFLINK_BYTES, /* Bytes shared by reflinks */
+	OUICHEFS_STAT_SNAP_CREATE,
+	OUICHEFS_STAT_SNAP_DELETE,
+	OUICHEFS_STAT_SNAP_RESTORE,
+	OUICHEFS_NR_STATS,
+};
+
+/* Block I/O of the module per region, see ouichefs_bread() */
+enum ouichefs_io {
+	OUICHEFS_IO_HIT, /* Block reads served by the buffer cache */
+	OUICHEFS_IO_READ, /* Blocks read from the device */
+	OUICHEFS_IO_WRITE, /* Blocks written to the device */
+	OUICHEFS_IO_WAIT, /* Synchronous waits for the device */
+	OUICHEFS_IO_WAIT_NS, /* Time spent in them */
+	OUICHEFS_NR_IO,
+};
+
+/* Operations with a latency histogram, see ouichefs_lat_end() */
+enum ouichefs_lat {
+	OUICHEFS_LAT_LOOKUP,
+	OUICHEFS_LAT_CREATE,
+	OUICHEFS_LAT_UNLINK,
+	OUICHEFS_LAT_RENAME,
+	OUICHEFS_LAT_WRITE_BEGIN,
+	OUICHEFS_LAT_WRITEPAGE,
+	OUICHEFS_LAT_WRITE_INODE,
+	OUICHEFS_LAT_SYNC_FS,
+	OUICHEFS_LAT_SNAP_CREATE,
+	OUICHEFS_LAT_SNAP_DELETE,
+	OUICHEFS_LAT_SNAP_RESTORE,
+	OUICHEFS_NR_LATS,
+};
+
+/* Bucket i counts latencies in [2^i, 2^(i+1)) ns, the last one all above */
+#define OUICHEFS_LAT_BUCKETS 40
+
+struct ouichefs_stats {
+	u64 count[OUICHEFS_NR_STATS];
+	u64 io[OUICHEFS_NR_REGIONS][OUICHEFS_NR_IO];
+	u64 wa[OUICHEFS_NR_WA];
+	u64 lat[OUICHEFS_NR_LATS][OUICHEFS_LAT_BUCKETS];
+};
+
+/*
+ * Write amplification of a partition from the creation of a snapshot to the
+ * next one. While it runs, count holds the totals at its start.
+ */
+struct ouichefs_wa_epoch {
+	time64_t start;
+	ouichefs_snap_id_t id; /* Snapshot that started it, 0 for the mount */
+	u64 count[OUICHEFS_NR_WA];
+};
+
+#define OUICHEFS_WA_EPOCHS 16
+
+/* Snapshot operations and their phases, as reported by the tracepoints */
+enum ouichefs_snapshot_op {
+	OUICHEFS_SNAP_CREATE,
+	OUICHEFS_SNAP_DELETE,
+	OUICHEFS_SNAP_RESTORE,
+};
+
+enum ouichefs_snapshot_phase {
+	OUICHEFS_SNAP_START,  /* Arguments checked, freezing the fs */
+	OUICHEFS_SNAP_FROZEN, /* File system frozen */
+	OUICHEFS_SNAP_INODES, /* All inodes on disk processed */
+	OUICHEFS_SNAP_END,    /* Committed and thawed */
+};
+
 /* superblock functions */
 int ouichefs_fill_super(struct super_block *sb, void *data, int silent);
 
@@ -178,12 +417,38 @@ int ouichefs_init_inode_cache(void);
 void ouichefs_destroy_inode_cache(void);
 struct inode *ouichefs_iget(struct super_block *sb, uint32_t ino, bool create);
 int ouichefs_ifill(struct inode *inode, bool create);
+void ouichefs_inode_usage(struct inode *inode, struct ouichefs_dir_stats *usage);
+void ouichefs_dir_stats_propagate(struct dentry *dentry,
+				  const struct ouichefs_dir_stats *delta);
+void ouichefs_dir_stats_defer(struct inode *inode,
+			      const struct ouichefs_dir_stats *delta);
+void ouichefs_dir_stats_flush(struct dentry *dentry);
+unsigned int ouichefs_dir_stats_credits(struct dentry *dentry);
+int ouichefs_ino_to_path(struct super_block *sb, uint32_t ino, char *buf,
+			 int size);
+int ouichefs_dir_remove_entry(struct inode *dir, uint32_t ino, bool is_dir);
+int ouichefs_release_inode(struct inode *inode);
+struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode,
+				 uint32_t index_block);
+
+/* subtree clone functions */
+int ouichefs_clone_tree(struct file *file, struct file *src_file,
+			const char *name);
+
+/* subtree reclaim functions */
+void ouichefs_reclaim_init(struct super_block *sb);
+int ouichefs_reclaim_detached(struct super_block *sb, uint32_t ino);
+void ouichefs_reclaim_flush(struct super_block *sb);
+int ouichefs_rmtree(struct file *file, const char *name);
 
 /* inode data functions */
 struct ouichefs_inode_data *ouichefs_get_inode_data(struct super_block *sb,
 						    struct buffer_head **id_bh,
 						    uint32_t ino, bool allocate,
-						    bool cow);
+						    bool *copied);
+struct ouichefs_inode_data *ouichefs_peek_inode_data(struct super_block *sb,
+						     struct buffer_head **id_bh,
+						     uint32_t ino);
 int ouichefs_link_inode_data(struct super_block *sb, uint32_t ino,
 			     struct ouichefs_inode *inode,
 			     ouichefs_snap_index_t from,
@@ -192,8 +457,9 @@ void ouichefs_put_inode_data(struct super_block *sb, uint32_t ino,
 			     struct ouichefs_inode *inode,
 			     ouichefs_snap_index_t snapshot);
 /* data block functions */
-int ouichefs_alloc_block(struct super_block *sb, uint32_t *bno);
-int ouichefs_cow_block(struct super_block *sb, uint32_t *bno,
+int ouichefs_alloc_block(struct super_block *sb, uint32_t *bno, uint32_t goal);
+int ouichefs_alloc_zeroed_block(struct super_block *sb, uint32_t *bno);
+int ouichefs_cow_block(struct inode *inode, uint32_t *bno,
 		       enum ouichefs_datablock_type b_type);
 int ouichefs_get_block(struct super_block *sb, uint32_t bno);
 void ouichefs_put_block(struct super_block *sb, uint32_t bno,
@@ -205,13 +471,108 @@ int ouichefs_snapshot_delete(struct super_block *sb, ouichefs_snap_id_t s_id);
 int ouichefs_snapshot_list(struct super_block *sb, char *buf);
 int ouichefs_snapshot_restore(struct super_block *sb, ouichefs_snap_id_t s_id);
 
+/* journal functions */
+int ouichefs_journal_load(struct super_block *sb);
+void ouichefs_journal_release(struct super_block *sb);
+void ouichefs_journal_start(struct super_block *sb, struct ouichefs_handle *h);
+void ouichefs_journal_start_credits(struct super_block *sb,
+				    struct ouichefs_handle *h,
+				    unsigned int extra);
+void ouichefs_journal_stop(struct ouichefs_handle *h);
+void ouichefs_journal_ensure_credits(struct ouichefs_handle *h,
+				     unsigned int nr);
+void ouichefs_journal_dirty(struct super_block *sb, struct buffer_head *bh);
+void ouichefs_journal_dirty_sync(struct super_block *sb,
+				 struct buffer_head *bh);
+void ouichefs_journal_bitmap(struct ouichefs_sb_info *sbi, uint32_t block);
+bool ouichefs_journal_defer_free(struct ouichefs_sb_info *sbi, uint32_t bno);
+int ouichefs_journal_commit(struct super_block *sb);
+int ouichefs_journal_flush(struct super_block *sb);
+int ouichefs_log_inode_retry(struct inode *inode);
+void ouichefs_sb_to_disk(struct super_block *sb,
+			 struct ouichefs_sb_info *disk_sb);
+int ouichefs_load_idfree(struct ouichefs_sb_info *sbi);
+
+/* statistics functions */
+int ouichefs_stats_init(struct super_block *sb);
+void ouichefs_stats_release(struct super_block *sb);
+u64 ouichefs_stat_read(struct super_block *sb, enum ouichefs_stat stat);
+u64 ouichefs_io_read(struct super_block *sb, enum ouichefs_region region,
+		     enum ouichefs_io io);
+enum ouichefs_region ouichefs_block_region(struct ouichefs_sb_info *sbi,
+					   uint32_t block);
+struct buffer_head *ouichefs_bread(struct super_block *sb, uint32_t block);
+void ouichefs_breadahead(struct super_block *sb, uint32_t block);
+int ouichefs_sync_buffer(struct super_block *sb, struct buffer_head *bh);
+int ouichefs_submit_bio_wait(struct super_block *sb, struct bio *bio);
+
+static inline void ouichefs_stat_add(struct ouichefs_sb_info *sbi,
+				     enum ouichefs_stat stat, u64 n)
+{
+	this_cpu_add(sbi->stats->count[stat], n);
+}
+
+static inline void ouichefs_stat_inc(struct ouichefs_sb_info *sbi,
+				     enum ouichefs_stat stat)
+{
+	ouichefs_stat_add(sbi, stat, 1);
+}
+
+/* Accounts nr blocks of I/O starting at block */
+static inline void ouichefs_io_add(struct ouichefs_sb_info *sbi,
+				   uint32_t block, enum ouichefs_io io,
+				   u64 nr)
+{
+	this_cpu_add(sbi->stats->io[ouichefs_block_region(sbi, block)][io],
+		     nr);
+}
+
+/*
+ * Records the latency of an operation that started at start, as returned by
+ * local_clock().
+ */
+static inline void ouichefs_lat_end(struct ouichefs_sb_info *sbi,
+				    enum ouichefs_lat lat, u64 start)
+{
+	s64 delta = local_clock() - start;
+	unsigned int bucket = 0;
+
+	/* local_clock() may go backwards slightly across CPUs */
+	if (delta > 1)
+		bucket = min_t(unsigned int, ilog2((u64)delta),
+			       OUICHEFS_LAT_BUCKETS - 1);
+	this_cpu_inc(sbi->stats->lat[lat][bucket]);
+}
+
+void ouichefs_wa_new_epoch(struct super_block *sb, ouichefs_snap_id_t id);
+
+/* debugfs functions */
+void ouichefs_debugfs_init(void);
+void ouichefs_debugfs_exit(void);
+void ouichefs_debugfs_register(struct super_block *sb);
+void ouichefs_debugfs_unregister(struct super_block *sb);
+void ouichefs_frag_debugfs(struct super_block *sb, struct dentry *dir);
+
+/* resize functions */
+int ouichefs_grow(struct super_block *sb, uint32_t nr_blocks);
+
+/* hot list functions */
+struct buffer_head *ouichefs_bread_hot(struct super_block *sb, uint32_t block);
+void ouichefs_hot_init(struct super_block *sb);
+void ouichefs_hot_save(struct super_block *sb);
+void ouichefs_hot_release(struct super_block *sb);
+
 /* sysfs interface function */
 int create_ouichefs_partition_entry(const char *dev_name, struct super_block *sb);
 void remove_ouichefs_partition_entry(const char *dev_name);
 int init_sysfs_interface(void);
 void cleanup_sysfs_interface(void);
 
+/* ioctl functions */
+long ouichefs_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+
 /* file functions */
+int ouichefs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
 extern const struct file_operations ouichefs_file_ops;
 extern const struct file_operations ouichefs_dir_ops;
 extern const struct address_space_operations ouichefs_aops;
@@ -221,23 +582,27 @@ extern const struct address_space_operations ouichefs_aops;
 #define OUICHEFS_INODE(inode) \
 	(container_of(inode, struct ouichefs_inode_info, vfs_inode))
 
+/* Charges n to the write amplification of inode and of its partition */
+static inline void ouichefs_wa_add(struct inode *inode, enum ouichefs_wa wa,
+				   u64 n)
+{
+	atomic64_add(n, &OUICHEFS_INODE(inode)->wa[wa]);
+	this_cpu_add(OUICHEFS_SB(inode->i_sb)->stats->wa[wa], n);
+}
+
 // Do some compile-time sanity checks
-static_assert(sizeof(struct ouichefs_metadata_block) <= OUICHEFS_BLOCK_SIZE,
-			"ouichefs_metadata_block is bigger than a block!");
-static_assert(sizeof(struct ouichefs_sb_info) <= OUICHEFS_BLOCK_SIZE,
+static_assert(offsetof(struct ouichefs_sb_info, ifree_bitmap) <= OUICHEFS_MIN_BLOCK_SIZE,
 			"ouichefs_sb_info is bigger than a block!");
-static_assert(sizeof(struct ouichefs_file_index_block) <= OUICHEFS_BLOCK_SIZE,
-			"ouichefs_file_index_block is bigger than a block!");
-static_assert(sizeof(struct ouichefs_inode_data_index_block) <= OUICHEFS_BLOCK_SIZE,
-			"ouichefs_inode_data_index_block is bigger than a block!");
-static_assert(sizeof(struct ouichefs_dir_block) <= OUICHEFS_BLOCK_SIZE,
-			"ouichefs_dir_block is bigger than a block!");
-static_assert(sizeof(struct ouichefs_inode) <= OUICHEFS_BLOCK_SIZE,
+static_assert(sizeof(struct ouichefs_inode_data) <= OUICHEFS_MIN_BLOCK_SIZE,
+			"ouichefs_inode_data is bigger than a block!");
+static_assert(sizeof(struct ouichefs_inode) <= OUICHEFS_MIN_BLOCK_SIZE,
 			"ouichefs_inode is bigger than a block!");
+static_assert(!(sizeof(struct ouichefs_inode) & (sizeof(struct ouichefs_inode) - 1)),
+			"ouichefs_inode size must be a power of two!");
+static_assert(!(sizeof(struct ouichefs_file) & (sizeof(struct ouichefs_file) - 1)),
+			"ouichefs_file size must be a power of two!");
 static_assert(OUICHEFS_MAX_SNAPSHOTS <= (1l << 8 * sizeof(ouichefs_snap_index_t)),
 			"type ouichefs_snap_index_t cannot fit OUICHEFS_MAX_SNAPSHOTS!");
-static_assert(OUICHEFS_MAX_FILESIZE >= (1l << 22),
-			"OUICHEFS_MAX_FILESIZE is smaller than 4MB!");
 
 /*
  * File system layout helpers to ease accessing the various blocks and regions
@@ -248,10 +613,10 @@ static_assert(OUICHEFS_MAX_FILESIZE >= (1l << 22),
  * Inodes are indexed linearly by their number (ino). Multiple inodes live in
  * the same physical block in the 'inode store' region.
  */
- #define OUICHEFS_GET_INODE_BLOCK(ino) \
-	(1 + (ino / ((uint32_t) OUICHEFS_INODES_PER_BLOCK)))
-#define OUICHEFS_GET_INODE_SHIFT(ino) \
-	(ino % OUICHEFS_INODES_PER_BLOCK)
+#define OUICHEFS_GET_INODE_BLOCK(sbi, ino) \
+	(1 + ((ino) >> sbi->inode_bits))
+#define OUICHEFS_GET_INODE_SHIFT(sbi, ino) \
+	((ino) & ((1U << sbi->inode_bits) - 1))
 
 /*
  * Ouichefs uses various bitmaps to manage free indices and blocks.
@@ -262,6 +627,12 @@ static_assert(OUICHEFS_MAX_FILESIZE >= (1l << 22),
 	(1 + sbi->nr_istore_blocks + sbi->nr_ifree_blocks)
 #define OUICHEFS_GET_IDFREE_START(sbi) \
 	(OUICHEFS_GET_BFREE_START(sbi) + sbi->nr_bfree_blocks)
+/*
+ * Block free bitmap blocks covering the partition. mkfs may reserve more, so
+ * that the partition can grow online, see ouichefs_grow().
+ */
+#define OUICHEFS_GET_BFREE_USED(sbi) \
+	DIV_ROUND_UP(sbi->nr_blocks, sbi->bits_per_block)
 
 /*
  * Similar to inodes, inode data is index by a simple number (idx).
@@ -270,31 +641,53 @@ static_assert(OUICHEFS_MAX_FILESIZE >= (1l << 22),
  * is needed to map each index number (idx) to some spot in a data block.
  * Similarly, each index block can hold multiple mappings.
  */
+/* Number of the inode data block of idx, counted across all ididx blocks */
+#define OUICHEFS_GET_IDE_NR(sbi, idx) \
+	reciprocal_divide(idx, sbi->ide_per_block_rv)
 #define OUICHEFS_GET_IDIDX_BLOCK(sbi, idx) (\
 	OUICHEFS_GET_IDFREE_START(sbi) + sbi->nr_idfree_blocks + \
-	(idx / ((uint32_t) OUICHEFS_IDE_PER_INDEX_BLOCK)) \
+	(OUICHEFS_GET_IDE_NR(sbi, idx) >> sbi->index_bits) \
 )
 #define OUICHEFS_GET_IDIDX_INDEX(sbi, idx) (\
-	(idx % OUICHEFS_IDE_PER_INDEX_BLOCK) / \
-	((uint32_t) OUICHEFS_IDE_PER_DATA_BLOCK) \
+	OUICHEFS_GET_IDE_NR(sbi, idx) & (sbi->index_len - 1) \
 )
 #define OUICHEFS_GET_IDIDX_SHIFT(sbi, idx) (\
-	(idx % OUICHEFS_IDE_PER_INDEX_BLOCK) % OUICHEFS_IDE_PER_DATA_BLOCK \
+	idx - OUICHEFS_GET_IDE_NR(sbi, idx) * sbi->ide_per_block \
 )
 
 /*
  * Data blocks hold data of many different formats. Each data block supports
  * Copy-on-Write, and hence each block has a reference counter associated with
  * it - this counter is stored in the metadata blocks.
+ * With the flat layout, all metadata blocks come before the first data block.
+ * With the group layout, the remainder of the partition is split into groups,
+ * each made of a metadata block followed by the data blocks it covers. This
+ * keeps refcount updates close to the data they belong to.
  */
+#define OUICHEFS_GET_META_START(sbi) \
+	(OUICHEFS_GET_IDIDX_BLOCK(sbi, 0) + sbi->nr_ididx_blocks)
 #define OUICHEFS_GET_DATA_START(sbi) \
-	(OUICHEFS_GET_IDIDX_BLOCK(sbi, 0) + sbi->nr_ididx_blocks + sbi->nr_meta_blocks)
+	(OUICHEFS_GET_META_START(sbi) + \
+	 (sbi->layout == OUICHEFS_LAYOUT_GROUPS ? 0 : sbi->nr_meta_blocks))
+/* Group layout only: first block of the group of bno, its metadata block */
+#define OUICHEFS_GET_GROUP_START(bno, sbi) \
+	(OUICHEFS_GET_META_START(sbi) + \
+	 reciprocal_divide(bno - OUICHEFS_GET_META_START(sbi), \
+			   sbi->group_blocks_rv) * sbi->group_blocks)
+/* Whether bno is a metadata block inside the data blocks (group layout) */
+#define OUICHEFS_IS_META_BLOCK(bno, sbi) \
+	(sbi->layout == OUICHEFS_LAYOUT_GROUPS && \
+	 bno == OUICHEFS_GET_GROUP_START(bno, sbi))
 /* Get metadata block for data block */
 #define OUICHEFS_GET_META_BLOCK(bno, sbi) \
-	(OUICHEFS_GET_IDIDX_BLOCK(sbi, 0) + sbi->nr_ididx_blocks + \
-	((bno - OUICHEFS_GET_DATA_START(sbi)) / ((uint32_t) OUICHEFS_META_BLOCK_LEN)))
+	(sbi->layout == OUICHEFS_LAYOUT_GROUPS ? \
+	 OUICHEFS_GET_GROUP_START(bno, sbi) : \
+	 OUICHEFS_GET_META_START(sbi) + \
+	 ((bno - OUICHEFS_GET_DATA_START(sbi)) >> sbi->meta_bits))
 /* Offset inside the metadata block */
 #define OUICHEFS_GET_META_SHIFT(bno) \
-	((bno - OUICHEFS_GET_DATA_START(sbi)) % OUICHEFS_META_BLOCK_LEN)
+	(sbi->layout == OUICHEFS_LAYOUT_GROUPS ? \
+	 bno - OUICHEFS_GET_GROUP_START(bno, sbi) - 1 : \
+	 (bno - OUICHEFS_GET_DATA_START(sbi)) & (sbi->meta_len - 1))
 
 #endif /* _OUICHEFS_H */
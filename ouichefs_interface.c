@@ -72,7 +72,11 @@ static const struct sysfs_ops partition_sysfs_ops = {
 
 static int add_snapshot(struct ouichefs_partition *part, unsigned int id)
 {
+	u64 start = local_clock();
 	int ret = ouichefs_snapshot_create(part->sb, id);
+
+	ouichefs_lat_end(OUICHEFS_SB(part->sb), OUICHEFS_LAT_SNAP_CREATE,
+			 start);
 	if (!ret)
 		pr_info("ouichefs: Created snapshot in partition %s\n", part->name);
 	return ret;
@@ -80,7 +84,11 @@ static int add_snapshot(struct ouichefs_partition *part, unsigned int id)
 
 static int remove_snapshot(struct ouichefs_partition *part, unsigned int id)
 {
+	u64 start = local_clock();
 	int ret = ouichefs_snapshot_delete(part->sb, id);
+
+	ouichefs_lat_end(OUICHEFS_SB(part->sb), OUICHEFS_LAT_SNAP_DELETE,
+			 start);
 	if (!ret)
 		pr_info("ouichefs: Destroyed snapshot %u in partition %s\n", id, part->name);
 
@@ -89,7 +97,11 @@ static int remove_snapshot(struct ouichefs_partition *part, unsigned int id)
 
 static int restore_snapshot(struct ouichefs_partition *part, unsigned int id)
 {
+	u64 start = local_clock();
 	int ret = ouichefs_snapshot_restore(part->sb, id);
+
+	ouichefs_lat_end(OUICHEFS_SB(part->sb), OUICHEFS_LAT_SNAP_RESTORE,
+			 start);
 	if (!ret)
 		pr_info("ouichefs: Restored snapshot %u in partition %s\n", id, part->name);
 
@@ -162,7 +174,117 @@ static struct attribute *partition_attrs[] = {
 	NULL,
 };
 
-ATTRIBUTE_GROUPS(partition);
+static const struct attribute_group partition_group = {
+	.attrs = partition_attrs,
+};
+
+/* A counter in the stats/ directory of a partition */
+struct stat_attribute {
+	struct partition_attribute attr;
+	enum ouichefs_stat stat;
+};
+
+static ssize_t stat_show(struct ouichefs_partition *part,
+			 struct partition_attribute *attr, char *buf)
+{
+	struct stat_attribute *sattr =
+		container_of(attr, struct stat_attribute, attr);
+
+	return sysfs_emit(buf, "%llu\n",
+			  ouichefs_stat_read(part->sb, sattr->stat));
+}
+
+#define STAT_ATTR(_name, _stat)					\
+	static struct stat_attribute stat_attr_##_name = {		\
+		.attr = __ATTR(_name, 0444, stat_show, NULL),		\
+		.stat = _stat,						\
+	}
+
+STAT_ATTR(blocks_allocated, OUICHEFS_STAT_ALLOC);
+STAT_ATTR(blocks_freed, OUICHEFS_STAT_FREE);
+STAT_ATTR(cow_data, OUICHEFS_STAT_COW_DATA);
+STAT_ATTR(cow_index, OUICHEFS_STAT_COW_INDEX);
+STAT_ATTR(cow_dir, OUICHEFS_STAT_COW_DIR);
+STAT_ATTR(cow_inode_data, OUICHEFS_STAT_COW_INODE_DATA);
+STAT_ATTR(refcount_inc, OUICHEFS_STAT_REF_INC);
+STAT_ATTR(refcount_dec, OUICHEFS_STAT_REF_DEC);
+STAT_ATTR(inode_data_cow, OUICHEFS_STAT_IDE_COW);
+STAT_ATTR(reflink_bytes, OUICHEFS_STAT_REFLINK_BYTES);
+STAT_ATTR(snapshot_create, OUICHEFS_STAT_SNAP_CREATE);
+STAT_ATTR(snapshot_delete, OUICHEFS_STAT_SNAP_DELETE);
+STAT_ATTR(snapshot_restore, OUICHEFS_STAT_SNAP_RESTORE);
+
+/* Block reads of a region, whether served by the buffer cache or not */
+struct io_attribute {
+	struct partition_attribute attr;
+	enum ouichefs_region region;
+};
+
+static ssize_t io_show(struct ouichefs_partition *part,
+		       struct partition_attribute *attr, char *buf)
+{
+	struct io_attribute *iattr =
+		container_of(attr, struct io_attribute, attr);
+
+	return sysfs_emit(buf, "%llu\n",
+			  ouichefs_io_read(part->sb, iattr->region,
+					   OUICHEFS_IO_HIT) +
+			  ouichefs_io_read(part->sb, iattr->region,
+					   OUICHEFS_IO_READ));
+}
+
+#define IO_ATTR(_name, _region)					\
+	static struct io_attribute io_attr_##_name = {			\
+		.attr = __ATTR(_name, 0444, io_show, NULL),		\
+		.region = _region,					\
+	}
+
+IO_ATTR(reads_sb, OUICHEFS_REGION_SB);
+IO_ATTR(reads_istore, OUICHEFS_REGION_ISTORE);
+IO_ATTR(reads_ifree, OUICHEFS_REGION_IFREE);
+IO_ATTR(reads_bfree, OUICHEFS_REGION_BFREE);
+IO_ATTR(reads_idfree, OUICHEFS_REGION_IDFREE);
+IO_ATTR(reads_ididx, OUICHEFS_REGION_IDIDX);
+IO_ATTR(reads_meta, OUICHEFS_REGION_META);
+IO_ATTR(reads_data, OUICHEFS_REGION_DATA);
+IO_ATTR(reads_journal, OUICHEFS_REGION_JOURNAL);
+
+static struct attribute *stats_attrs[] = {
+	&stat_attr_blocks_allocated.attr.attr,
+	&stat_attr_blocks_freed.attr.attr,
+	&stat_attr_cow_data.attr.attr,
+	&stat_attr_cow_index.attr.attr,
+	&stat_attr_cow_dir.attr.attr,
+	&stat_attr_cow_inode_data.attr.attr,
+	&stat_attr_refcount_inc.attr.attr,
+	&stat_attr_refcount_dec.attr.attr,
+	&stat_attr_inode_data_cow.attr.attr,
+	&stat_attr_reflink_bytes.attr.attr,
+	&stat_attr_snapshot_create.attr.attr,
+	&stat_attr_snapshot_delete.attr.attr,
+	&stat_attr_snapshot_restore.attr.attr,
+	&io_attr_reads_sb.attr.attr,
+	&io_attr_reads_istore.attr.attr,
+	&io_attr_reads_ifree.attr.attr,
+	&io_attr_reads_bfree.attr.attr,
+	&io_attr_reads_idfree.attr.attr,
+	&io_attr_reads_ididx.attr.attr,
+	&io_attr_reads_meta.attr.attr,
+	&io_attr_reads_data.attr.attr,
+	&io_attr_reads_journal.attr.attr,
+	NULL,
+};
+
+static const struct attribute_group stats_group = {
+	.name = "stats",
+	.attrs = stats_attrs,
+};
+
+static const struct attribute_group *partition_groups[] = {
+	&partition_group,
+	&stats_group,
+	NULL,
+};
 
 static void partition_release(struct kobject *kobj)
 {
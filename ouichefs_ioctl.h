@@ -0,0 +1,141 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * ioctl interface of ouiche_fs. This header is shared between the kernel
+ * module and userspace tools, so only use types from <linux/types.h> here.
+ */
+#ifndef _OUICHEFS_IOCTL_H
+#define _OUICHEFS_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define OUICHEFS_IOC_MAGIC 'O'
+
+/*
+ * Recursive statistics of a directory: the sum over all inodes below it,
+ * excluding the directory itself. Blocks are counted in file system blocks.
+ */
+struct ouichefs_ioc_dirstats {
+	__u64 bytes;
+	__u64 blocks;
+	__u64 files;
+};
+
+#define OUICHEFS_IOC_GET_DIRSTATS \
+	_IOR(OUICHEFS_IOC_MAGIC, 1, struct ouichefs_ioc_dirstats)
+
+/*
+ * Resolves an inode number to its path, relative to the root of the file
+ * system. 'path' points to a buffer of 'size' bytes that receives the
+ * NUL-terminated path. Requires CAP_SYS_ADMIN.
+ */
+struct ouichefs_ioc_ino_path {
+	__u32 ino;
+	__u32 size;
+	__u64 path;
+};
+
+#define OUICHEFS_IOC_INO_TO_PATH \
+	_IOW(OUICHEFS_IOC_MAGIC, 2, struct ouichefs_ioc_ino_path)
+
+/*
+ * Metadata of one inode as returned by OUICHEFS_IOC_BULKSTAT. Bit i of
+ * 'snapshots' is set if the inode exists in snapshot slot i, where slot 0 is
+ * the live file system. Inodes that only exist in snapshots are reported with
+ * all other fields but 'ino' zeroed.
+ */
+struct ouichefs_ioc_bstat {
+	__u32 ino;
+	__u32 mode;
+	__u32 uid;
+	__u32 gid;
+	__u32 nlink;
+	__u32 blocks;
+	__u32 index_block;
+	__u32 snapshots;
+	__u64 size;
+	__s64 atime;
+	__s64 mtime;
+	__s64 ctime;
+	__u32 atime_nsec;
+	__u32 mtime_nsec;
+	__u32 ctime_nsec;
+	__u32 pad;
+};
+
+/*
+ * Streams the metadata of all used inodes, in inode number order, starting at
+ * 'start_ino'. 'buf' points to an array of 'count' struct ouichefs_ioc_bstat.
+ * On return, 'count' holds the number of entries filled in and 'start_ino' the
+ * inode to continue from; A count of 0 signals the end of the inode store.
+ * Requires CAP_SYS_ADMIN.
+ */
+struct ouichefs_ioc_bulkstat {
+	__u32 start_ino;
+	__u32 count;
+	__u64 buf;
+};
+
+#define OUICHEFS_IOC_BULKSTAT \
+	_IOWR(OUICHEFS_IOC_MAGIC, 3, struct ouichefs_ioc_bulkstat)
+
+/*
+ * Detaches the subdirectory 'name' (a pointer to a NUL-terminated string) of
+ * the directory the ioctl is issued on and returns immediately. The subtree
+ * is reclaimed in the background. Requires CAP_SYS_ADMIN.
+ */
+struct ouichefs_ioc_rmtree {
+	__u64 name;
+};
+
+#define OUICHEFS_IOC_RMTREE \
+	_IOW(OUICHEFS_IOC_MAGIC, 4, struct ouichefs_ioc_rmtree)
+
+/*
+ * Clones the directory opened as 'src_fd' recursively into the directory the
+ * ioctl is issued on, as the new entry 'name' (a pointer to a NUL-terminated
+ * string). Regular files share all their blocks with the source until either
+ * side is modified. Requires CAP_SYS_ADMIN.
+ */
+struct ouichefs_ioc_clone_tree {
+	__s64 src_fd;
+	__u64 name;
+};
+
+#define OUICHEFS_IOC_CLONE_TREE \
+	_IOW(OUICHEFS_IOC_MAGIC, 5, struct ouichefs_ioc_clone_tree)
+
+/*
+ * Grows the mounted file system to 'nr_blocks' blocks, or to the size of the
+ * underlying device if 'nr_blocks' is 0. Requires the group layout and enough
+ * block free bitmap space, reserved with mkfs -r. The file system is frozen
+ * during the operation. Requires CAP_SYS_ADMIN.
+ */
+struct ouichefs_ioc_grow {
+	__u64 nr_blocks;
+};
+
+#define OUICHEFS_IOC_GROW \
+	_IOW(OUICHEFS_IOC_MAGIC, 6, struct ouichefs_ioc_grow)
+
+/*
+ * Write amplification of a file or directory since its inode was loaded in
+ * memory: bytes written by write() versus blocks written back to disk and
+ * copied by Copy-on-Write because a snapshot or reflink shared them.
+ */
+struct ouichefs_ioc_wstats {
+	__u64 bytes; /* Bytes written by write() */
+	__u64 data_blocks; /* Data blocks written back */
+	__u64 cow_data; /* Blocks copied by Copy-on-Write, per type */
+	__u64 cow_index;
+	__u64 cow_dir;
+	__u64 cow_inode_data;
+	__u64 inode_data; /* Inode data entries copied by Copy-on-Write */
+};
+
+#define OUICHEFS_IOC_GET_WSTATS \
+	_IOR(OUICHEFS_IOC_MAGIC, 7, struct ouichefs_ioc_wstats)
+
+#endif /* _OUICHEFS_IOCTL_H */
@@ -0,0 +1,268 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Tracepoints of ouiche_fs, see /sys/kernel/tracing/events/ouichefs/. They
+ * only carry numbers, so tools like perf or bpftrace can aggregate them.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ouichefs
+
+#if !defined(_OUICHEFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _OUICHEFS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include "ouichefs.h"
+
+TRACE_DEFINE_ENUM(OUICHEFS_DATA);
+TRACE_DEFINE_ENUM(OUICHEFS_INDEX);
+TRACE_DEFINE_ENUM(OUICHEFS_DIR);
+TRACE_DEFINE_ENUM(OUICHEFS_INODE_DATA);
+
+#define show_block_type(type)					\
+	__print_symbolic(type,					\
+			 { OUICHEFS_DATA, "data" },		\
+			 { OUICHEFS_INDEX, "index" },		\
+			 { OUICHEFS_DIR, "dir" },		\
+			 { OUICHEFS_INODE_DATA, "inode_data" })
+
+TRACE_DEFINE_ENUM(OUICHEFS_SNAP_CREATE);
+TRACE_DEFINE_ENUM(OUICHEFS_SNAP_DELETE);
+TRACE_DEFINE_ENUM(OUICHEFS_SNAP_RESTORE);
+TRACE_DEFINE_ENUM(OUICHEFS_SNAP_START);
+TRACE_DEFINE_ENUM(OUICHEFS_SNAP_FROZEN);
+TRACE_DEFINE_ENUM(OUICHEFS_SNAP_INODES);
+TRACE_DEFINE_ENUM(OUICHEFS_SNAP_END);
+
+#define show_snapshot_op(op)					\
+	__print_symbolic(op,					\
+			 { OUICHEFS_SNAP_CREATE, "create" },	\
+			 { OUICHEFS_SNAP_DELETE, "delete" },	\
+			 { OUICHEFS_SNAP_RESTORE, "restore" })
+
+#define show_snapshot_phase(phase)				\
+	__print_symbolic(phase,					\
+			 { OUICHEFS_SNAP_START, "start" },	\
+			 { OUICHEFS_SNAP_FROZEN, "frozen" },	\
+			 { OUICHEFS_SNAP_INODES, "inodes" },	\
+			 { OUICHEFS_SNAP_END, "end" })
+
+TRACE_EVENT(ouichefs_alloc_block,
+	TP_PROTO(struct super_block *sb, uint32_t goal, uint32_t bno, int ret),
+	TP_ARGS(sb, goal, bno, ret),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(uint32_t, goal)
+		__field(uint32_t, bno)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->goal = goal;
+		__entry->bno = bno;
+		__entry->ret = ret;
+	),
+
+	TP_printk("dev %d,%d goal %u bno %u ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->goal,
+		  __entry->bno, __entry->ret)
+);
+
+TRACE_EVENT(ouichefs_cow_block,
+	TP_PROTO(struct super_block *sb, uint32_t old_bno, uint32_t new_bno,
+		 int type, unsigned int refcount),
+	TP_ARGS(sb, old_bno, new_bno, type, refcount),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(uint32_t, old_bno)
+		__field(uint32_t, new_bno)
+		__field(int, type)
+		__field(unsigned int, refcount)
+	),
+
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->old_bno = old_bno;
+		__entry->new_bno = new_bno;
+		__entry->type = type;
+		__entry->refcount = refcount;
+	),
+
+	TP_printk("dev %d,%d %s block %u refcount %u %s %u",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  show_block_type(__entry->type), __entry->old_bno,
+		  __entry->refcount,
+		  __entry->old_bno == __entry->new_bno ? "kept" : "copied to",
+		  __entry->new_bno)
+);
+
+TRACE_EVENT(ouichefs_get_block,
+	TP_PROTO(struct super_block *sb, uint32_t bno, unsigned int refcount),
+	TP_ARGS(sb, bno, refcount),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(uint32_t, bno)
+		__field(unsigned int, refcount)
+	),
+
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->bno = bno;
+		__entry->refcount = refcount;
+	),
+
+	TP_printk("dev %d,%d bno %u refcount %u",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->bno,
+		  __entry->refcount)
+);
+
+TRACE_EVENT(ouichefs_put_block,
+	TP_PROTO(struct super_block *sb, uint32_t bno, int type,
+		 unsigned int refcount),
+	TP_ARGS(sb, bno, type, refcount),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(uint32_t, bno)
+		__field(int, type)
+		__field(unsigned int, refcount)
+	),
+
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->bno = bno;
+		__entry->type = type;
+		__entry->refcount = refcount;
+	),
+
+	TP_printk("dev %d,%d %s bno %u refcount %u%s",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  show_block_type(__entry->type), __entry->bno,
+		  __entry->refcount, __entry->refcount ? "" : " freed")
+);
+
+TRACE_EVENT(ouichefs_get_inode_data,
+	TP_PROTO(struct super_block *sb, uint32_t ino, uint32_t idx,
+		 uint32_t bno, unsigned int refcount, bool allocate, bool cow),
+	TP_ARGS(sb, ino, idx, bno, refcount, allocate, cow),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(uint32_t, ino)
+		__field(uint32_t, idx)
+		__field(uint32_t, bno)
+		__field(unsigned int, refcount)
+		__field(bool, allocate)
+		__field(bool, cow)
+	),
+
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->ino = ino;
+		__entry->idx = idx;
+		__entry->bno = bno;
+		__entry->refcount = refcount;
+		__entry->allocate = allocate;
+		__entry->cow = cow;
+	),
+
+	TP_printk("dev %d,%d ino %u idx %u bno %u refcount %u allocate %d cow %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->idx, __entry->bno, __entry->refcount,
+		  __entry->allocate, __entry->cow)
+);
+
+TRACE_EVENT(ouichefs_write_begin,
+	TP_PROTO(struct inode *inode, loff_t pos, unsigned int len, int ret),
+	TP_ARGS(inode, pos, len, ret),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(loff_t, pos)
+		__field(unsigned int, len)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->pos = pos;
+		__entry->len = len;
+		__entry->ret = ret;
+	),
+
+	TP_printk("dev %d,%d ino %lu pos %lld len %u ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->pos, __entry->len, __entry->ret)
+);
+
+TRACE_EVENT(ouichefs_write_end,
+	TP_PROTO(struct inode *inode, loff_t pos, unsigned int len,
+		 unsigned int copied, uint64_t blocks),
+	TP_ARGS(inode, pos, len, copied, blocks),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(loff_t, pos)
+		__field(unsigned int, len)
+		__field(unsigned int, copied)
+		__field(uint64_t, blocks)
+	),
+
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->pos = pos;
+		__entry->len = len;
+		__entry->copied = copied;
+		__entry->blocks = blocks;
+	),
+
+	TP_printk("dev %d,%d ino %lu pos %lld len %u copied %u blocks %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->pos, __entry->len, __entry->copied,
+		  __entry->blocks)
+);
+
+TRACE_EVENT(ouichefs_snapshot,
+	TP_PROTO(struct super_block *sb, int op, int phase, uint32_t id,
+		 int ret),
+	TP_ARGS(sb, op, phase, id, ret),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(int, op)
+		__field(int, phase)
+		__field(uint32_t, id)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->op = op;
+		__entry->phase = phase;
+		__entry->id = id;
+		__entry->ret = ret;
+	),
+
+	TP_printk("dev %d,%d %s %u %s ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  show_snapshot_op(__entry->op), __entry->id,
+		  show_snapshot_phase(__entry->phase), __entry->ret)
+);
+
+#endif /* _OUICHEFS_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ouichefs_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,275 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/mount.h>
+#include <linux/namei.h>
+#include <linux/slab.h>
+#include <linux/buffer_head.h>
+#include <linux/workqueue.h>
+
+#include "ouichefs.h"
+
+/*
+ * A directory of a detached subtree, waiting to be reclaimed. Files are
+ * reclaimed directly while their parent directory is processed, so only
+ * directories are ever queued.
+ */
+struct ouichefs_reclaim {
+	struct list_head list;
+	uint32_t ino;
+};
+
+static int ouichefs_reclaim_queue(struct ouichefs_sb_info *sbi, uint32_t ino)
+{
+	struct ouichefs_reclaim *entry;
+
+	entry = kmalloc(sizeof(*entry), GFP_NOFS);
+	if (!entry)
+		return -ENOMEM;
+	entry->ino = ino;
+
+	/* Depth-first, this keeps the list short */
+	spin_lock(&sbi->reclaim_lock);
+	list_add(&entry->list, &sbi->reclaim_list);
+	spin_unlock(&sbi->reclaim_lock);
+	return 0;
+}
+
+/*
+ * Reclaims a detached directory and all regular files in it. Subdirectories
+ * are queued and reclaimed later on.
+ */
+static int ouichefs_reclaim_dir(struct super_block *sb, uint32_t ino)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_dir_block *dblock;
+	struct ouichefs_handle handle;
+	struct buffer_head *bh;
+	struct inode *inode, *child;
+	int i, ret;
+
+	inode = ouichefs_iget(sb, ino, false);
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+	inode_lock_nested(inode, I_MUTEX_PARENT);
+	inode->i_flags |= S_DEAD;
+
+	bh = ouichefs_bread(sb, OUICHEFS_INODE(inode)->index_block);
+	if (!bh) {
+		ret = -EIO;
+		goto unlock;
+	}
+	dblock = (struct ouichefs_dir_block *)bh->b_data;
+
+	for (i = 0; i < sbi->max_subfiles; i++) {
+		if (dblock->files[i].inode == 0)
+			break;
+
+		child = ouichefs_iget(sb, dblock->files[i].inode, false);
+		if (IS_ERR(child)) {
+			pr_warn("Failed to load ino %u, leaking it\n",
+				dblock->files[i].inode);
+			continue;
+		}
+
+		if (S_ISDIR(child->i_mode)) {
+			if (ouichefs_reclaim_queue(sbi, child->i_ino))
+				pr_warn("Out of memory, leaking ino %lu\n",
+					child->i_ino);
+		} else {
+			inode_lock(child);
+			ouichefs_journal_start(sb, &handle);
+			ouichefs_release_inode(child);
+			ouichefs_journal_stop(&handle);
+			clear_nlink(child);
+			inode_unlock(child);
+		}
+		iput(child);
+	}
+	brelse(bh);
+
+	pr_debug("Reclaimed %d entries of ino %u\n", i, ino);
+	ouichefs_journal_start(sb, &handle);
+	ret = ouichefs_release_inode(inode);
+	ouichefs_journal_stop(&handle);
+	clear_nlink(inode);
+unlock:
+	inode_unlock(inode);
+	iput(inode);
+	return ret;
+}
+
+/*
+ * Reclaims one directory at a time, each step protected against freezing.
+ * Snapshot operations empty the list before freezing, and no subtree can be
+ * detached until they are done, so a step never works on inodes copied into
+ * a snapshot or revived by a restore.
+ */
+static void ouichefs_reclaim_work(struct work_struct *work)
+{
+	struct ouichefs_sb_info *sbi =
+		container_of(work, struct ouichefs_sb_info, reclaim_work);
+	struct super_block *sb = sbi->sb;
+	struct ouichefs_reclaim *entry;
+	int ret;
+
+	while (true) {
+		sb_start_write(sb);
+		spin_lock(&sbi->reclaim_lock);
+		entry = list_first_entry_or_null(&sbi->reclaim_list,
+						 struct ouichefs_reclaim, list);
+		if (entry)
+			list_del(&entry->list);
+		spin_unlock(&sbi->reclaim_lock);
+		if (!entry) {
+			sb_end_write(sb);
+			break;
+		}
+
+		ret = ouichefs_reclaim_dir(sb, entry->ino);
+		if (ret)
+			pr_warn("Failed to reclaim ino %u: %d\n",
+				entry->ino, ret);
+		sb_end_write(sb);
+		kfree(entry);
+		cond_resched();
+	}
+}
+
+void ouichefs_reclaim_init(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	sbi->sb = sb;
+	INIT_LIST_HEAD(&sbi->reclaim_list);
+	spin_lock_init(&sbi->reclaim_lock);
+	INIT_WORK(&sbi->reclaim_work, ouichefs_reclaim_work);
+	init_rwsem(&sbi->detach_rwsem);
+}
+
+/*
+ * Hands the detached directory ino to the reclaim worker.
+ */
+int ouichefs_reclaim_detached(struct super_block *sb, uint32_t ino)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	int ret;
+
+	ret = ouichefs_reclaim_queue(sbi, ino);
+	if (ret)
+		return ret;
+	queue_work(system_unbound_wq, &sbi->reclaim_work);
+	return 0;
+}
+
+/*
+ * Waits until all detached subtrees are reclaimed.
+ */
+void ouichefs_reclaim_flush(struct super_block *sb)
+{
+	flush_work(&OUICHEFS_SB(sb)->reclaim_work);
+}
+
+/*
+ * Detaches the subdirectory name of the directory opened as file with a
+ * single update of the parent directory block. The subtree below it is
+ * reclaimed asynchronously.
+ */
+int ouichefs_rmtree(struct file *file, const char *name)
+{
+	struct dentry *parent = file->f_path.dentry;
+	struct inode *dir = d_inode(parent);
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_reclaim *entry;
+	struct ouichefs_dir_stats usage;
+	struct ouichefs_handle handle;
+	struct dentry *dentry;
+	struct inode *inode;
+	int ret;
+
+	if (!S_ISDIR(dir->i_mode))
+		return -ENOTDIR;
+
+	entry = kmalloc(sizeof(*entry), GFP_KERNEL);
+	if (!entry)
+		return -ENOMEM;
+
+	/* Before mnt_want_write_file(), snapshots hold it across a freeze */
+	down_read(&sbi->detach_rwsem);
+	ret = mnt_want_write_file(file);
+	if (ret)
+		goto up;
+
+	inode_lock_nested(dir, I_MUTEX_PARENT);
+	dentry = lookup_one_len(name, parent, strlen(name));
+	if (IS_ERR(dentry)) {
+		ret = PTR_ERR(dentry);
+		goto unlock_dir;
+	}
+
+	inode = d_inode(dentry);
+	if (!inode) {
+		ret = -ENOENT;
+		goto put_dentry;
+	}
+	if (!S_ISDIR(inode->i_mode)) {
+		ret = -ENOTDIR;
+		goto put_dentry;
+	}
+	if (d_mountpoint(dentry)) {
+		ret = -EBUSY;
+		goto put_dentry;
+	}
+
+	/* Unlink from the parent, this is the only synchronous write */
+	entry->ino = inode->i_ino;
+	inode_lock(inode);
+	ouichefs_journal_start_credits(sb, &handle,
+				       ouichefs_dir_stats_credits(dentry));
+	ret = ouichefs_dir_remove_entry(dir, inode->i_ino, true);
+	if (ret) {
+		ouichefs_journal_stop(&handle);
+		inode_unlock(inode);
+		goto put_dentry;
+	}
+
+	/* Remove the whole subtree from the statistics above it */
+	ouichefs_inode_usage(inode, &usage);
+	usage.bytes = -usage.bytes;
+	usage.blocks = -usage.blocks;
+	usage.files = -usage.files;
+	ouichefs_dir_stats_propagate(dentry, &usage);
+	ouichefs_journal_stop(&handle);
+
+	/* Prevent new entries, then drop all cached dentries below */
+	inode->i_flags |= S_DEAD;
+	dont_mount(dentry);
+	inode_unlock(inode);
+	d_invalidate(dentry);
+	d_delete(dentry);
+
+	pr_debug("Detached ino %u from ino %lu\n", entry->ino, dir->i_ino);
+	spin_lock(&sbi->reclaim_lock);
+	list_add_tail(&entry->list, &sbi->reclaim_list);
+	spin_unlock(&sbi->reclaim_lock);
+	queue_work(system_unbound_wq, &sbi->reclaim_work);
+	entry = NULL;
+
+put_dentry:
+	dput(dentry);
+unlock_dir:
+	inode_unlock(dir);
+	mnt_drop_write_file(file);
+up:
+	up_read(&sbi->detach_rwsem);
+	kfree(entry);
+	return ret;
+}
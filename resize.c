@@ -0,0 +1,221 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/blkdev.h>
+#include <linux/bitmap.h>
+#include <linux/slab.h>
+
+#include "ouichefs.h"
+#include "bitmap.h"
+
+/*
+ * Online grow of ouiche_fs
+ *
+ * Growing only adds data blocks; the inode store and everything sized by the
+ * number of inodes keep the size chosen by mkfs. The refcounts of the new
+ * blocks need new metadata blocks, so this requires the group layout: each
+ * group added at the end of the partition brings its own metadata block.
+ * The block free bitmap cannot move, so it can only grow into the bitmap
+ * blocks reserved by mkfs -r.
+ *
+ * The file system is frozen during the grow. The new metadata blocks are
+ * zeroed before they become part of the partition, which then grows by one
+ * bitmap block per transaction. Each of them leaves a consistent partition.
+ */
+
+/*
+ * Returns the first block after old that can be used. The journal may sit
+ * at the end of the partition; groups starting inside it have no metadata
+ * block, so their blocks are never used.
+ */
+static uint32_t ouichefs_grow_first(struct ouichefs_sb_info *sbi,
+				    uint32_t old)
+{
+	uint32_t group = OUICHEFS_GET_GROUP_START(old, sbi);
+
+	if (sbi->nr_journal_blocks && group >= sbi->journal_start &&
+	    group < sbi->journal_start + sbi->nr_journal_blocks)
+		return group + sbi->group_blocks;
+	return old;
+}
+
+/* Returns the first group starting at or after bno */
+static u64 ouichefs_next_group(struct ouichefs_sb_info *sbi, uint32_t bno)
+{
+	u64 group = OUICHEFS_GET_GROUP_START(bno, sbi);
+
+	return group < bno ? group + sbi->group_blocks : group;
+}
+
+/*
+ * Zeroes the metadata blocks of the groups in [first, end). They are not
+ * part of the partition yet, so they are written outside of the journal and
+ * made durable before any transaction refers to them.
+ */
+static int ouichefs_grow_meta(struct super_block *sb, uint32_t first,
+			      uint32_t end)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct buffer_head *bh;
+	u64 group;
+
+	for (group = ouichefs_next_group(sbi, first); group < end;
+	     group += sbi->group_blocks) {
+		bh = sb_getblk(sb, group);
+		if (!bh)
+			return -ENOMEM;
+		lock_buffer(bh);
+		memset(bh->b_data, 0, sb->s_blocksize);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		brelse(bh);
+		cond_resched();
+	}
+	return sync_blockdev(sb->s_bdev);
+}
+
+/*
+ * Replaces the in-memory block free bitmap by one covering nr_blocks. Bits
+ * past the current end are cleared, i.e. used, until they are added.
+ */
+static int ouichefs_grow_bfree(struct super_block *sb, uint32_t nr_blocks)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	uint32_t old_len = OUICHEFS_GET_BFREE_USED(sbi);
+	uint32_t new_len = DIV_ROUND_UP(nr_blocks, sbi->bits_per_block);
+	unsigned long *bitmap, *dirty;
+
+	if (new_len == old_len)
+		return 0;
+
+	bitmap = kvzalloc((size_t)new_len << sb->s_blocksize_bits,
+			  GFP_KERNEL);
+	if (!bitmap)
+		return -ENOMEM;
+	dirty = bitmap_zalloc(new_len, GFP_KERNEL);
+	if (!dirty) {
+		kvfree(bitmap);
+		return -ENOMEM;
+	}
+
+	spin_lock(&sbi->bfree_lock);
+	memcpy(bitmap, sbi->bfree_bitmap,
+	       (size_t)old_len << sb->s_blocksize_bits);
+	bitmap_copy(dirty, sbi->bfree_dirty, old_len);
+	swap(sbi->bfree_bitmap, bitmap);
+	swap(sbi->bfree_dirty, dirty);
+	spin_unlock(&sbi->bfree_lock);
+
+	kvfree(bitmap);
+	bitmap_free(dirty);
+	return 0;
+}
+
+/*
+ * Adds blocks [start, end) to the partition, all of them covered by the same
+ * bitmap block. Blocks before first stay used.
+ */
+static void ouichefs_grow_range(struct super_block *sb, uint32_t first,
+				uint32_t start, uint32_t end)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_handle handle;
+	uint32_t from = max(start, first);
+	uint32_t nr_free = 0, nr_groups = 0;
+	u64 group;
+
+	ouichefs_journal_start(sb, &handle);
+	spin_lock(&sbi->bfree_lock);
+	bitmap_clear(sbi->bfree_bitmap, start, end - start);
+	if (from < end) {
+		bitmap_set(sbi->bfree_bitmap, from, end - from);
+		nr_free = end - from;
+		for (group = ouichefs_next_group(sbi, from); group < end;
+		     group += sbi->group_blocks) {
+			__clear_bit(group, sbi->bfree_bitmap);
+			nr_groups++;
+		}
+	}
+	sbi->nr_free_blocks += nr_free - nr_groups;
+	sbi->nr_meta_blocks += nr_groups;
+	sbi->nr_blocks = end;
+	spin_unlock(&sbi->bfree_lock);
+	mark_bitmap_dirty(sbi, sbi->bfree_dirty, OUICHEFS_GET_BFREE_START(sbi),
+			  start);
+	ouichefs_journal_stop(&handle);
+}
+
+/*
+ * Grows the partition to nr_blocks blocks without remounting it.
+ */
+int ouichefs_grow(struct super_block *sb, uint32_t nr_blocks)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	uint32_t old, first, start, end;
+	int ret;
+
+	if (sbi->layout != OUICHEFS_LAYOUT_GROUPS) {
+		pr_warn("Growing requires the group layout\n");
+		return -EOPNOTSUPP;
+	}
+	if (nr_blocks > bdev_nr_bytes(sb->s_bdev) >> sb->s_blocksize_bits)
+		return -EINVAL;
+	if (nr_blocks > (u64)sbi->nr_bfree_blocks * sbi->bits_per_block) {
+		pr_warn("Block free bitmap only covers %llu blocks, reserve more with mkfs -r\n",
+			(u64)sbi->nr_bfree_blocks * sbi->bits_per_block);
+		return -ENOSPC;
+	}
+
+	/* Sync all dirty data and prevent changes to this file system */
+	ret = freeze_super(sb);
+	if (ret) {
+		pr_err("file system freeze failed\n");
+		return ret;
+	}
+	/* Keep sync and remount away while the bitmap is replaced */
+	down_write(&sb->s_umount);
+
+	old = sbi->nr_blocks;
+	if (sb_rdonly(sb)) {
+		ret = -EROFS;
+		goto unlock;
+	}
+	if (nr_blocks <= old) {
+		ret = nr_blocks == old ? 0 : -EINVAL;
+		goto unlock;
+	}
+
+	first = ouichefs_grow_first(sbi, old);
+	ret = ouichefs_grow_meta(sb, first, nr_blocks);
+	if (ret)
+		goto unlock;
+	ret = ouichefs_grow_bfree(sb, nr_blocks);
+	if (ret)
+		goto unlock;
+
+	for (start = old; start < nr_blocks; start = end) {
+		end = min_t(u64, nr_blocks,
+			    round_down((u64)start, sbi->bits_per_block) +
+				    sbi->bits_per_block);
+		ouichefs_grow_range(sb, first, start, end);
+		cond_resched();
+	}
+	ret = sync_filesystem(sb);
+	pr_info("Grew from %u to %u blocks (%u free)\n", old, sbi->nr_blocks,
+		sbi->nr_free_blocks);
+
+unlock:
+	up_write(&sb->s_umount);
+	if (thaw_super(sb))
+		pr_err("File system unfreeze failed\n");
+	return ret;
+}
@@ -0,0 +1,55 @@
+# Helpers shared by the benchmarks of scripts/bench, sourced by them.
+# Environment: MKFS (mkfs.ouichefs), IMG, IMGSIZE (MiB), MNT
+
+bench=$(dirname "$(readlink -f "$0")")
+
+MKFS=${MKFS:-$bench/../../mkfs/mkfs.ouichefs}
+IMG=${IMG:-/tmp/ouichefs-bench.img}
+IMGSIZE=${IMGSIZE:-512}
+MNT=${MNT:-/tmp/ouichefs-bench}
+
+exit_fail() {
+	echo "$(basename "$0"): $1" >&2
+	exit 1
+}
+
+# Checks that the module is loaded and that mkfs and the tools $@ exist
+check_env() {
+	for tool in "$@"; do
+		command -v "$tool" > /dev/null || exit_fail "$tool not found"
+	done
+	[ -x "$MKFS" ] || exit_fail "$MKFS not found, build it in mkfs/"
+	grep -qw ouichefs /proc/filesystems || exit_fail "ouichefs is not loaded"
+	mkdir -p "$MNT"
+}
+
+# Formats a fresh image with the mkfs options $@ and mounts it on $MNT;
+# $sysfs is then the sysfs directory of the partition
+setup() {
+	rm -f "$IMG"
+	dd if=/dev/zero of="$IMG" bs=1M count="$IMGSIZE" status=none
+	"$MKFS" "$@" "$IMG" > /dev/null
+	mount -t ouichefs -o loop "$IMG" "$MNT"
+	sysfs=/sys/fs/ouichefs/$(basename "$(findmnt -no SOURCE "$MNT")")
+}
+
+teardown() {
+	umount "$MNT"
+	rm -f "$IMG"
+}
+
+drop_caches() {
+	sync
+	echo 3 > /proc/sys/vm/drop_caches
+}
+
+# Prints the counters of $sysfs/stats/ as a JSON object
+ouichefs_stats() {
+	local stats="{}" f
+
+	for f in "$sysfs"/stats/*; do
+		stats=$(jq --arg k "$(basename "$f")" --argjson v "$(cat "$f")" \
+			'. + {($k): $v}' <<< "$stats")
+	done
+	echo "$stats"
+}
@@ -0,0 +1,404 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * mdbench - metadata benchmark for ouiche_fs, in the spirit of mdtest
+ *
+ * Each thread works in its own directory, dir/t<thread>, with d<n>
+ * subdirectories of files f<n>. A directory holds at most 128 entries with
+ * 4 KiB blocks, so the files are spread over many directories. The phases
+ * run in the order given, all threads start each phase together and the
+ * latency of every operation is recorded.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+struct worker {
+	pthread_t thread;
+	unsigned int id;
+	uint64_t *lat; /* Latency of each operation of a phase, in ns */
+	uint64_t nr_ops;
+	uint64_t nr_errors;
+	uint64_t start, end; /* Time of the phase in this thread */
+};
+
+struct phase {
+	char code;
+	const char *name;
+	bool per_dir; /* One operation per directory instead of per file */
+	int (*op)(const char *path, const char *new_path);
+};
+
+static const char *root;
+static unsigned int nr_threads = 4;
+static unsigned int nr_dirs = 16;
+static unsigned int nr_files = 64;
+static bool drop_caches;
+static bool json;
+
+static pthread_barrier_t barrier;
+static const struct phase *cur_phase;
+static char prefix = 'f'; /* Name prefix of the files, r once renamed */
+
+static int op_mkdir(const char *path, const char *new_path)
+{
+	return mkdir(path, 0755);
+}
+
+static int op_create(const char *path, const char *new_path)
+{
+	int fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+
+	if (fd < 0)
+		return -1;
+	return close(fd);
+}
+
+static int op_stat(const char *path, const char *new_path)
+{
+	struct stat st;
+
+	return stat(path, &st);
+}
+
+static int op_rename(const char *path, const char *new_path)
+{
+	return rename(path, new_path);
+}
+
+static int op_unlink(const char *path, const char *new_path)
+{
+	return unlink(path);
+}
+
+static int op_rmdir(const char *path, const char *new_path)
+{
+	return rmdir(path);
+}
+
+static const struct phase phases[] = {
+	{ 'm', "mkdir", true, op_mkdir },
+	{ 'c', "create", false, op_create },
+	{ 's', "stat", false, op_stat },
+	{ 'r', "rename", false, op_rename },
+	{ 'u', "unlink", false, op_unlink },
+	{ 'd', "rmdir", true, op_rmdir },
+};
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void run_op(struct worker *w, const char *path, const char *new_path)
+{
+	uint64_t start = now_ns();
+
+	if (cur_phase->op(path, new_path)) {
+		if (!w->nr_errors++)
+			fprintf(stderr, "%s %s: %s\n", cur_phase->name, path,
+				strerror(errno));
+		return;
+	}
+	w->lat[w->nr_ops++] = now_ns() - start;
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	char path[4096], new_path[4096];
+	unsigned int d, f;
+
+	for (;;) {
+		/* Wait for the next phase, NULL once all are done */
+		pthread_barrier_wait(&barrier);
+		if (!cur_phase)
+			break;
+		w->nr_ops = 0;
+		w->nr_errors = 0;
+		w->start = now_ns();
+		for (d = 0; d < nr_dirs; d++) {
+			if (cur_phase->per_dir) {
+				snprintf(path, sizeof(path), "%s/t%u/d%u",
+					 root, w->id, d);
+				run_op(w, path, NULL);
+				continue;
+			}
+			for (f = 0; f < nr_files; f++) {
+				snprintf(path, sizeof(path), "%s/t%u/d%u/%c%u",
+					 root, w->id, d, prefix, f);
+				snprintf(new_path, sizeof(new_path),
+					 "%s/t%u/d%u/r%u", root, w->id, d, f);
+				run_op(w, path, new_path);
+			}
+		}
+		w->end = now_ns();
+		pthread_barrier_wait(&barrier);
+	}
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Upper value of the permille lowest latencies of a sorted array */
+static uint64_t percentile(const uint64_t *lat, uint64_t n,
+			   unsigned int permille)
+{
+	if (!n)
+		return 0;
+	return lat[(n - 1) * permille / 1000];
+}
+
+static void report(const struct phase *p, struct worker *workers,
+		   uint64_t *all, bool first)
+{
+	uint64_t n = 0, errors = 0, start = UINT64_MAX, end = 0, elapsed;
+	double ops_per_sec;
+	unsigned int i;
+
+	for (i = 0; i < nr_threads; i++) {
+		memcpy(all + n, workers[i].lat,
+		       workers[i].nr_ops * sizeof(*all));
+		n += workers[i].nr_ops;
+		errors += workers[i].nr_errors;
+		if (workers[i].start < start)
+			start = workers[i].start;
+		if (workers[i].end > end)
+			end = workers[i].end;
+	}
+	elapsed = end - start;
+	qsort(all, n, sizeof(*all), cmp_u64);
+	ops_per_sec = elapsed ? n * 1e9 / elapsed : 0;
+
+	if (json) {
+		printf("%s\n    {\"phase\": \"%s\", \"ops\": %" PRIu64 ", "
+		       "\"errors\": %" PRIu64 ", \"seconds\": %.6f, "
+		       "\"ops_per_sec\": %.1f, \"lat_ns\": {"
+		       "\"p50\": %" PRIu64 ", \"p99\": %" PRIu64 ", "
+		       "\"p999\": %" PRIu64 ", \"max\": %" PRIu64 "}}",
+		       first ? "" : ",", p->name, n, errors, elapsed / 1e9,
+		       ops_per_sec, percentile(all, n, 500),
+		       percentile(all, n, 990), percentile(all, n, 999),
+		       n ? all[n - 1] : 0);
+		return;
+	}
+	printf("%-8s %9" PRIu64 " %7" PRIu64 " %11.1f %9.1f %9.1f %9.1f %9.1f\n",
+	       p->name, n, errors, ops_per_sec, percentile(all, n, 500) / 1e3,
+	       percentile(all, n, 990) / 1e3, percentile(all, n, 999) / 1e3,
+	       n ? all[n - 1] / 1e3 : 0);
+}
+
+/*
+ * Files are named f<n>, and r<n> once renamed. A run may continue where an
+ * earlier one stopped, e.g. -P u after -P mcsr, so the names are taken from
+ * what is on disk.
+ */
+static void detect_prefix(void)
+{
+	char path[4096];
+	struct stat st;
+
+	snprintf(path, sizeof(path), "%s/t0/d0/r0", root);
+	if (!stat(path, &st))
+		prefix = 'r';
+}
+
+/* Writes back and drops the dentry, inode and page caches (root only) */
+static void do_drop_caches(void)
+{
+	int fd;
+
+	sync();
+	fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+	if (fd < 0 || write(fd, "3", 1) != 1)
+		perror("drop_caches");
+	if (fd >= 0)
+		close(fd);
+}
+
+static inline void usage(char *appname)
+{
+	fprintf(stderr,
+		"Usage:\n"
+		"%s [-t threads] [-d dirs] [-f files] [-P phases] [-c] [-j] dir\n"
+		"\t-t: number of threads (default: %u)\n"
+		"\t-d: directories per thread (default: %u)\n"
+		"\t-f: files per directory (default: %u)\n"
+		"\t-P: phases to run in order (default: mcsrud)\n"
+		"\t    m: mkdir, c: create, s: stat, r: rename, u: unlink,\n"
+		"\t    d: rmdir. Phases may continue an earlier run, the files\n"
+		"\t    renamed by it are found\n"
+		"\t-c: drop the caches before each phase, so that stat, rename\n"
+		"\t    and unlink look the files up on disk (requires root)\n"
+		"\t-j: print the results in JSON\n",
+		appname, nr_threads, nr_dirs, nr_files);
+}
+
+static bool parse_uint(const char *s, unsigned int *val)
+{
+	char *end;
+	unsigned long v = strtoul(s, &end, 10);
+
+	if (*end != '\0' || !v || v > 1000000)
+		return false;
+	*val = v;
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	const char *order = "mcsrud";
+	struct worker *workers = NULL;
+	uint64_t *all = NULL, nr_errors = 0;
+	char path[4096];
+	const struct phase *p;
+	bool first = true;
+	unsigned int i, nr_phases = sizeof(phases) / sizeof(phases[0]);
+	int opt, ret = EXIT_FAILURE;
+
+	while ((opt = getopt(argc, argv, "t:d:f:P:cj")) != -1) {
+		switch (opt) {
+		case 't':
+			if (!parse_uint(optarg, &nr_threads)) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'd':
+			if (!parse_uint(optarg, &nr_dirs)) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'f':
+			if (!parse_uint(optarg, &nr_files)) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'P':
+			order = optarg;
+			break;
+		case 'c':
+			drop_caches = true;
+			break;
+		case 'j':
+			json = true;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	root = argv[optind];
+
+	workers = calloc(nr_threads, sizeof(*workers));
+	all = malloc((size_t)nr_threads * nr_dirs * nr_files * sizeof(*all));
+	if (!workers || !all) {
+		perror("malloc");
+		goto out;
+	}
+	pthread_barrier_init(&barrier, NULL, nr_threads + 1);
+
+	/* The thread directories are created and removed outside of phases */
+	for (i = 0; i < nr_threads; i++) {
+		snprintf(path, sizeof(path), "%s/t%u", root, i);
+		if (mkdir(path, 0755) && errno != EEXIST) {
+			perror(path);
+			goto out;
+		}
+		workers[i].id = i;
+		workers[i].lat = malloc((size_t)nr_dirs * nr_files *
+					sizeof(uint64_t));
+		if (!workers[i].lat) {
+			perror("malloc");
+			goto out;
+		}
+	}
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&workers[i].thread, NULL, worker_fn,
+				   &workers[i])) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (json)
+		printf("{\n  \"threads\": %u, \"dirs\": %u, \"files\": %u,\n"
+		       "  \"phases\": [", nr_threads, nr_dirs, nr_files);
+	else
+		printf("%-8s %9s %7s %11s %9s %9s %9s %9s\n", "phase", "ops",
+		       "errors", "ops/s", "p50 us", "p99 us", "p99.9 us",
+		       "max us");
+
+	detect_prefix();
+	for (; *order; order++) {
+		for (p = NULL, i = 0; i < nr_phases; i++) {
+			if (phases[i].code == *order)
+				p = &phases[i];
+		}
+		if (!p) {
+			fprintf(stderr, "unknown phase %c\n", *order);
+			break;
+		}
+		if (p->code == 'c')
+			prefix = 'f';
+		if (drop_caches)
+			do_drop_caches();
+
+		cur_phase = p;
+		pthread_barrier_wait(&barrier);
+		pthread_barrier_wait(&barrier);
+		report(p, workers, all, first);
+		first = false;
+
+		if (p->code == 'r')
+			prefix = 'r';
+		for (i = 0; i < nr_threads; i++)
+			nr_errors += workers[i].nr_errors;
+	}
+
+	cur_phase = NULL;
+	pthread_barrier_wait(&barrier);
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(workers[i].thread, NULL);
+	if (json)
+		printf("\n  ]\n}\n");
+
+	for (i = 0; i < nr_threads; i++) {
+		snprintf(path, sizeof(path), "%s/t%u", root, i);
+		rmdir(path);
+	}
+	if (!*order && !nr_errors)
+		ret = EXIT_SUCCESS;
+out:
+	if (workers) {
+		for (i = 0; i < nr_threads; i++)
+			free(workers[i].lat);
+	}
+	free(workers);
+	free(all);
+	return ret;
+}
@@ -0,0 +1,491 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * reflinkbench - benchmark of the clone paths of ouiche_fs
+ *
+ * All phases work on dir/src, a 4 MiB file (the largest possible with 4 KiB
+ * blocks) created on first use, and on N files of a subdirectory per phase:
+ *   clone:      FICLONE of src into new files of dir/clone
+ *   clonerange: FICLONERANGE of a range of src into new files of dir/range,
+ *               with the offset in src moving along the files
+ *   dedup:      FIDEDUPERANGE of src onto copies of it in dir/dedup
+ *   overwrite:  first and second 4 KiB overwrite of each clone of dir/clone
+ *   read:       sequential read of all the clones of dir/clone
+ * Each phase prints one line of JSON.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#define FILE_SIZE (4 << 20)
+#define FS_BLOCK_SIZE 4096
+
+static const char *root;
+static unsigned int nr_files = 100;
+static unsigned long range_len = 1 << 20;
+static bool drop_caches;
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Sorts lat and prints its p50, p99 and maximum as a JSON object */
+static void print_lat(const char *name, uint64_t *lat, unsigned int n)
+{
+	qsort(lat, n, sizeof(*lat), cmp_u64);
+	printf(", \"%s\": {\"p50\": %" PRIu64 ", \"p99\": %" PRIu64
+	       ", \"max\": %" PRIu64 "}", name,
+	       n ? lat[(n - 1) * 500 / 1000] : 0,
+	       n ? lat[(n - 1) * 990 / 1000] : 0, n ? lat[n - 1] : 0);
+}
+
+static void print_result(const char *phase, unsigned int ops, uint64_t bytes,
+			 uint64_t elapsed)
+{
+	printf("{\"phase\": \"%s\", \"ops\": %u, \"bytes\": %" PRIu64
+	       ", \"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+	       "\"mib_per_sec\": %.1f", phase, ops, bytes, elapsed / 1e9,
+	       elapsed ? ops * 1e9 / elapsed : 0,
+	       elapsed ? bytes * 1e9 / elapsed / (1 << 20) : 0);
+}
+
+/* Writes back and drops the dentry, inode and page caches (root only) */
+static void do_drop_caches(void)
+{
+	int fd;
+
+	sync();
+	fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+	if (fd < 0 || write(fd, "3", 1) != 1)
+		perror("drop_caches");
+	if (fd >= 0)
+		close(fd);
+}
+
+/* Returns the size of the page cache in KiB, from /proc/meminfo */
+static long cached_kib(void)
+{
+	char line[256];
+	long kib = -1;
+	FILE *f = fopen("/proc/meminfo", "r");
+
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "Cached: %ld kB", &kib) == 1)
+			break;
+	}
+	fclose(f);
+	return kib;
+}
+
+static int open_file(const char *dir, unsigned int i, int flags)
+{
+	char path[4096];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s/%u", root, dir, i);
+	fd = open(path, flags, 0644);
+	if (fd < 0)
+		perror(path);
+	return fd;
+}
+
+static int make_dir(const char *dir)
+{
+	char path[4096];
+
+	snprintf(path, sizeof(path), "%s/%s", root, dir);
+	if (mkdir(path, 0755) && errno != EEXIST) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+/* Fills fd with the content of buf and syncs it */
+static int write_file(int fd, const char *buf)
+{
+	if (pwrite(fd, buf, FILE_SIZE, 0) != FILE_SIZE || fsync(fd)) {
+		perror("write");
+		return -1;
+	}
+	return 0;
+}
+
+/* Opens dir/src, creating it with random content if needed */
+static int open_src(char *buf)
+{
+	char path[4096];
+	int fd, rnd;
+
+	snprintf(path, sizeof(path), "%s/src", root);
+	fd = open(path, O_RDWR);
+	if (fd >= 0) {
+		if (pread(fd, buf, FILE_SIZE, 0) == FILE_SIZE)
+			return fd;
+		close(fd);
+	}
+
+	rnd = open("/dev/urandom", O_RDONLY);
+	if (rnd < 0 || read(rnd, buf, FILE_SIZE) != FILE_SIZE) {
+		perror("/dev/urandom");
+		return -1;
+	}
+	close(rnd);
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+	if (write_file(fd, buf)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int phase_clone(int src, const char *buf)
+{
+	uint64_t *lat, start, begin;
+	unsigned int i;
+	int fd, ret = -1;
+
+	lat = calloc(nr_files, sizeof(*lat));
+	if (!lat || make_dir("clone"))
+		goto out;
+	begin = now_ns();
+	for (i = 0; i < nr_files; i++) {
+		start = now_ns();
+		fd = open_file("clone", i, O_WRONLY | O_CREAT | O_TRUNC);
+		if (fd < 0)
+			goto out;
+		if (ioctl(fd, FICLONE, src)) {
+			perror("FICLONE");
+			close(fd);
+			goto out;
+		}
+		close(fd);
+		lat[i] = now_ns() - start;
+	}
+	print_result("clone", nr_files, (uint64_t)nr_files * FILE_SIZE,
+		     now_ns() - begin);
+	print_lat("lat_ns", lat, nr_files);
+	printf("}\n");
+	ret = 0;
+out:
+	free(lat);
+	return ret;
+}
+
+static int phase_clonerange(int src, const char *buf)
+{
+	struct file_clone_range range;
+	uint64_t *lat, start, begin;
+	unsigned int i;
+	int fd, ret = -1;
+
+	lat = calloc(nr_files, sizeof(*lat));
+	if (!lat || make_dir("range"))
+		goto out;
+	begin = now_ns();
+	for (i = 0; i < nr_files; i++) {
+		start = now_ns();
+		fd = open_file("range", i, O_WRONLY | O_CREAT | O_TRUNC);
+		if (fd < 0)
+			goto out;
+		range.src_fd = src;
+		/* Spread the ranges over the source, all within its size */
+		range.src_offset = (uint64_t)i * range_len %
+				   (FILE_SIZE - range_len + 1);
+		range.src_offset -= range.src_offset % FS_BLOCK_SIZE;
+		range.src_length = range_len;
+		range.dest_offset = 0;
+		if (ioctl(fd, FICLONERANGE, &range)) {
+			perror("FICLONERANGE");
+			close(fd);
+			goto out;
+		}
+		close(fd);
+		lat[i] = now_ns() - start;
+	}
+	print_result("clonerange", nr_files, (uint64_t)nr_files * range_len,
+		     now_ns() - begin);
+	print_lat("lat_ns", lat, nr_files);
+	printf("}\n");
+	ret = 0;
+out:
+	free(lat);
+	return ret;
+}
+
+static int phase_dedup(int src, const char *buf)
+{
+	struct file_dedupe_range *range;
+	uint64_t *lat, start, begin, bytes = 0;
+	unsigned int i;
+	int *fds, ret = -1;
+
+	lat = calloc(nr_files, sizeof(*lat));
+	fds = malloc(nr_files * sizeof(*fds));
+	if (fds)
+		memset(fds, -1, nr_files * sizeof(*fds));
+	range = calloc(1, sizeof(*range) + sizeof(range->info[0]));
+	if (!lat || !fds || !range || make_dir("dedup"))
+		goto out;
+
+	/* The copies are written beforehand, outside of the measure */
+	for (i = 0; i < nr_files; i++) {
+		fds[i] = open_file("dedup", i, O_RDWR | O_CREAT | O_TRUNC);
+		if (fds[i] < 0 || write_file(fds[i], buf))
+			goto out;
+	}
+	if (drop_caches)
+		do_drop_caches();
+
+	begin = now_ns();
+	for (i = 0; i < nr_files; i++) {
+		memset(range, 0, sizeof(*range) + sizeof(range->info[0]));
+		range->src_length = FILE_SIZE;
+		range->dest_count = 1;
+		range->info[0].dest_fd = fds[i];
+		start = now_ns();
+		if (ioctl(src, FIDEDUPERANGE, range)) {
+			perror("FIDEDUPERANGE");
+			goto out;
+		}
+		lat[i] = now_ns() - start;
+		if (range->info[0].status != FILE_DEDUPE_RANGE_SAME) {
+			fprintf(stderr, "FIDEDUPERANGE: status %d\n",
+				range->info[0].status);
+			goto out;
+		}
+		bytes += range->info[0].bytes_deduped;
+	}
+	print_result("dedup", nr_files, bytes, now_ns() - begin);
+	print_lat("lat_ns", lat, nr_files);
+	printf("}\n");
+	ret = 0;
+out:
+	for (i = 0; fds && i < nr_files; i++) {
+		if (fds[i] >= 0)
+			close(fds[i]);
+	}
+	free(range);
+	free(fds);
+	free(lat);
+	return ret;
+}
+
+/*
+ * The first overwrite of a clone copies its index block and the data block,
+ * the second one only the data block.
+ */
+static int phase_overwrite(int src, const char *buf)
+{
+	uint64_t *lat, start, begin;
+	unsigned int i, pass;
+	off_t off;
+	int fd, ret = -1;
+
+	lat = calloc(4 * (size_t)nr_files, sizeof(*lat));
+	if (!lat)
+		goto out;
+	if (drop_caches)
+		do_drop_caches();
+
+	begin = now_ns();
+	for (i = 0; i < nr_files; i++) {
+		fd = open_file("clone", i, O_WRONLY);
+		if (fd < 0)
+			goto out;
+		for (pass = 0; pass < 2; pass++) {
+			off = (off_t)pass * FS_BLOCK_SIZE;
+			start = now_ns();
+			if (pwrite(fd, buf, FS_BLOCK_SIZE, off) !=
+			    FS_BLOCK_SIZE) {
+				perror("pwrite");
+				close(fd);
+				goto out;
+			}
+			lat[2 * pass * nr_files + i] = now_ns() - start;
+			start = now_ns();
+			if (fsync(fd)) {
+				perror("fsync");
+				close(fd);
+				goto out;
+			}
+			lat[(2 * pass + 1) * nr_files + i] = now_ns() - start;
+		}
+		close(fd);
+	}
+	print_result("overwrite", 2 * nr_files,
+		     2 * (uint64_t)nr_files * FS_BLOCK_SIZE, now_ns() - begin);
+	print_lat("first_write_ns", lat, nr_files);
+	print_lat("first_fsync_ns", lat + nr_files, nr_files);
+	print_lat("second_write_ns", lat + 2 * nr_files, nr_files);
+	print_lat("second_fsync_ns", lat + 3 * nr_files, nr_files);
+	printf("}\n");
+	ret = 0;
+out:
+	free(lat);
+	return ret;
+}
+
+/*
+ * Clones share their blocks on disk but not in the page cache, so reading
+ * them costs as much memory as reading copies.
+ */
+static int phase_read(int src, const char *buf)
+{
+	uint64_t begin, bytes = 0;
+	long cached;
+	unsigned int i;
+	char *rbuf;
+	ssize_t len;
+	int fd, ret = -1;
+
+	rbuf = malloc(1 << 20);
+	if (!rbuf)
+		return -1;
+	if (drop_caches)
+		do_drop_caches();
+
+	cached = cached_kib();
+	begin = now_ns();
+	for (i = 0; i < nr_files; i++) {
+		fd = open_file("clone", i, O_RDONLY);
+		if (fd < 0)
+			goto out;
+		while ((len = read(fd, rbuf, 1 << 20)) > 0)
+			bytes += len;
+		close(fd);
+		if (len < 0) {
+			perror("read");
+			goto out;
+		}
+	}
+	print_result("read", nr_files, bytes, now_ns() - begin);
+	printf(", \"cached_kib\": %ld}\n", cached_kib() - cached);
+	ret = 0;
+out:
+	free(rbuf);
+	return ret;
+}
+
+static const struct {
+	const char *name;
+	int (*run)(int src, const char *buf);
+} phases[] = {
+	{ "clone", phase_clone },
+	{ "clonerange", phase_clonerange },
+	{ "dedup", phase_dedup },
+	{ "overwrite", phase_overwrite },
+	{ "read", phase_read },
+};
+
+static inline void usage(char *appname)
+{
+	fprintf(stderr,
+		"Usage:\n"
+		"%s [-n files] [-r range] [-c] dir phase...\n"
+		"\t-n: number of files per phase (default: %u)\n"
+		"\t-r: bytes cloned by clonerange, a multiple of the block\n"
+		"\t    size (default: %lu)\n"
+		"\t-c: drop the caches before dedup, overwrite and read\n"
+		"\t    (requires root)\n"
+		"\tphase: clone, clonerange, dedup, overwrite (after clone) or\n"
+		"\t       read (after clone)\n",
+		appname, nr_files, range_len);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int i, nr_phases = sizeof(phases) / sizeof(phases[0]);
+	char *buf, *end;
+	int opt, src, p, ret = EXIT_FAILURE;
+
+	while ((opt = getopt(argc, argv, "n:r:c")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_files = strtoul(optarg, &end, 10);
+			if (*end != '\0' || !nr_files) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'r':
+			range_len = strtoul(optarg, &end, 10);
+			if (*end != '\0' || !range_len ||
+			    range_len % FS_BLOCK_SIZE ||
+			    range_len > FILE_SIZE) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'c':
+			drop_caches = true;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind > argc - 2) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	root = argv[optind];
+
+	buf = malloc(FILE_SIZE);
+	if (!buf) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+	src = open_src(buf);
+	if (src < 0)
+		goto free_buf;
+
+	for (p = optind + 1; p < argc; p++) {
+		for (i = 0; i < nr_phases; i++) {
+			if (!strcmp(argv[p], phases[i].name))
+				break;
+		}
+		if (i == nr_phases) {
+			usage(argv[0]);
+			goto close_src;
+		}
+		if (phases[i].run(src, buf))
+			goto close_src;
+		fflush(stdout);
+	}
+	ret = EXIT_SUCCESS;
+
+close_src:
+	close(src);
+free_buf:
+	free(buf);
+	return ret;
+}
@@ -0,0 +1,185 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * snapbench - times one snapshot operation of ouiche_fs
+ *
+ * The operation is the write of a snapshot id to one of the create, destroy
+ * or restore files of /sys/fs/ouichefs/<dev>/. Meanwhile, a writer thread
+ * overwrites a file 4 KiB at a time, so that the time writers are held up
+ * by the operation (e.g. while the file system is frozen) is measured too.
+ * The result is printed as one line of JSON.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define WRITER_FILE_SIZE (4 << 20)
+#define WRITER_BLOCK_SIZE 4096
+
+/* A write is stalled if it takes longer than this */
+#define STALL_NS 1000000ULL
+
+static int writer_fd = -1;
+static atomic_bool stop;
+static atomic_uint_fast64_t op_start, op_end;
+
+/* Written by the writer only, read once it is joined */
+static uint64_t nr_writes, stall_max, stall_total, nr_stalls;
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Overwrites the file until stopped, and accounts the writes that overlap
+ * with the operation.
+ */
+static void *writer_fn(void *arg)
+{
+	char buf[WRITER_BLOCK_SIZE];
+	uint64_t start, end, lat, begin;
+	off_t off = 0;
+
+	memset(buf, 0x5a, sizeof(buf));
+	while (!atomic_load(&stop)) {
+		start = now_ns();
+		if (pwrite(writer_fd, buf, sizeof(buf), off) < 0) {
+			perror("pwrite");
+			break;
+		}
+		end = now_ns();
+		off = (off + WRITER_BLOCK_SIZE) % WRITER_FILE_SIZE;
+
+		begin = atomic_load(&op_start);
+		if (!begin || end < begin)
+			continue;
+		if (atomic_load(&op_end) && start > atomic_load(&op_end))
+			continue;
+		lat = end - start;
+		nr_writes++;
+		if (lat > stall_max)
+			stall_max = lat;
+		if (lat > STALL_NS) {
+			stall_total += lat;
+			nr_stalls++;
+		}
+	}
+	return NULL;
+}
+
+static inline void usage(char *appname)
+{
+	fprintf(stderr,
+		"Usage:\n"
+		"%s [-w file] sysfs_file id\n"
+		"\t-w: file overwritten during the operation, to measure how\n"
+		"\t    long writers stall (created if needed)\n"
+		"\tsysfs_file: /sys/fs/ouichefs/<dev>/{create,destroy,restore}\n",
+		appname);
+}
+
+static bool parse_id(const char *s, unsigned int *id)
+{
+	char *end;
+	unsigned long v = strtoul(s, &end, 10);
+
+	if (*end != '\0' || v > UINT32_MAX)
+		return false;
+	*id = v;
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	const char *writer_path = NULL;
+	pthread_t writer;
+	char id[16], *op;
+	unsigned int snap_id;
+	uint64_t elapsed;
+	int opt, fd, len, ret = EXIT_FAILURE;
+
+	while ((opt = getopt(argc, argv, "w:")) != -1) {
+		switch (opt) {
+		case 'w':
+			writer_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 2) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	op = basename(strdup(argv[optind]));
+	if (!parse_id(argv[optind + 1], &snap_id)) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	len = snprintf(id, sizeof(id), "%u", snap_id);
+
+	fd = open(argv[optind], O_WRONLY);
+	if (fd < 0) {
+		perror(argv[optind]);
+		return EXIT_FAILURE;
+	}
+	if (writer_path) {
+		writer_fd = open(writer_path, O_WRONLY | O_CREAT, 0644);
+		if (writer_fd < 0) {
+			perror(writer_path);
+			goto close_fd;
+		}
+		if (pthread_create(&writer, NULL, writer_fn, NULL)) {
+			perror("pthread_create");
+			goto close_writer;
+		}
+		/* Let the writer reach a steady state */
+		usleep(100000);
+	}
+
+	atomic_store(&op_start, now_ns());
+	if (write(fd, id, len) != len) {
+		fprintf(stderr, "%s %s: %s\n", op, id, strerror(errno));
+		ret = EXIT_FAILURE;
+	} else {
+		ret = EXIT_SUCCESS;
+	}
+	atomic_store(&op_end, now_ns());
+	elapsed = atomic_load(&op_end) - atomic_load(&op_start);
+
+	if (writer_path) {
+		/* Account the writes held up until the very end */
+		usleep(10000);
+		atomic_store(&stop, true);
+		pthread_join(writer, NULL);
+	}
+	if (ret == EXIT_SUCCESS)
+		printf("{\"op\": \"%s\", \"id\": %u, \"ns\": %" PRIu64 ", "
+		       "\"writes\": %" PRIu64 ", \"stalls\": %" PRIu64 ", "
+		       "\"stall_ns\": %" PRIu64 ", \"stall_max_ns\": %" PRIu64
+		       "}\n", op, snap_id, elapsed, nr_writes, nr_stalls,
+		       stall_total, stall_max);
+
+close_writer:
+	if (writer_fd >= 0)
+		close(writer_fd);
+close_fd:
+	close(fd);
+	return ret;
+}
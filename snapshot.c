@@ -15,6 +15,13 @@
 #include <linux/fs.h>
 
 #include "ouichefs.h"
+#include "ouichefs_trace.h"
+
+/*
+ * Blocks one inode may add to a snapshot transaction: its inode store block
+ * and the blocks touched by linking or putting its inode data
+ */
+#define OUICHEFS_SNAP_INODE_CREDITS 8
 
 static int copy_all_disk_inodes(struct super_block *sb,
 				uint8_t from_index, uint8_t to_index)
@@ -22,48 +29,55 @@ static int copy_all_disk_inodes(struct super_block *sb,
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct buffer_head *bh = NULL;
 	struct ouichefs_inode *disk_ino;
+	struct ouichefs_handle handle;
 	uint32_t ino, last_ino_block = 0;
 	bool dirty = false;
 
 	/* Copy inodes on disk only, since we do not have a full list in memory */
+	ouichefs_journal_start(sb, &handle);
 	for_each_clear_bit(ino, sbi->ifree_bitmap, sbi->nr_inodes) {
 		pr_debug("Copying ino %u\n", ino);
 		/* Reuse buffer head between ino's if they are in the same block */
-		if (OUICHEFS_GET_INODE_BLOCK(ino) != last_ino_block) {
+		if (OUICHEFS_GET_INODE_BLOCK(sbi, ino) != last_ino_block) {
 			if (likely(bh)) {
 				if (dirty) {
-					mark_buffer_dirty(bh);
-					sync_dirty_buffer(bh);
+					ouichefs_journal_dirty_sync(sb, bh);
 					dirty = false;
 				}
 				brelse(bh);
 			}
-			bh = sb_bread(sb, OUICHEFS_GET_INODE_BLOCK(ino));
+			bh = ouichefs_bread(sb,
+					    OUICHEFS_GET_INODE_BLOCK(sbi, ino));
 			if (unlikely(!bh)) {
 				pr_err("Failed to read inode %u while making a snapshot\n", ino);
+				ouichefs_journal_stop(&handle);
 				return -EIO;
 			}
-			last_ino_block = OUICHEFS_GET_INODE_BLOCK(ino);
+			last_ino_block = OUICHEFS_GET_INODE_BLOCK(sbi, ino);
 		}
 		disk_ino = (struct ouichefs_inode *) bh->b_data;
-		disk_ino += OUICHEFS_GET_INODE_SHIFT(ino);
+		disk_ino += OUICHEFS_GET_INODE_SHIFT(sbi, ino);
 
 		// Inode exists in current snapshot; Copy it
 		if (disk_ino->i_data[from_index] != 0) {
+			/* Split huge snapshots into transactions */
+			ouichefs_journal_ensure_credits(&handle,
+						OUICHEFS_SNAP_INODE_CREDITS);
 			ouichefs_link_inode_data(sb, ino, disk_ino,
 						 from_index, to_index);
+			ouichefs_journal_dirty(sb, bh);
 			dirty = true;
 			pr_debug("Copied ino=%u\n", ino);
 		}
 	}
 	if (likely(bh)) {
 		if (dirty) {
-			mark_buffer_dirty(bh);
-			sync_dirty_buffer(bh);
+			ouichefs_journal_dirty_sync(sb, bh);
 			dirty = false;
 		}
 		brelse(bh);
 	}
+	ouichefs_journal_stop(&handle);
 
 	return 0;
 }
@@ -76,6 +90,9 @@ int ouichefs_snapshot_create(struct super_block *sb, ouichefs_snap_id_t s_id)
 	uint32_t new_snapshot_id = 0;
 	int ret = 0;
 
+	if (sb_rdonly(sb))
+		return -EROFS;
+
 	/* Find free index for new snapshot */
 	for (ouichefs_snap_index_t j = 1; j < OUICHEFS_MAX_SNAPSHOTS; j++) {
 		if (sbi->snapshots[j].id == 0) {
@@ -110,16 +127,26 @@ try_next_id:
 		new_snapshot_id = s_id;
 	}
 
+	trace_ouichefs_snapshot(sb, OUICHEFS_SNAP_CREATE, OUICHEFS_SNAP_START,
+				new_snapshot_id, 0);
+
+	/* Keep detached subtrees out of the snapshot */
+	down_write(&sbi->detach_rwsem);
+	ouichefs_reclaim_flush(sb);
 
 	/* Sync all dirty data and prevent changes to this file system */
 	ret = freeze_super(sb);
 	if (ret) {
 		pr_err("file system freeze failed\n");
-		return ret;
+		goto up;
 	}
+	trace_ouichefs_snapshot(sb, OUICHEFS_SNAP_CREATE, OUICHEFS_SNAP_FROZEN,
+				new_snapshot_id, 0);
 
 	/* Copy all inodes on disk */
 	ret = copy_all_disk_inodes(sb, 0, new_snapshot_index);
+	trace_ouichefs_snapshot(sb, OUICHEFS_SNAP_CREATE, OUICHEFS_SNAP_INODES,
+				new_snapshot_id, ret);
 	if (ret)
 		goto cleanup;
 
@@ -127,13 +154,22 @@ try_next_id:
 	s_info->created = ktime_get_real_seconds();
 	s_info->id = new_snapshot_id;
 	pr_info("Created new snapshot %u\n", s_info->id);
+	ouichefs_stat_inc(sbi, OUICHEFS_STAT_SNAP_CREATE);
+	ouichefs_wa_new_epoch(sb, new_snapshot_id);
 	ret = 0;
 
 cleanup:
+	/* Make the snapshot durable before anyone can modify the fs */
+	ouichefs_journal_commit(sb);
+
 	//unfreeze fs to unlock it
 	if (thaw_super(sb))
 		pr_err("File system unfreeze failed\n");
 
+up:
+	up_write(&sbi->detach_rwsem);
+	trace_ouichefs_snapshot(sb, OUICHEFS_SNAP_CREATE, OUICHEFS_SNAP_END,
+				new_snapshot_id, ret);
 	return ret;
 }
 
@@ -143,11 +179,15 @@ int ouichefs_snapshot_delete(struct super_block *sb, ouichefs_snap_id_t s_id)
 	struct ouichefs_snapshot_info *s_info = NULL;
 	struct buffer_head *bh = NULL;
 	struct ouichefs_inode *disk_ino;
+	struct ouichefs_handle handle;
 	uint32_t ino, last_ino_block = 0;
 	ouichefs_snap_index_t s_index;
 	int ret = 0;
 	bool dirty = false;
 
+	if (sb_rdonly(sb))
+		return -EROFS;
+
 	// Cannot delete live snapshot
 	if (s_id == 0)
 		return -EINVAL;
@@ -165,62 +205,82 @@ int ouichefs_snapshot_delete(struct super_block *sb, ouichefs_snap_id_t s_id)
 	if (s_info == NULL)
 		return -ENOENT;
 
+	trace_ouichefs_snapshot(sb, OUICHEFS_SNAP_DELETE, OUICHEFS_SNAP_START,
+				s_id, 0);
+
 	/* Sync all dirty data and prevent changes to this file system */
 	ret = freeze_super(sb);
 	if (ret) {
 		pr_err("file system freeze failed\n");
-		return ret;
+		goto out;
 	}
+	trace_ouichefs_snapshot(sb, OUICHEFS_SNAP_DELETE, OUICHEFS_SNAP_FROZEN,
+				s_id, 0);
 
 	// Clean up inodes on disk
+	ouichefs_journal_start(sb, &handle);
 	for_each_clear_bit(ino, sbi->ifree_bitmap, sbi->nr_inodes) {
 		pr_debug("Iterating ino %u\n", ino);
 		// Reuse buffer head between ino's if they are in the same block
-		if (OUICHEFS_GET_INODE_BLOCK(ino) != last_ino_block) {
+		if (OUICHEFS_GET_INODE_BLOCK(sbi, ino) != last_ino_block) {
 			if (likely(bh)) {
 				if (dirty) {
-					mark_buffer_dirty(bh);
-					sync_dirty_buffer(bh);
+					ouichefs_journal_dirty_sync(sb, bh);
 					dirty = false;
 				}
 				brelse(bh);
 			}
-			bh = sb_bread(sb, OUICHEFS_GET_INODE_BLOCK(ino));
+			bh = ouichefs_bread(sb,
+					    OUICHEFS_GET_INODE_BLOCK(sbi, ino));
 			if (unlikely(!bh)) {
 				ret = -EIO;
 				pr_err("Failed to read inode %u while deleting a snapshot\n", ino);
+				ouichefs_journal_stop(&handle);
 				goto cleanup;
 			}
-			last_ino_block = OUICHEFS_GET_INODE_BLOCK(ino);
+			last_ino_block = OUICHEFS_GET_INODE_BLOCK(sbi, ino);
 		}
 		disk_ino = (struct ouichefs_inode *) bh->b_data;
-		disk_ino += OUICHEFS_GET_INODE_SHIFT(ino);
+		disk_ino += OUICHEFS_GET_INODE_SHIFT(sbi, ino);
 
 		// Inode exists in requested snapshot
 		if (disk_ino->i_data[s_index] != 0) {
+			/* Split huge snapshots into transactions */
+			ouichefs_journal_ensure_credits(&handle,
+						OUICHEFS_SNAP_INODE_CREDITS);
 			ouichefs_put_inode_data(sb, ino, disk_ino, s_index);
+			ouichefs_journal_dirty(sb, bh);
 			dirty = true;
 		}
 	}
 	if (likely(bh)) {
 		if (dirty) {
-			mark_buffer_dirty(bh);
-			sync_dirty_buffer(bh);
+			ouichefs_journal_dirty_sync(sb, bh);
 			dirty = false;
 		}
 		brelse(bh);
 	}
+	ouichefs_journal_stop(&handle);
+	trace_ouichefs_snapshot(sb, OUICHEFS_SNAP_DELETE, OUICHEFS_SNAP_INODES,
+				s_id, 0);
 
 	/* Free the slot in the superblock */
 	s_info->created = 0;
 	s_info->id = 0;
+	ouichefs_stat_inc(sbi, OUICHEFS_STAT_SNAP_DELETE);
 
 	ret = 0;
 cleanup:
+	/* Make the snapshot durable before anyone can modify the fs */
+	ouichefs_journal_commit(sb);
+
 	//unfreeze fs to unlock it
 	if (thaw_super(sb))
 		pr_err("File system unfreeze failed\n");
 
+out:
+	trace_ouichefs_snapshot(sb, OUICHEFS_SNAP_DELETE, OUICHEFS_SNAP_END,
+				s_id, ret);
 	return ret;
 }
 
@@ -261,6 +321,9 @@ int ouichefs_snapshot_restore(struct super_block *sb, ouichefs_snap_id_t s_id)
 	ouichefs_snap_index_t s_index;
 	int ret;
 
+	if (sb_rdonly(sb))
+		return -EROFS;
+
 	// Cannot restore live snapshot
 	if (s_id == 0)
 		return -EINVAL;
@@ -278,12 +341,24 @@ int ouichefs_snapshot_restore(struct super_block *sb, ouichefs_snap_id_t s_id)
 	if (s_info == NULL)
 		return -ENOENT;
 
+	trace_ouichefs_snapshot(sb, OUICHEFS_SNAP_RESTORE, OUICHEFS_SNAP_START,
+				s_id, 0);
+
+	/*
+	 * Finish reclaiming the detached subtrees of the live state before it
+	 * is replaced, so that none is left behind with its blocks in use.
+	 */
+	down_write(&sbi->detach_rwsem);
+	ouichefs_reclaim_flush(sb);
+
 	/* Sync all dirty data and prevent changes to this file system */
 	ret = freeze_super(sb);
 	if (ret) {
 		pr_err("file system freeze failed\n");
-		return ret;
+		goto up;
 	}
+	trace_ouichefs_snapshot(sb, OUICHEFS_SNAP_RESTORE, OUICHEFS_SNAP_FROZEN,
+				s_id, 0);
 
 	/*
 	 * Delete all dentries. This is overkill, but we do not have a
@@ -299,6 +374,8 @@ int ouichefs_snapshot_restore(struct super_block *sb, ouichefs_snap_id_t s_id)
 	 * Copy all data on disk, as we might not have all inodes loaded currently.
 	 */
 	copy_all_disk_inodes(sb, s_index, 0);
+	trace_ouichefs_snapshot(sb, OUICHEFS_SNAP_RESTORE, OUICHEFS_SNAP_INODES,
+				s_id, 0);
 
 	/*
 	 * Delete all unused inodes (i_count=0) and update all others in memory.
@@ -338,10 +415,18 @@ int ouichefs_snapshot_restore(struct super_block *sb, ouichefs_snap_id_t s_id)
 		}
 	}
 	spin_unlock(&sb->s_inode_list_lock);
+	ouichefs_journal_commit(sb);
 
 	//unfreeze fs to unlock it
 	if (thaw_super(sb))
 		pr_err("File system unfreeze failed\n");
 
-	return 0;
+	/* Inodes missing from the snapshot are not an error */
+	ret = 0;
+	ouichefs_stat_inc(sbi, OUICHEFS_STAT_SNAP_RESTORE);
+up:
+	up_write(&sbi->detach_rwsem);
+	trace_ouichefs_snapshot(sb, OUICHEFS_SNAP_RESTORE, OUICHEFS_SNAP_END,
+				s_id, ret);
+	return ret;
 }
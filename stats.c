@@ -0,0 +1,409 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/percpu.h>
+#include <linux/buffer_head.h>
+#include <linux/bio.h>
+#include <linux/slab.h>
+#include <linux/timekeeping.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "ouichefs.h"
+
+/*
+ * Performance counters of a partition. They are per-CPU, so updating them
+ * costs no more than an increment; reading sums them over all CPUs.
+ */
+int ouichefs_stats_init(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	sbi->stats = alloc_percpu(struct ouichefs_stats);
+	if (!sbi->stats)
+		return -ENOMEM;
+	sbi->wa_epochs = kcalloc(OUICHEFS_WA_EPOCHS, sizeof(*sbi->wa_epochs),
+				 GFP_KERNEL);
+	if (!sbi->wa_epochs) {
+		free_percpu(sbi->stats);
+		sbi->stats = NULL;
+		return -ENOMEM;
+	}
+
+	/* The first epoch starts at mount time */
+	spin_lock_init(&sbi->wa_lock);
+	sbi->wa_epochs[0].start = ktime_get_real_seconds();
+	sbi->wa_epoch = 1;
+	return 0;
+}
+
+void ouichefs_stats_release(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	kfree(sbi->wa_epochs);
+	free_percpu(sbi->stats);
+}
+
+u64 ouichefs_stat_read(struct super_block *sb, enum ouichefs_stat stat)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu_ptr(sbi->stats, cpu)->count[stat];
+	return sum;
+}
+
+u64 ouichefs_io_read(struct super_block *sb, enum ouichefs_region region,
+		     enum ouichefs_io io)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu_ptr(sbi->stats, cpu)->io[region][io];
+	return sum;
+}
+
+/* Sums the write amplification counters of all CPUs into count */
+static void ouichefs_wa_read(struct ouichefs_sb_info *sbi, u64 *count)
+{
+	int wa, cpu;
+
+	memset(count, 0, OUICHEFS_NR_WA * sizeof(*count));
+	for_each_possible_cpu(cpu) {
+		for (wa = 0; wa < OUICHEFS_NR_WA; wa++)
+			count[wa] += per_cpu_ptr(sbi->stats, cpu)->wa[wa];
+	}
+}
+
+/*
+ * Ends the running write amplification epoch and starts the one of the
+ * snapshot id, which was just created.
+ */
+void ouichefs_wa_new_epoch(struct super_block *sb, ouichefs_snap_id_t id)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_wa_epoch *cur, *next;
+	u64 total[OUICHEFS_NR_WA];
+	int wa;
+
+	ouichefs_wa_read(sbi, total);
+	spin_lock(&sbi->wa_lock);
+	cur = &sbi->wa_epochs[(sbi->wa_epoch - 1) % OUICHEFS_WA_EPOCHS];
+	next = &sbi->wa_epochs[sbi->wa_epoch % OUICHEFS_WA_EPOCHS];
+	for (wa = 0; wa < OUICHEFS_NR_WA; wa++) {
+		cur->count[wa] = total[wa] - cur->count[wa];
+		next->count[wa] = total[wa];
+	}
+	next->start = ktime_get_real_seconds();
+	next->id = id;
+	sbi->wa_epoch++;
+	spin_unlock(&sbi->wa_lock);
+}
+
+/*
+ * Returns the region of the partition layout block belongs to. With the
+ * group layout, metadata blocks are spread over the data region.
+ */
+enum ouichefs_region ouichefs_block_region(struct ouichefs_sb_info *sbi,
+					   uint32_t block)
+{
+	if (block == OUICHEFS_SB_BLOCK_NR)
+		return OUICHEFS_REGION_SB;
+	if (block < OUICHEFS_GET_IFREE_START(sbi))
+		return OUICHEFS_REGION_ISTORE;
+	if (block < OUICHEFS_GET_BFREE_START(sbi))
+		return OUICHEFS_REGION_IFREE;
+	if (block < OUICHEFS_GET_IDFREE_START(sbi))
+		return OUICHEFS_REGION_BFREE;
+	if (block < OUICHEFS_GET_IDIDX_BLOCK(sbi, 0))
+		return OUICHEFS_REGION_IDFREE;
+	if (block < OUICHEFS_GET_META_START(sbi))
+		return OUICHEFS_REGION_IDIDX;
+	if (sbi->nr_journal_blocks && block >= sbi->journal_start &&
+	    block < sbi->journal_start + sbi->nr_journal_blocks)
+		return OUICHEFS_REGION_JOURNAL;
+	if (block < OUICHEFS_GET_DATA_START(sbi) ||
+	    OUICHEFS_IS_META_BLOCK(block, sbi))
+		return OUICHEFS_REGION_META;
+	return OUICHEFS_REGION_DATA;
+}
+
+/*
+ * Same as sb_bread(), but accounts the read in the region of block: a cache
+ * hit, or a read from the device and the synchronous wait for it.
+ */
+struct buffer_head *ouichefs_bread(struct super_block *sb, uint32_t block)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct buffer_head *bh;
+	u64 start;
+	int ret;
+
+	bh = sb_getblk(sb, block);
+	if (unlikely(!bh))
+		return NULL;
+	if (buffer_uptodate(bh)) {
+		ouichefs_io_add(sbi, block, OUICHEFS_IO_HIT, 1);
+		return bh;
+	}
+
+	start = local_clock();
+	ret = bh_read(bh, 0);
+	if (unlikely(ret < 0)) {
+		brelse(bh);
+		return NULL;
+	}
+	/* Someone else may have read it while we waited for the lock */
+	ouichefs_io_add(sbi, block, ret ? OUICHEFS_IO_HIT : OUICHEFS_IO_READ,
+			1);
+	ouichefs_io_add(sbi, block, OUICHEFS_IO_WAIT, 1);
+	ouichefs_io_add(sbi, block, OUICHEFS_IO_WAIT_NS, local_clock() - start);
+	return bh;
+}
+
+/* Same as sb_breadahead(), but accounts the read */
+void ouichefs_breadahead(struct super_block *sb, uint32_t block)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct buffer_head *bh = sb_getblk(sb, block);
+
+	if (likely(bh)) {
+		if (!buffer_uptodate(bh))
+			ouichefs_io_add(sbi, block, OUICHEFS_IO_READ, 1);
+		bh_readahead(bh, REQ_RAHEAD);
+		brelse(bh);
+	}
+}
+
+/* Same as sync_dirty_buffer(), but accounts the write and the wait */
+int ouichefs_sync_buffer(struct super_block *sb, struct buffer_head *bh)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	u64 start = local_clock();
+	int ret;
+
+	if (buffer_dirty(bh))
+		ouichefs_io_add(sbi, bh->b_blocknr, OUICHEFS_IO_WRITE, 1);
+	ret = sync_dirty_buffer(bh);
+	ouichefs_io_add(sbi, bh->b_blocknr, OUICHEFS_IO_WAIT, 1);
+	ouichefs_io_add(sbi, bh->b_blocknr, OUICHEFS_IO_WAIT_NS,
+			local_clock() - start);
+	return ret;
+}
+
+/*
+ * Same as submit_bio_wait(). The blocks must be accounted when the bio is
+ * built, the wait is accounted in the region of the first block of bio,
+ * i.e. of the last bio of a chain.
+ */
+int ouichefs_submit_bio_wait(struct super_block *sb, struct bio *bio)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	uint32_t block = bio->bi_iter.bi_sector >>
+			 (sb->s_blocksize_bits - SECTOR_SHIFT);
+	u64 start = local_clock();
+	int ret;
+
+	ret = submit_bio_wait(bio);
+	ouichefs_io_add(sbi, block, OUICHEFS_IO_WAIT, 1);
+	ouichefs_io_add(sbi, block, OUICHEFS_IO_WAIT_NS, local_clock() - start);
+	return ret;
+}
+
+/*
+ * debugfs interface, in /sys/kernel/debug/ouichefs/<dev>/. Unlike sysfs, its
+ * files may hold whole tables, e.g. histograms.
+ */
+static struct dentry *ouichefs_debugfs_root;
+
+static const char *const ouichefs_lat_names[OUICHEFS_NR_LATS] = {
+	[OUICHEFS_LAT_LOOKUP] = "lookup",
+	[OUICHEFS_LAT_CREATE] = "create",
+	[OUICHEFS_LAT_UNLINK] = "unlink",
+	[OUICHEFS_LAT_RENAME] = "rename",
+	[OUICHEFS_LAT_WRITE_BEGIN] = "write_begin",
+	[OUICHEFS_LAT_WRITEPAGE] = "writepage",
+	[OUICHEFS_LAT_WRITE_INODE] = "write_inode",
+	[OUICHEFS_LAT_SYNC_FS] = "sync_fs",
+	[OUICHEFS_LAT_SNAP_CREATE] = "snapshot_create",
+	[OUICHEFS_LAT_SNAP_DELETE] = "snapshot_delete",
+	[OUICHEFS_LAT_SNAP_RESTORE] = "snapshot_restore",
+};
+
+/* Returns the upper bound in ns of the permille-th permille of hist */
+static u64 lat_percentile(const u64 *hist, u64 total, unsigned int permille)
+{
+	u64 sum = 0;
+	int i;
+
+	for (i = 0; i < OUICHEFS_LAT_BUCKETS - 1; i++) {
+		sum += hist[i];
+		if (sum * 1000 >= total * permille)
+			break;
+	}
+	return 1ULL << (i + 1);
+}
+
+static const char *const ouichefs_region_names[OUICHEFS_NR_REGIONS] = {
+	[OUICHEFS_REGION_SB] = "sb",
+	[OUICHEFS_REGION_ISTORE] = "istore",
+	[OUICHEFS_REGION_IFREE] = "ifree",
+	[OUICHEFS_REGION_BFREE] = "bfree",
+	[OUICHEFS_REGION_IDFREE] = "idfree",
+	[OUICHEFS_REGION_IDIDX] = "ididx",
+	[OUICHEFS_REGION_META] = "meta",
+	[OUICHEFS_REGION_DATA] = "data",
+	[OUICHEFS_REGION_JOURNAL] = "journal",
+};
+
+static int io_show(struct seq_file *m, void *v)
+{
+	struct super_block *sb = m->private;
+	int region;
+
+	seq_printf(m, "%-8s %12s %12s %12s %12s %16s\n", "region", "hits",
+		   "reads", "writes", "waits", "wait_ns");
+	for (region = 0; region < OUICHEFS_NR_REGIONS; region++)
+		seq_printf(m, "%-8s %12llu %12llu %12llu %12llu %16llu\n",
+			   ouichefs_region_names[region],
+			   ouichefs_io_read(sb, region, OUICHEFS_IO_HIT),
+			   ouichefs_io_read(sb, region, OUICHEFS_IO_READ),
+			   ouichefs_io_read(sb, region, OUICHEFS_IO_WRITE),
+			   ouichefs_io_read(sb, region, OUICHEFS_IO_WAIT),
+			   ouichefs_io_read(sb, region, OUICHEFS_IO_WAIT_NS));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(io);
+
+static int write_amplification_show(struct seq_file *m, void *v)
+{
+	struct super_block *sb = m->private;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_wa_epoch e;
+	u64 total[OUICHEFS_NR_WA];
+	u64 blocks, ratio;
+	unsigned int i, first, last;
+	u32 frac;
+	int wa;
+
+	seq_printf(m, "%-8s %-10s %-12s %14s %10s %10s %10s %10s %10s %10s %10s\n",
+		   "epoch", "snapshot", "start", "bytes", "data", "cow_data",
+		   "cow_index", "cow_dir", "cow_idata", "ide_cow", "wa");
+	ouichefs_wa_read(sbi, total);
+	spin_lock(&sbi->wa_lock);
+	last = sbi->wa_epoch - 1;
+	first = last >= OUICHEFS_WA_EPOCHS ? last - OUICHEFS_WA_EPOCHS + 1 : 0;
+	for (i = first; i <= last; i++) {
+		e = sbi->wa_epochs[i % OUICHEFS_WA_EPOCHS];
+		if (i == last) {
+			for (wa = 0; wa < OUICHEFS_NR_WA; wa++)
+				e.count[wa] = total[wa] - e.count[wa];
+		}
+
+		/* Bytes of blocks written or copied per byte of write() */
+		blocks = e.count[OUICHEFS_WA_DATA] +
+			 e.count[OUICHEFS_WA_COW_DATA] +
+			 e.count[OUICHEFS_WA_COW_INDEX] +
+			 e.count[OUICHEFS_WA_COW_DIR] +
+			 e.count[OUICHEFS_WA_COW_INODE_DATA];
+		ratio = 0;
+		if (e.count[OUICHEFS_WA_BYTES])
+			ratio = div64_u64(blocks * sb->s_blocksize * 100,
+					  e.count[OUICHEFS_WA_BYTES]);
+		ratio = div_u64_rem(ratio, 100, &frac);
+
+		seq_printf(m, "%-8u %-10u %-12lld %14llu %10llu %10llu %10llu %10llu %10llu %10llu %7llu.%02u\n",
+			   i, e.id, e.start, e.count[OUICHEFS_WA_BYTES],
+			   e.count[OUICHEFS_WA_DATA],
+			   e.count[OUICHEFS_WA_COW_DATA],
+			   e.count[OUICHEFS_WA_COW_INDEX],
+			   e.count[OUICHEFS_WA_COW_DIR],
+			   e.count[OUICHEFS_WA_COW_INODE_DATA],
+			   e.count[OUICHEFS_WA_IDE_COW],
+			   ratio, frac);
+	}
+	spin_unlock(&sbi->wa_lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(write_amplification);
+
+static int latency_show(struct seq_file *m, void *v)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(m->private);
+	struct ouichefs_stats *stats;
+	u64 hist[OUICHEFS_LAT_BUCKETS];
+	u64 total;
+	int lat, i, cpu;
+
+	for (lat = 0; lat < OUICHEFS_NR_LATS; lat++) {
+		memset(hist, 0, sizeof(hist));
+		total = 0;
+		for_each_possible_cpu(cpu) {
+			stats = per_cpu_ptr(sbi->stats, cpu);
+			for (i = 0; i < OUICHEFS_LAT_BUCKETS; i++)
+				hist[i] += stats->lat[lat][i];
+		}
+		for (i = 0; i < OUICHEFS_LAT_BUCKETS; i++)
+			total += hist[i];
+
+		seq_printf(m, "%s: %llu ops", ouichefs_lat_names[lat], total);
+		if (total)
+			seq_printf(m, ", p50 < %llu ns, p99 < %llu ns, p99.9 < %llu ns",
+				   lat_percentile(hist, total, 500),
+				   lat_percentile(hist, total, 990),
+				   lat_percentile(hist, total, 999));
+		seq_putc(m, '\n');
+		for (i = 0; i < OUICHEFS_LAT_BUCKETS; i++) {
+			if (hist[i])
+				seq_printf(m, "  [%llu, %llu) ns: %llu\n",
+					   i ? 1ULL << i : 0, 1ULL << (i + 1),
+					   hist[i]);
+		}
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(latency);
+
+void ouichefs_debugfs_init(void)
+{
+	ouichefs_debugfs_root = debugfs_create_dir("ouichefs", NULL);
+}
+
+void ouichefs_debugfs_exit(void)
+{
+	debugfs_remove(ouichefs_debugfs_root);
+}
+
+/*
+ * Creates the debugfs directory of a mounted partition. Like everywhere in
+ * debugfs, failures are not fatal and not reported.
+ */
+void ouichefs_debugfs_register(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	sbi->debugfs = debugfs_create_dir(sb->s_id, ouichefs_debugfs_root);
+	debugfs_create_file("io", 0444, sbi->debugfs, sb, &io_fops);
+	debugfs_create_file("latency", 0444, sbi->debugfs, sb, &latency_fops);
+	debugfs_create_file("write_amplification", 0444, sbi->debugfs, sb,
+			    &write_amplification_fops);
+	ouichefs_frag_debugfs(sb, sbi->debugfs);
+}
+
+/* Removes the debugfs files, waiting for their readers */
+void ouichefs_debugfs_unregister(struct super_block *sb)
+{
+	debugfs_remove(OUICHEFS_SB(sb)->debugfs);
+}
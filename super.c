@@ -10,9 +10,15 @@
 #include <linux/kernel.h>
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
+#include <linux/bio.h>
+#include <linux/bitmap.h>
+#include <linux/blkdev.h>
+#include <linux/log2.h>
+#include <linux/sizes.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/statfs.h>
+#include <linux/vmalloc.h>
 
 #include "ouichefs.h"
 
@@ -36,12 +42,17 @@ void ouichefs_destroy_inode_cache(void)
 static struct inode *ouichefs_alloc_inode(struct super_block *sb)
 {
 	struct ouichefs_inode_info *ci;
+	int i;
 
 	/* ci = kzalloc(sizeof(struct ouichefs_inode_info), GFP_KERNEL); */
 	ci = kmem_cache_alloc(ouichefs_inode_cache, GFP_KERNEL);
 	if (!ci)
 		return NULL;
 	inode_init_once(&ci->vfs_inode);
+	memset(&ci->pending, 0, sizeof(ci->pending));
+	ci->log_err = 0;
+	for (i = 0; i < OUICHEFS_NR_WA; i++)
+		atomic64_set(&ci->wa[i], 0);
 	return &ci->vfs_inode;
 }
 
@@ -56,8 +67,7 @@ static void ouichefs_destroy_inode(struct inode *inode)
 /*
  * Writes an inode to disk, dropping associated data if it is deleted.
  */
-static int ouichefs_write_inode(struct inode *inode,
-				struct writeback_control *wbc)
+static int ouichefs_store_inode(struct inode *inode)
 {
 	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 	struct super_block *sb = inode->i_sb;
@@ -66,6 +76,7 @@ static int ouichefs_write_inode(struct inode *inode,
 	struct ouichefs_inode *disk_inode;
 	struct ouichefs_inode_data *disk_idata;
 	uint32_t ino = inode->i_ino;
+	bool copied = false;
 
 	if (ino >= sbi->nr_inodes)
 		return 0;
@@ -77,11 +88,11 @@ static int ouichefs_write_inode(struct inode *inode,
 	 */
 	if (ci->index_block == 0) {
 		/* This is here for debugging, gate behind a flag maybe? */
-		bh = sb_bread(sb, OUICHEFS_GET_INODE_BLOCK(ino));
+		bh = ouichefs_bread(sb, OUICHEFS_GET_INODE_BLOCK(sbi, ino));
 		if (unlikely(!bh))
 			return -EIO;
 		disk_inode = (struct ouichefs_inode *)bh->b_data;
-		disk_inode += OUICHEFS_GET_INODE_SHIFT(ino);
+		disk_inode += OUICHEFS_GET_INODE_SHIFT(sbi, ino);
 
 		if (unlikely(disk_inode->i_data[0])) {
 			pr_err("Dead inode %u has idx %u mapped!",
@@ -95,9 +106,11 @@ static int ouichefs_write_inode(struct inode *inode,
 	}
 
 	/* Get inode data from disk */
-	disk_idata = ouichefs_get_inode_data(sb, &bh, ino, false, true);
+	disk_idata = ouichefs_get_inode_data(sb, &bh, ino, false, &copied);
 	if (IS_ERR(disk_idata))
 		return PTR_ERR(disk_idata);
+	if (copied)
+		ouichefs_wa_add(inode, OUICHEFS_WA_IDE_COW, 1);
 
 	/* update the mode using what the generic inode has */
 	disk_idata->i_mode = inode->i_mode;
@@ -113,27 +126,91 @@ static int ouichefs_write_inode(struct inode *inode,
 	disk_idata->i_blocks = inode->i_blocks;
 	disk_idata->i_nlink = inode->i_nlink;
 	disk_idata->index_block = ci->index_block;
+	disk_idata->i_parent = ci->parent;
+	spin_lock(&sbi->dstats_lock);
+	disk_idata->r_bytes = cpu_to_le64(ci->r_stats.bytes);
+	disk_idata->r_blocks = cpu_to_le64(ci->r_stats.blocks);
+	disk_idata->r_files = cpu_to_le64(ci->r_stats.files);
+	spin_unlock(&sbi->dstats_lock);
 
 	pr_debug("Wrote inode %u with index_block %u\n", ino, ci->index_block);
 
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
+	ouichefs_journal_dirty_sync(sb, bh);
 	brelse(bh);
 
 	return 0;
 }
 
-static int sync_sb_info(struct super_block *sb, int wait)
+/*
+ * Logs an inode in a handle of its own. A failure is remembered so that
+ * ouichefs_log_inode_retry() tries again and reports it.
+ */
+static int ouichefs_log_inode(struct inode *inode)
 {
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-	struct ouichefs_sb_info *disk_sb;
-	struct buffer_head *bh;
+	struct ouichefs_handle handle;
+	int ret;
 
-	/* Flush superblock */
-	bh = sb_bread(sb, OUICHEFS_SB_BLOCK_NR);
-	if (!bh)
-		return -EIO;
-	disk_sb = (struct ouichefs_sb_info *)bh->b_data;
+	ouichefs_journal_start(inode->i_sb, &handle);
+	ret = ouichefs_store_inode(inode);
+	ouichefs_journal_stop(&handle);
+	WRITE_ONCE(OUICHEFS_INODE(inode)->log_err, ret);
+	return ret;
+}
+
+/*
+ * Logs an inode again if ouichefs_dirty_inode() failed to, so it stays dirty
+ * until it made it into a transaction.
+ */
+int ouichefs_log_inode_retry(struct inode *inode)
+{
+	if (!READ_ONCE(OUICHEFS_INODE(inode)->log_err))
+		return 0;
+	return ouichefs_log_inode(inode);
+}
+
+/*
+ * With a journal, inodes are logged as soon as they are dirtied, so they are
+ * part of the transaction that modified them.
+ */
+static void ouichefs_dirty_inode(struct inode *inode, int flags)
+{
+	if (!OUICHEFS_SB(inode->i_sb)->journal || !(flags & I_DIRTY_INODE))
+		return;
+	if (inode->i_ino >= OUICHEFS_SB(inode->i_sb)->nr_inodes ||
+	    OUICHEFS_INODE(inode)->index_block == 0)
+		return;
+
+	if (ouichefs_log_inode(inode))
+		pr_err("Failed to log inode %lu\n", inode->i_ino);
+}
+
+static int ouichefs_write_inode(struct inode *inode,
+				struct writeback_control *wbc)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	u64 start = local_clock();
+	int ret;
+
+	/* Already logged by ouichefs_dirty_inode(), unless that failed */
+	if (sbi->journal) {
+		ret = ouichefs_log_inode_retry(inode);
+		if (ret || wbc->sync_mode != WB_SYNC_ALL)
+			return ret;
+		ret = ouichefs_journal_commit(inode->i_sb);
+	} else {
+		ret = ouichefs_store_inode(inode);
+	}
+	ouichefs_lat_end(sbi, OUICHEFS_LAT_WRITE_INODE, start);
+	return ret;
+}
+
+/*
+ * Copies the in-memory superblock fields into the on-disk superblock.
+ */
+void ouichefs_sb_to_disk(struct super_block *sb,
+			 struct ouichefs_sb_info *disk_sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 
 	disk_sb->nr_blocks = sbi->nr_blocks;
 	disk_sb->nr_inodes = sbi->nr_inodes;
@@ -147,67 +224,230 @@ static int sync_sb_info(struct super_block *sb, int wait)
 	disk_sb->nr_idfree_blocks = sbi->nr_idfree_blocks;
 	disk_sb->nr_ididx_blocks = sbi->nr_ididx_blocks;
 	disk_sb->nr_meta_blocks = sbi->nr_meta_blocks;
+	disk_sb->journal_start = sbi->journal_start;
+	disk_sb->nr_journal_blocks = sbi->nr_journal_blocks;
+	disk_sb->hot_list_block = sbi->hot_list_block;
+	disk_sb->block_size = sbi->block_size;
+	disk_sb->version = sbi->version;
+	disk_sb->feature_compat = sbi->feature_compat;
+	disk_sb->feature_ro_compat = sbi->feature_ro_compat;
+	disk_sb->feature_incompat = sbi->feature_incompat;
 	memcpy(disk_sb->snapshots, sbi->snapshots,
 		sizeof(disk_sb->snapshots));
+}
+
+static int sync_sb_info(struct super_block *sb)
+{
+	struct buffer_head *bh;
+
+	/* Flush superblock */
+	bh = ouichefs_bread(sb, OUICHEFS_SB_BLOCK_NR);
+	if (!bh)
+		return -EIO;
+	ouichefs_sb_to_disk(sb, (struct ouichefs_sb_info *)bh->b_data);
 
 	mark_buffer_dirty(bh);
-	if (wait)
-		sync_dirty_buffer(bh);
 	brelse(bh);
 
 	return 0;
 }
 
+/*
+ * Copies the bitmap blocks modified since the last call into the buffer
+ * cache. The blocks are fully overwritten, so they are never read.
+ */
 static int sync_bitmap(struct super_block *sb, unsigned long *bitmap,
-		       uint32_t nr_blocks, uint32_t start, bool wait)
+		       unsigned long *dirty, spinlock_t *lock,
+		       uint32_t nr_blocks, uint32_t start)
 {
 	struct buffer_head *bh;
-	int i, idx;
+	unsigned long i;
 
-	/* Flush free blocks / inodes / ididx bitmask */
-	for (i = 0; i < nr_blocks; i++) {
-		idx = start + i;
+	for_each_set_bit(i, dirty, nr_blocks) {
+		/* Clear first, so concurrent changes dirty the block again */
+		clear_bit(i, dirty);
 
-		bh = sb_bread(sb, idx);
-		if (!bh)
-			return -EIO;
-
-		memcpy(bh->b_data,
-		       (void *)bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       OUICHEFS_BLOCK_SIZE);
+		bh = sb_getblk(sb, start + i);
+		if (!bh) {
+			set_bit(i, dirty);
+			return -ENOMEM;
+		}
 
+		lock_buffer(bh);
+		spin_lock(lock);
+		memcpy(bh->b_data, (void *)bitmap + (i << sb->s_blocksize_bits),
+		       sb->s_blocksize);
+		spin_unlock(lock);
+		set_buffer_uptodate(bh);
 		mark_buffer_dirty(bh);
-		if (wait)
-			sync_dirty_buffer(bh);
+		unlock_buffer(bh);
 		brelse(bh);
 	}
 
 	return 0;
 }
 
-static int load_bitmap(struct super_block *sb, unsigned long **bitmap,
-		       uint32_t nr_blocks, uint32_t start)
+static int alloc_bitmap(struct super_block *sb, unsigned long **bitmap,
+			unsigned long **dirty, uint32_t nr_blocks)
 {
-	struct buffer_head *bh;
-	*bitmap = kzalloc(nr_blocks * OUICHEFS_BLOCK_SIZE, GFP_KERNEL);
-
+	*bitmap = kvmalloc((size_t)nr_blocks << sb->s_blocksize_bits,
+			   GFP_KERNEL);
 	if (!(*bitmap))
 		return -ENOMEM;
-	for (int i = 0; i < nr_blocks; i++) {
-		int idx = start + i;
+	*dirty = bitmap_zalloc(nr_blocks, GFP_KERNEL);
+	if (!(*dirty)) {
+		kvfree(*bitmap);
+		*bitmap = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
 
-		bh = sb_bread(sb, idx);
-		if (!bh) {
-			kfree(*bitmap);
-			return -EIO;
-		}
+/*
+ * Frees the free bitmaps. The statistics in debugfs only look at ifree_bitmap
+ * and bfree_bitmap under their locks, so they are detached under them first.
+ */
+static void free_bitmaps(struct ouichefs_sb_info *sbi)
+{
+	unsigned long *ifree, *bfree;
+
+	spin_lock(&sbi->ifree_lock);
+	ifree = sbi->ifree_bitmap;
+	sbi->ifree_bitmap = NULL;
+	spin_unlock(&sbi->ifree_lock);
+	spin_lock(&sbi->bfree_lock);
+	bfree = sbi->bfree_bitmap;
+	sbi->bfree_bitmap = NULL;
+	spin_unlock(&sbi->bfree_lock);
+
+	kvfree(ifree);
+	kvfree(bfree);
+	kvfree(sbi->idfree_bitmap);
+	bitmap_free(sbi->ifree_dirty);
+	bitmap_free(sbi->bfree_dirty);
+	bitmap_free(sbi->idfree_dirty);
+	sbi->idfree_bitmap = NULL;
+	sbi->ifree_dirty = sbi->bfree_dirty = sbi->idfree_dirty = NULL;
+}
 
-		memcpy((void *)(*bitmap) + i * OUICHEFS_BLOCK_SIZE,
-		       bh->b_data, OUICHEFS_BLOCK_SIZE);
+/*
+ * Allocates the free bitmaps and the dirty maps tracking them.
+ * idfree_bitmap itself is loaded on first use.
+ */
+static int alloc_bitmaps(struct ouichefs_sb_info *sbi)
+{
+	int ret;
 
-		brelse(bh);
+	ret = alloc_bitmap(sbi->sb, &sbi->ifree_bitmap, &sbi->ifree_dirty,
+			   sbi->nr_ifree_blocks);
+	if (ret)
+		return ret;
+	ret = alloc_bitmap(sbi->sb, &sbi->bfree_bitmap, &sbi->bfree_dirty,
+			   OUICHEFS_GET_BFREE_USED(sbi));
+	if (ret)
+		goto free;
+	sbi->idfree_dirty = bitmap_zalloc(sbi->nr_idfree_blocks, GFP_KERNEL);
+	if (!sbi->idfree_dirty) {
+		ret = -ENOMEM;
+		goto free;
 	}
 	return 0;
+
+free:
+	free_bitmaps(sbi);
+	return ret;
+}
+
+/*
+ * Queues the reads of nr_blocks bitmap blocks starting at start into buf,
+ * chained behind bio. Each bio covers as many blocks as it can hold. The last
+ * bio is returned without being submitted, it completes after all others.
+ */
+static struct bio *read_bitmap(struct super_block *sb, struct bio *bio,
+			       void *buf, uint32_t nr_blocks, uint32_t start,
+			       gfp_t gfp)
+{
+	bool new_bio = true;
+
+	ouichefs_io_add(OUICHEFS_SB(sb), start, OUICHEFS_IO_READ, nr_blocks);
+	for (uint32_t i = 0; i < nr_blocks; i++) {
+		void *addr = buf + ((size_t)i << sb->s_blocksize_bits);
+		struct page *page = is_vmalloc_addr(addr) ?
+					    vmalloc_to_page(addr) :
+					    virt_to_page(addr);
+
+		if (!new_bio && bio_add_page(bio, page, sb->s_blocksize,
+					     offset_in_page(addr)))
+			continue;
+
+		bio = blk_next_bio(bio, sb->s_bdev, BIO_MAX_VECS, REQ_OP_READ,
+				   gfp);
+		bio->bi_iter.bi_sector = (sector_t)(start + i)
+					 << (sb->s_blocksize_bits - SECTOR_SHIFT);
+		__bio_add_page(bio, page, sb->s_blocksize, offset_in_page(addr));
+		new_bio = false;
+	}
+	return bio;
+}
+
+/*
+ * Queues the reads of ifree_bitmap and bfree_bitmap. As for read_bitmap(),
+ * the returned bio must be submitted by the caller.
+ */
+static struct bio *read_bitmaps(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct bio *bio;
+
+	bio = read_bitmap(sb, NULL, sbi->ifree_bitmap, sbi->nr_ifree_blocks,
+			  OUICHEFS_GET_IFREE_START(sbi), GFP_KERNEL);
+	return read_bitmap(sb, bio, sbi->bfree_bitmap,
+			   OUICHEFS_GET_BFREE_USED(sbi),
+			   OUICHEFS_GET_BFREE_START(sbi), GFP_KERNEL);
+}
+
+static void read_bitmap_end_io(struct bio *bio)
+{
+	complete(bio->bi_private);
+}
+
+/*
+ * The inode data free bitmap is by far the largest one and only needed to
+ * create or delete inode data entries, so it is read on first use.
+ */
+int ouichefs_load_idfree(struct ouichefs_sb_info *sbi)
+{
+	struct super_block *sb = sbi->sb;
+	unsigned long *bitmap;
+	struct bio *bio;
+	int ret = 0;
+
+	mutex_lock(&sbi->idfree_mutex);
+	if (sbi->idfree_bitmap)
+		goto unlock;
+
+	/* Callers may be inside a journal handle */
+	bitmap = kvmalloc((size_t)sbi->nr_idfree_blocks << sb->s_blocksize_bits,
+			  GFP_NOFS);
+	if (!bitmap) {
+		ret = -ENOMEM;
+		goto unlock;
+	}
+	bio = read_bitmap(sb, NULL, bitmap, sbi->nr_idfree_blocks,
+			  OUICHEFS_GET_IDFREE_START(sbi), GFP_NOFS);
+	ret = ouichefs_submit_bio_wait(sb, bio);
+	bio_put(bio);
+	if (ret) {
+		pr_err("Failed to read inode data free bitmap: %d\n", ret);
+		kvfree(bitmap);
+		goto unlock;
+	}
+
+	/* Pairs with the lockless check in bitmap.h */
+	smp_store_release(&sbi->idfree_bitmap, bitmap);
+unlock:
+	mutex_unlock(&sbi->idfree_mutex);
+	return ret;
 }
 
 static void ouichefs_put_super(struct super_block *sb)
@@ -215,35 +455,68 @@ static void ouichefs_put_super(struct super_block *sb)
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 
 	if (sbi) {
-		kfree(sbi->ifree_bitmap);
-		kfree(sbi->bfree_bitmap);
-		kfree(sbi->idfree_bitmap);
+		ouichefs_debugfs_unregister(sb);
+		ouichefs_journal_release(sb);
+		ouichefs_hot_release(sb);
+		ouichefs_stats_release(sb);
+		free_bitmaps(sbi);
 		kfree(sbi);
 	}
 }
 
-static int ouichefs_sync_fs(struct super_block *sb, int wait)
+static int __ouichefs_sync_fs(struct super_block *sb, int wait)
 {
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	int ret = 0;
 
-	ret = sync_sb_info(sb, wait);
+	/*
+	 * The superblock and bitmaps are logged by each commit. Writing them
+	 * here would expose uncommitted changes. Periodic commits take care
+	 * of the non-waiting case.
+	 */
+	if (sbi->journal)
+		return wait ? ouichefs_journal_commit(sb) : 0;
+
+	/*
+	 * Only copy what changed into the buffer cache. The block device
+	 * writes them back in one batch, which we wait for if asked to,
+	 * followed by a single cache flush.
+	 */
+	ret = sync_sb_info(sb);
 	if (ret)
 		return ret;
-	ret = sync_bitmap(sb, sbi->ifree_bitmap, sbi->nr_ifree_blocks,
-			  OUICHEFS_GET_IFREE_START(sbi), wait);
+	ret = sync_bitmap(sb, sbi->ifree_bitmap, sbi->ifree_dirty,
+			  &sbi->ifree_lock, sbi->nr_ifree_blocks,
+			  OUICHEFS_GET_IFREE_START(sbi));
 	if (ret)
 		return ret;
-	ret = sync_bitmap(sb, sbi->bfree_bitmap, sbi->nr_bfree_blocks,
-			  OUICHEFS_GET_BFREE_START(sbi), wait);
+	ret = sync_bitmap(sb, sbi->bfree_bitmap, sbi->bfree_dirty,
+			  &sbi->bfree_lock, OUICHEFS_GET_BFREE_USED(sbi),
+			  OUICHEFS_GET_BFREE_START(sbi));
 	if (ret)
 		return ret;
-	ret = sync_bitmap(sb, sbi->idfree_bitmap, sbi->nr_idfree_blocks,
-			  OUICHEFS_GET_IDFREE_START(sbi), wait);
+	ret = sync_bitmap(sb, sbi->idfree_bitmap, sbi->idfree_dirty,
+			  &sbi->idfree_lock, sbi->nr_idfree_blocks,
+			  OUICHEFS_GET_IDFREE_START(sbi));
 	if (ret)
 		return ret;
+	if (!wait)
+		return 0;
 
-	return 0;
+	ret = sync_blockdev(sb->s_bdev);
+	if (ret)
+		return ret;
+	return blkdev_issue_flush(sb->s_bdev);
+}
+
+static int ouichefs_sync_fs(struct super_block *sb, int wait)
+{
+	u64 start = local_clock();
+	int ret;
+
+	ret = __ouichefs_sync_fs(sb, wait);
+	ouichefs_lat_end(OUICHEFS_SB(sb), OUICHEFS_LAT_SYNC_FS, start);
+	return ret;
 }
 
 static int ouichefs_statfs(struct dentry *dentry, struct kstatfs *stat)
@@ -252,7 +525,7 @@ static int ouichefs_statfs(struct dentry *dentry, struct kstatfs *stat)
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 
 	stat->f_type = OUICHEFS_MAGIC;
-	stat->f_bsize = OUICHEFS_BLOCK_SIZE;
+	stat->f_bsize = sb->s_blocksize;
 	stat->f_blocks = sbi->nr_blocks;
 	stat->f_bfree = sbi->nr_free_blocks;
 	stat->f_bavail = sbi->nr_free_blocks;
@@ -263,15 +536,177 @@ static int ouichefs_statfs(struct dentry *dentry, struct kstatfs *stat)
 	return 0;
 }
 
+/*
+ * Read-only mounts do without the free bitmaps, load them when switching to
+ * read-write.
+ */
+static int ouichefs_remount_fs(struct super_block *sb, int *flags, char *data)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct bio *bio;
+	int ret;
+
+	/* New detaches are excluded by sb_prepare_remount_readonly() */
+	if ((*flags & SB_RDONLY) && !sb_rdonly(sb))
+		ouichefs_reclaim_flush(sb);
+
+	ret = sync_filesystem(sb);
+	if (ret)
+		return ret;
+	if (*flags & SB_RDONLY) {
+		/* Stop the periodic commit and leave a clean log */
+		if (!sb_rdonly(sb))
+			ret = ouichefs_journal_flush(sb);
+		return ret;
+	}
+	if (sbi->feature_ro_compat & ~OUICHEFS_FEATURE_RO_COMPAT_SUPP) {
+		pr_err("Unsupported features %#x, only read-only mounts are possible\n",
+		       sbi->feature_ro_compat & ~OUICHEFS_FEATURE_RO_COMPAT_SUPP);
+		return -EROFS;
+	}
+	if (sbi->ifree_bitmap)
+		return 0;
+
+	ret = alloc_bitmaps(sbi);
+	if (ret)
+		return ret;
+	bio = read_bitmaps(sb);
+	ret = ouichefs_submit_bio_wait(sb, bio);
+	bio_put(bio);
+	if (ret) {
+		pr_err("Failed to read free bitmaps: %d\n", ret);
+		free_bitmaps(sbi);
+	}
+	return ret;
+}
+
 static struct super_operations ouichefs_super_ops = {
 	.put_super = ouichefs_put_super,
 	.alloc_inode = ouichefs_alloc_inode,
 	.destroy_inode = ouichefs_destroy_inode,
+	.dirty_inode = ouichefs_dirty_inode,
 	.write_inode = ouichefs_write_inode,
 	.sync_fs = ouichefs_sync_fs,
 	.statfs = ouichefs_statfs,
+	.remount_fs = ouichefs_remount_fs,
 };
 
+/*
+ * Reads the partition superblock. The block size is stored in the superblock
+ * itself, which is at the start of block 0 whatever the size: read it with
+ * the smallest size first, then switch to the one of the partition.
+ */
+static struct buffer_head *read_disk_sb(struct super_block *sb)
+{
+	struct ouichefs_sb_info *csb;
+	struct buffer_head *bh;
+	uint32_t block_size;
+
+	if (!sb_min_blocksize(sb, OUICHEFS_MIN_BLOCK_SIZE)) {
+		pr_err("Unable to set the block size\n");
+		return ERR_PTR(-EINVAL);
+	}
+	bh = sb_bread(sb, OUICHEFS_SB_BLOCK_NR);
+	if (!bh)
+		return ERR_PTR(-EIO);
+	csb = (struct ouichefs_sb_info *)bh->b_data;
+
+	/* Check magic number */
+	if (csb->magic != sb->s_magic) {
+		pr_err("Wrong magic number\n");
+		brelse(bh);
+		return ERR_PTR(-EPERM);
+	}
+
+	block_size = csb->block_size;
+	if (block_size < OUICHEFS_MIN_BLOCK_SIZE ||
+	    block_size > OUICHEFS_MAX_BLOCK_SIZE ||
+	    !is_power_of_2(block_size)) {
+		pr_err("Invalid block size %u\n", block_size);
+		brelse(bh);
+		return ERR_PTR(-EINVAL);
+	}
+	if (block_size == sb->s_blocksize)
+		return bh;
+
+	brelse(bh);
+	/* Buffer heads cannot be larger than a page */
+	if (!sb_set_blocksize(sb, block_size)) {
+		pr_err("Unsupported block size %u\n", block_size);
+		return ERR_PTR(-EINVAL);
+	}
+	bh = sb_bread(sb, OUICHEFS_SB_BLOCK_NR);
+	if (!bh)
+		return ERR_PTR(-EIO);
+	return bh;
+}
+
+/*
+ * Checks that this module understands the on-disk format. Unknown
+ * compatible features are ignored, unknown read-only compatible ones only
+ * allow read-only mounts.
+ */
+static int check_features(struct super_block *sb,
+			  struct ouichefs_sb_info *csb)
+{
+	uint32_t unknown;
+
+	if (csb->version != OUICHEFS_VERSION) {
+		pr_err("Unsupported format version %u\n", csb->version);
+		return -EINVAL;
+	}
+	unknown = csb->feature_incompat & ~OUICHEFS_FEATURE_INCOMPAT_SUPP;
+	if (unknown) {
+		pr_err("Unsupported incompatible features %#x\n", unknown);
+		return -EINVAL;
+	}
+	unknown = csb->feature_ro_compat & ~OUICHEFS_FEATURE_RO_COMPAT_SUPP;
+	if (unknown && !sb_rdonly(sb)) {
+		pr_err("Unsupported features %#x, only read-only mounts are possible\n",
+		       unknown);
+		return -EROFS;
+	}
+	unknown = csb->feature_compat & ~OUICHEFS_FEATURE_COMPAT_SUPP;
+	if (unknown)
+		pr_info("Ignoring unknown compatible features %#x\n", unknown);
+	return 0;
+}
+
+/*
+ * Computes the block geometry from the block size. Everything but the number
+ * of inode data entries per block is a power of two.
+ */
+static void set_geometry(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	unsigned int bits = sb->s_blocksize_bits;
+
+	sbi->index_bits = bits - ilog2(sizeof(uint32_t));
+	sbi->index_len = 1U << sbi->index_bits;
+	sbi->meta_bits = bits - ilog2(sizeof(ouichefs_snap_index_t));
+	sbi->meta_len = 1U << sbi->meta_bits;
+	sbi->group_blocks = 1 + sbi->meta_len;
+	sbi->group_blocks_rv = reciprocal_value(sbi->group_blocks);
+	sbi->inode_bits = bits - ilog2(sizeof(struct ouichefs_inode));
+	sbi->ide_per_block = sb->s_blocksize /
+			     sizeof(struct ouichefs_inode_data);
+	sbi->ide_per_block_rv = reciprocal_value(sbi->ide_per_block);
+	sbi->max_subfiles = sb->s_blocksize / sizeof(struct ouichefs_file);
+	sbi->bits_per_block = sb->s_blocksize * BITS_PER_BYTE;
+	sbi->hot_list_len = (sb->s_blocksize -
+			     sizeof(struct ouichefs_hot_list)) /
+			    sizeof(uint32_t);
+	sbi->journal_max_blocks = (sb->s_blocksize -
+				   sizeof(struct ouichefs_journal_header)) /
+				  sizeof(uint32_t);
+
+	/* A file is limited to the blocks its index block can reference */
+	sb->s_maxbytes = (loff_t)sbi->index_len << bits;
+	if (sb->s_maxbytes < SZ_4M)
+		pr_info("Files are limited to %lld KiB with %lu B blocks\n",
+			sb->s_maxbytes >> 10, sb->s_blocksize);
+}
+
 /* Fill the struct superblock from partition superblock */
 int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 {
@@ -279,26 +714,31 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 	struct ouichefs_sb_info *csb = NULL;
 	struct ouichefs_sb_info *sbi = NULL;
 	struct inode *root_inode = NULL;
+	DECLARE_COMPLETION_ONSTACK(bitmaps_read);
+	struct bio *bio = NULL;
 	int ret = 0;
 
 	/* Init sb */
 	sb->s_magic = OUICHEFS_MAGIC;
-	sb_set_blocksize(sb, OUICHEFS_BLOCK_SIZE);
-	sb->s_maxbytes = OUICHEFS_MAX_FILESIZE;
 	sb->s_op = &ouichefs_super_ops;
 	sb->s_time_gran = 1;
 
 	/* Read sb from disk */
-	bh = sb_bread(sb, OUICHEFS_SB_BLOCK_NR);
-	if (!bh)
-		return -EIO;
+	bh = read_disk_sb(sb);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
 	csb = (struct ouichefs_sb_info *)bh->b_data;
 
-	/* Check magic number */
-	if (csb->magic != sb->s_magic) {
-		pr_err("Wrong magic number\n");
+	if (csb->nr_blocks > bdev_nr_bytes(sb->s_bdev) >> sb->s_blocksize_bits) {
+		pr_err("Partition has %u blocks, but the device is smaller\n",
+		       csb->nr_blocks);
 		brelse(bh);
-		return -EPERM;
+		return -EINVAL;
+	}
+	ret = check_features(sb, csb);
+	if (ret) {
+		brelse(bh);
+		return ret;
 	}
 
 	/* Alloc sb_info */
@@ -307,7 +747,25 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 		brelse(bh);
 		return -ENOMEM;
 	}
+	sb->s_fs_info = sbi;
+	set_geometry(sb);
+	ret = ouichefs_stats_init(sb);
+	if (ret) {
+		brelse(bh);
+		goto free_sbi;
+	}
+
+	/* Replay the journal before anything else is read */
 	sbi->nr_blocks = csb->nr_blocks;
+	sbi->journal_start = csb->journal_start;
+	sbi->nr_journal_blocks = csb->nr_journal_blocks;
+	ret = ouichefs_journal_load(sb);
+	if (ret) {
+		pr_err("Failed to load journal: %d\n", ret);
+		brelse(bh);
+		goto free_sbi;
+	}
+
 	sbi->nr_inodes = csb->nr_inodes;
 	sbi->nr_inode_data_entries = csb->nr_inode_data_entries;
 	sbi->nr_istore_blocks = csb->nr_istore_blocks;
@@ -319,36 +777,59 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 	sbi->nr_idfree_blocks = csb->nr_idfree_blocks;
 	sbi->nr_ididx_blocks = csb->nr_ididx_blocks;
 	sbi->nr_meta_blocks = csb->nr_meta_blocks;
+	sbi->hot_list_block = csb->hot_list_block;
+	sbi->block_size = csb->block_size;
+	sbi->version = csb->version;
+	sbi->feature_compat = csb->feature_compat;
+	sbi->feature_ro_compat = csb->feature_ro_compat;
+	sbi->feature_incompat = csb->feature_incompat;
+	sbi->layout = (sbi->feature_incompat & OUICHEFS_FEATURE_INCOMPAT_GROUPS) ?
+			      OUICHEFS_LAYOUT_GROUPS : OUICHEFS_LAYOUT_FLAT;
 	memcpy(sbi->snapshots, csb->snapshots,
 		sizeof(sbi->snapshots));
-	sb->s_fs_info = sbi;
 
 	brelse(bh);
 
-	/* Alloc and copy ifree_bitmap */
-	spin_lock_init(&sbi->ifree_lock);
-	if (load_bitmap(sb, &sbi->ifree_bitmap, sbi->nr_ifree_blocks,
-			OUICHEFS_GET_IFREE_START(sbi)))
-		goto free_sbi;
+	if (OUICHEFS_GET_BFREE_USED(sbi) > sbi->nr_bfree_blocks) {
+		pr_err("Block free bitmap too small for %u blocks\n",
+		       sbi->nr_blocks);
+		ret = -EINVAL;
+		goto release_journal;
+	}
 
-	/* Alloc and copy bfree_bitmap */
-	spin_lock_init(&sbi->bfree_lock);
-	if (load_bitmap(sb, &sbi->bfree_bitmap, sbi->nr_bfree_blocks,
-			OUICHEFS_GET_BFREE_START(sbi)))
-		goto free_ifree;
+	spin_lock_init(&sbi->dstats_lock);
+	ouichefs_reclaim_init(sb);
 
-	/* Alloc and copy idfree_bitmap */
+	spin_lock_init(&sbi->ifree_lock);
+	spin_lock_init(&sbi->bfree_lock);
 	spin_lock_init(&sbi->idfree_lock);
-	if (load_bitmap(sb, &sbi->idfree_bitmap, sbi->nr_idfree_blocks,
-			OUICHEFS_GET_IDFREE_START(sbi)))
-		goto free_bfree;
+	mutex_init(&sbi->idfree_mutex);
+
+	/*
+	 * A read-only mount never allocates anything, so it does without the
+	 * free bitmaps until it is remounted read-write. Otherwise, start
+	 * reading them in large bios and load the root inode while they are
+	 * in flight.
+	 */
+	if (!sb_rdonly(sb)) {
+		ret = alloc_bitmaps(sbi);
+		if (ret)
+			goto release_journal;
+		bio = read_bitmaps(sb);
+		bio->bi_private = &bitmaps_read;
+		bio->bi_end_io = read_bitmap_end_io;
+		submit_bio(bio);
+	}
+
+	/* Warm up the cache with the metadata that was hot last time */
+	ouichefs_hot_init(sb);
 
 	/* Create root inode */
 	root_inode = ouichefs_iget(sb, 1, false);
 	if (IS_ERR(root_inode)) {
 		ret = PTR_ERR(root_inode);
 		pr_warn("Failed to load root inode: %d\n", ret);
-		goto free_idfree;
+		goto wait_bitmaps;
 	}
 	if (!S_ISDIR(root_inode->i_mode)) {
 		ret = -ENOTDIR;
@@ -357,20 +838,35 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 		goto iput;
 	}
 	inode_init_owner(&nop_mnt_idmap, root_inode, NULL, root_inode->i_mode);
+
+	if (bio) {
+		wait_for_completion_io(&bitmaps_read);
+		ret = blk_status_to_errno(bio->bi_status);
+		bio_put(bio);
+		bio = NULL;
+		if (ret) {
+			pr_err("Failed to read free bitmaps: %d\n", ret);
+			goto iput;
+		}
+	}
+
 	sb->s_root = d_make_root(root_inode);
 	if (!sb->s_root) {
 		ret = -ENOMEM;
-		goto iput;
+		goto free_bitmaps;
 	}
 
 	pr_debug("Loaded superblock:\n"
+		 "\tblock_size=%lu\n"
 		 "\tnr_blocks=%u\n"
 		 "\tnr_inodes=%u (istore=%u blocks)\n"
 		 "\tnr_inode_data_entries=%u (ididx=%u blocks)\n"
 		 "\tnr_ifree_blocks=%u\n"
 		 "\tnr_bfree_blocks=%u\n"
 		 "\tnr_idfree_blocks=%u\n"
-		 "\tnr_meta_blocks=%u\n"
+		 "\tversion=%u (features=%#x/%#x/%#x)\n"
+		 "\tnr_meta_blocks=%u (layout=%u)\n"
+		 "\tnr_journal_blocks=%u (start=%u)\n"
 		 "\tnr_free_inodes=%u\n"
 		 "\tnr_free_blocks=%u\n"
 		 "\tnr_free_inode_data_entries=%u\n"
@@ -379,30 +875,42 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 		 "\tBFREE_START=%u\n"
 		 "\tMETA_START=%u\n"
 		 "\tDATA_START=%u\n",
-		 sbi->nr_blocks, sbi->nr_inodes, sbi->nr_istore_blocks,
+		 sb->s_blocksize, sbi->nr_blocks, sbi->nr_inodes,
+		 sbi->nr_istore_blocks,
 		 sbi->nr_inode_data_entries, sbi->nr_ididx_blocks,
 		 sbi->nr_ifree_blocks, sbi->nr_bfree_blocks,
-		 sbi->nr_idfree_blocks, sbi->nr_meta_blocks,
+		 sbi->nr_idfree_blocks, sbi->version, sbi->feature_compat,
+		 sbi->feature_ro_compat, sbi->feature_incompat,
+		 sbi->nr_meta_blocks, sbi->layout,
+		 sbi->nr_journal_blocks, sbi->journal_start,
 		 sbi->nr_free_inodes, sbi->nr_free_blocks,
 		 sbi->nr_free_inode_data_entries,
-		 OUICHEFS_GET_INODE_BLOCK(0), OUICHEFS_GET_IFREE_START(sbi),
+		 OUICHEFS_GET_INODE_BLOCK(sbi, 0), OUICHEFS_GET_IFREE_START(sbi),
 		 OUICHEFS_GET_BFREE_START(sbi),
 		 OUICHEFS_GET_META_BLOCK(OUICHEFS_GET_DATA_START(sbi) + 1, sbi),
 		 OUICHEFS_GET_DATA_START(sbi)
 	);
+	ouichefs_debugfs_register(sb);
 
 	return 0;
 
 iput:
 	iput(root_inode);
-free_idfree:
-	kfree(sbi->idfree_bitmap);
-free_bfree:
-	kfree(sbi->bfree_bitmap);
-free_ifree:
-	kfree(sbi->ifree_bitmap);
+wait_bitmaps:
+	/* The reads must be done before their buffers are freed */
+	if (bio) {
+		wait_for_completion_io(&bitmaps_read);
+		bio_put(bio);
+	}
+free_bitmaps:
+	ouichefs_hot_release(sb);
+	free_bitmaps(sbi);
+release_journal:
+	ouichefs_journal_release(sb);
 free_sbi:
+	ouichefs_stats_release(sb);
 	kfree(sbi);
+	sb->s_fs_info = NULL;
 
 	return ret;
 }